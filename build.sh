@@ -1,2 +1,24 @@
 #!/bin/bash
-gcc -Wall -Werror src/*.c -o build/a.out
+set -e
+
+# the regex engine, built as a library of its own (see "Library" in README.md)
+LIB_SRCS="src/analyze.c src/ast.c src/bitnfa.c src/compile.c src/debug.c src/dfa.c src/emit.c src/match.c src/pattern.c src/pike.c src/repition.c src/simulate.c src/trigram.c src/utf8.c src/util.c"
+# the command line tool built on top of it
+CLI_SRCS="src/main.c src/search.c src/walk.c src/input.c src/reader.c src/report.c src/server.c src/index.c src/follow.c"
+
+# zstd support is optional: only build it in if the library is installed
+ZSTD=""
+if echo '#include <zstd.h>' | gcc -E - > /dev/null 2>&1; then
+    ZSTD="-DHAVE_ZSTD -lzstd"
+fi
+
+mkdir -p build/lib
+rm -f build/lib/*.o
+for src in $LIB_SRCS; do
+    gcc -Wall -Werror -O2 -fPIC -c $src -o build/lib/$(basename $src .c).o
+done
+rm -f build/libmygrep.a
+ar rcs build/libmygrep.a build/lib/*.o
+gcc -shared build/lib/*.o -o build/libmygrep.so
+
+gcc -Wall -Werror -O2 $CLI_SRCS build/libmygrep.a -o build/a.out -pthread -lz $ZSTD
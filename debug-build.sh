@@ -1,2 +1,7 @@
 #!/bin/bash
-gcc -Wall -Werror src/*.c -o build/debug.out -DDEBUG
+# zstd support is optional: only build it in if the library is installed
+ZSTD=""
+if echo '#include <zstd.h>' | gcc -E - > /dev/null 2>&1; then
+    ZSTD="-DHAVE_ZSTD -lzstd"
+fi
+gcc -Wall -Werror src/*.c -o build/debug.out -DDEBUG -pthread -lz $ZSTD
@@ -0,0 +1,274 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "regex.h"
+#include "pattern.h"
+#include "util.h"
+
+//
+// This file contains the analysis of a compiled NFA that lets matching stop early:
+// which nodes can never lead to a match (dead), and which already guarantee one (sure).
+// It also finds which edges are worth trying on ASCII input, and which are empty,
+// and which bytes no edge can tell apart.
+//
+
+// Fill `closure` with `node` and every node reachable from it by empty edges
+// `marks` must be all false, and is left that way. Returns the size of the closure
+size_t node_closure(const Node* node, const Node** closure, bool* marks) {
+    size_t num = 0;
+    closure[num++] = node;
+    marks[node->id] = true;
+    for (size_t i = 0; i < num; ++i) {
+        const Node* n = closure[i];
+        for (size_t j = 0; j < n->num_edges; ++j) {
+            const Edge* e = &n->edges[j];
+            if (pat_size(&e->pat) == 0 && !marks[e->target->id]) {
+                marks[e->target->id] = true;
+                closure[num++] = e->target;
+            }
+        }
+    }
+    for (size_t i = 0; i < num; ++i) {
+        marks[closure[i]->id] = false;
+    }
+    return num;
+}
+
+// A node is dead if no accepting node can be reached from it.
+// These are found by walking the reversed edges back from every accepting node: whatever we never reach is dead
+void find_dead_nodes(Regex* regex) {
+    const Node** stack = alloc_or_die(regex->num_nodes, sizeof(Node*));
+    size_t num_stack = 0;
+    for (size_t i = 0; i < regex->num_nodes; ++i) {
+        Node* n = regex->nodes[i];
+        n->dead = !n->accepts;
+        if (n->accepts) {
+            stack[num_stack++] = n;
+        }
+    }
+    while (num_stack > 0) {
+        const Node* n = stack[--num_stack];
+        for (size_t i = 0; i < n->num_rev_edges; ++i) {
+            Node* source = n->rev_edges[i].target;
+            if (source->dead) {
+                source->dead = false;
+                stack[num_stack++] = source;
+            }
+        }
+    }
+    free(stack);
+}
+
+// A set of byte classes (see `find_byte_classes`), one bit per class
+typedef struct {
+    uint64_t bits[4];
+} ClassSet;
+
+// Add the nodes that reach `node` by empty edges to the back of `queue` (from `*num` on),
+// unless `marks` says they are already in it
+void push_empty_sources(const Node* node, const Node** queue, size_t* num, bool* marks) {
+    for (size_t i = 0; i < node->num_rev_edges; ++i) {
+        const Edge* e = &node->rev_edges[i];
+        if (pat_size(&e->pat) == 0 && !marks[e->target->id]) {
+            marks[e->target->id] = true;
+            queue[(*num)++] = e->target;
+        }
+    }
+}
+
+// A node is sure if being in it means the input is accepted, no matter what comes next:
+// it accepts if the input stops here, and whatever byte comes next leads to another sure node.
+// We start by assuming every node that accepts (through empty edges) is sure,
+// and rule nodes out until nothing changes.
+// Each round works out, for every node, which classes of bytes lead from it (through empty edges) to a sure node,
+// by passing those sets back along the reversed empty edges, rather than following every node's closure on its own.
+// So a round takes time in proportion to the size of the NFA, and there are only more rounds
+// when ruling out a node rules out others that led to it
+void find_sure_nodes(Regex* regex) {
+    size_t num_nodes = regex->num_nodes;
+    const Node** queue = alloc_or_die(num_nodes, sizeof(Node*));
+    bool* marks = alloc_or_die(num_nodes, sizeof(bool));
+    ClassSet* covered = alloc_or_die(num_nodes, sizeof(ClassSet));
+
+    // the classes each consuming edge matches, looked up by one byte of each class
+    int class_byte[256];
+    for (int ch = 255; ch >= 0; --ch) {
+        class_byte[regex->byte_class[ch]] = ch;
+    }
+    ClassSet all = { { 0 } };
+    for (size_t c = 0; c < regex->num_classes; ++c) {
+        all.bits[c / 64] |= (uint64_t)1 << (c % 64);
+    }
+    size_t* first_edge = alloc_or_die(num_nodes + 1, sizeof(size_t));
+    for (size_t i = 0; i < num_nodes; ++i) {
+        first_edge[i + 1] = first_edge[i] + regex->nodes[i]->num_edges;
+    }
+    ClassSet* edge_classes = alloc_or_die(first_edge[num_nodes], sizeof(ClassSet));
+    for (size_t i = 0; i < num_nodes; ++i) {
+        const Node* n = regex->nodes[i];
+        for (size_t j = 0; j < n->num_edges; ++j) {
+            const Pattern* pat = &n->edges[j].pat;
+            ClassSet* classes = &edge_classes[first_edge[i] + j];
+            for (size_t c = 0; pat_size(pat) > 0 && c < regex->num_classes; ++c) {
+                if (pattern_matches(pat, (char)class_byte[c])) {
+                    classes->bits[c / 64] |= (uint64_t)1 << (c % 64);
+                }
+            }
+        }
+    }
+
+    // the nodes that reach an accepting node by empty edges
+    size_t num = 0;
+    for (size_t i = 0; i < num_nodes; ++i) {
+        Node* n = regex->nodes[i];
+        n->sure = false;
+        if (n->accepts) {
+            marks[n->id] = true;
+            queue[num++] = n;
+        }
+    }
+    for (size_t i = 0; i < num; ++i) {
+        push_empty_sources(queue[i], queue, &num, marks);
+    }
+    for (size_t i = 0; i < num; ++i) {
+        ((Node*)queue[i])->sure = true;
+        marks[queue[i]->id] = false;
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        // the classes that each node's own edges take to a sure node
+        num = 0;
+        for (size_t i = 0; i < num_nodes; ++i) {
+            const Node* n = regex->nodes[i];
+            covered[n->id] = (ClassSet){ { 0 } };
+            for (size_t j = 0; j < n->num_edges; ++j) {
+                if (n->edges[j].target->sure) {
+                    for (int w = 0; w < 4; ++w) {
+                        covered[n->id].bits[w] |= edge_classes[first_edge[i] + j].bits[w];
+                    }
+                }
+            }
+            marks[n->id] = true;
+            queue[num++] = n;
+        }
+        // and through empty edges, those of every node they lead to.
+        // A node is queued again whenever its set grows, which happens at most once per class
+        size_t beg = 0;
+        while (num > 0) {
+            const Node* n = queue[beg];
+            beg = (beg + 1) % num_nodes;
+            --num;
+            marks[n->id] = false;
+            for (size_t i = 0; i < n->num_rev_edges; ++i) {
+                const Edge* e = &n->rev_edges[i];
+                if (pat_size(&e->pat) > 0) {
+                    continue;
+                }
+                ClassSet* source = &covered[e->target->id];
+                bool grew = false;
+                for (int w = 0; w < 4; ++w) {
+                    uint64_t merged = source->bits[w] | covered[n->id].bits[w];
+                    grew |= merged != source->bits[w];
+                    source->bits[w] = merged;
+                }
+                if (grew && !marks[e->target->id]) {
+                    marks[e->target->id] = true;
+                    queue[(beg + num) % num_nodes] = e->target;
+                    ++num;
+                }
+            }
+        }
+        for (size_t i = 0; i < num_nodes; ++i) {
+            Node* n = regex->nodes[i];
+            if (n->sure && memcmp(&covered[n->id], &all, sizeof(ClassSet)) != 0) {
+                n->sure = false;
+                changed = true;
+            }
+        }
+    }
+    free(edge_classes);
+    free(first_edge);
+    free(covered);
+    free(marks);
+    free(queue);
+}
+
+// Collect the edges of each node that are empty, and those that consume at least one ASCII byte
+void find_edge_lists(Regex* regex) {
+    for (size_t i = 0; i < regex->num_nodes; ++i) {
+        Node* n = regex->nodes[i];
+        n->ascii_edges = alloc_or_die(n->num_edges, sizeof(Edge*));
+        n->num_ascii_edges = 0;
+        n->empty_edges = alloc_or_die(n->num_edges, sizeof(Edge*));
+        n->num_empty_edges = 0;
+        for (size_t j = 0; j < n->num_edges; ++j) {
+            const Edge* e = &n->edges[j];
+            if (pat_size(&e->pat) == 0) {
+                n->empty_edges[n->num_empty_edges++] = e;
+                continue;
+            }
+            for (int ch = 0; ch < 0x80; ++ch) {
+                if (pattern_matches(&e->pat, (char)ch)) {
+                    n->ascii_edges[n->num_ascii_edges++] = e;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// Split the 256 bytes into classes, such that every edge matches either all of a class or none of it.
+// We start with one class, and split each class in two by each pattern in turn:
+// the bytes the pattern matches, and the bytes it does not
+void find_byte_classes(Regex* regex) {
+    int byte_class[256] = { 0 };
+    int num_classes = 1;
+    for (size_t i = 0; i < regex->num_nodes; ++i) {
+        const Node* n = regex->nodes[i];
+        for (size_t j = 0; j < n->num_edges; ++j) {
+            const Pattern* pat = &n->edges[j].pat;
+            if (pat_size(pat) == 0) {
+                continue;
+            }
+            // where the matching part of each old class goes, if it has been split off yet
+            int split_to[256];
+            for (int c = 0; c < num_classes; ++c) {
+                split_to[c] = -1;
+            }
+            // a class that is matched all or nothing stays whole:
+            // only split off the bytes that differ from the first byte seen in their class
+            bool first_matches[256];
+            bool seen[256] = { false };
+            for (int ch = 0; ch < 256; ++ch) {
+                int c = byte_class[ch];
+                bool matches = pattern_matches(pat, (char)ch);
+                if (!seen[c]) {
+                    seen[c] = true;
+                    first_matches[c] = matches;
+                } else if (matches != first_matches[c]) {
+                    if (split_to[c] < 0) {
+                        split_to[c] = num_classes++;
+                    }
+                    byte_class[ch] = split_to[c];
+                }
+            }
+        }
+    }
+    for (int ch = 0; ch < 256; ++ch) {
+        regex->byte_class[ch] = byte_class[ch];
+    }
+    regex->num_classes = num_classes;
+}
+
+void analyze_nodes(Regex* regex) {
+    find_dead_nodes(regex);
+    // sure nodes are found a class of bytes at a time
+    find_byte_classes(regex);
+    find_sure_nodes(regex);
+    find_edge_lists(regex);
+}
@@ -0,0 +1,394 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ast.h"
+#include "util.h"
+
+//
+// This file parses a regex into a tree once, and simplifies the tree before the compiler turns it into an NFA.
+// The compiler used to build nodes straight from the string, parsing the body of a group again for each repitition,
+// which left nowhere to simplify anything (and no way to tell which `)` closed which group).
+//
+
+// A new tree node of `type`, with no children
+Ast* make_ast(enum AstType type) {
+    Ast* ast = alloc_or_die(1, sizeof(Ast));
+    ast->type = type;
+    ast->pat = EMPTY_PATTERN;
+    return ast;
+}
+
+void push_child(Ast* parent, Ast* child) {
+    if (parent->num_children >= parent->cap_children) {
+        size_t new_cap = 2 * parent->cap_children;
+        if (new_cap == 0) {
+            new_cap = 1;
+        }
+        Ast** new_children = realloc(parent->children, sizeof(Ast*) * new_cap);
+        if (!new_children) {
+            out_of_memory();
+        }
+        parent->children = new_children;
+        parent->cap_children = new_cap;
+    }
+    parent->children[parent->num_children++] = child;
+}
+
+void destroy_ast(Ast* ast) {
+    for (size_t i = 0; i < ast->num_children; ++i) {
+        destroy_ast(ast->children[i]);
+    }
+    free(ast->children);
+    destroy_pat(&ast->pat);
+    free(ast);
+}
+
+// Replace `*ast` by its only child, freeing the rest of it
+void replace_by_child(Ast** ast) {
+    Ast* child = (*ast)->children[0];
+    (*ast)->num_children = 0;
+    destroy_ast(*ast);
+    *ast = child;
+}
+
+// =================================================================================
+//                                  Parsing
+// =================================================================================
+
+// Parse the body of a capturing group, just after its `(`, up to and including its `)`
+bool parse_group(Ast** ast, const char** str, bool utf8, size_t* num_groups) {
+    Ast* group = make_ast(AST_GROUP);
+    // groups are numbered in the order they open, so an outer group comes before the groups inside it
+    group->group = (*num_groups)++;
+    Ast* body;
+    if (!parse_ast(&body, str, utf8, num_groups)) {
+        destroy_ast(group);
+        return false;
+    }
+    push_child(group, body);
+    if (**str != ')') {
+        fprintf(error_output(), "ERROR: unclosed ( ) capturing group. expected closing `)`, found %s\n",
+                **str ? *str : "end of input");
+        destroy_ast(group);
+        return false;
+    }
+    ++*str;
+    *ast = group;
+    return true;
+}
+
+bool parse_ast(Ast** ast, const char** str, bool utf8, size_t* num_groups) {
+    Ast* seq = make_ast(AST_CONCAT);
+    while (**str != '\0' && **str != ')') {
+        if (**str == '$' && *(*str + 1) == '\0') {
+            break;
+        }
+        Ast* item;
+        if (**str == '(') {
+            ++*str;
+            if (!parse_group(&item, str, utf8, num_groups)) {
+                destroy_ast(seq);
+                return false;
+            }
+        } else {
+            item = make_ast(AST_PATTERN);
+            if (!parse_pattern(&item->pat, str, utf8)) {
+                destroy_ast(item);
+                destroy_ast(seq);
+                return false;
+            }
+        }
+        Repition rep;
+        if (!parse_repition(&rep, str)) {
+            destroy_ast(item);
+            destroy_ast(seq);
+            return false;
+        }
+        if (rep.lower_bound != 1 || rep.upper_bound != 1 || rep.is_unbounded) {
+            Ast* repeat = make_ast(AST_REPEAT);
+            repeat->rep = rep;
+            push_child(repeat, item);
+            item = repeat;
+        }
+        push_child(seq, item);
+    }
+    *ast = seq;
+    return true;
+}
+
+// =================================================================================
+//                               Simplifying
+// =================================================================================
+
+// Replace every capture group by what is inside it
+void strip_groups(Ast** ast) {
+    for (size_t i = 0; i < (*ast)->num_children; ++i) {
+        strip_groups(&(*ast)->children[i]);
+    }
+    if ((*ast)->type == AST_GROUP) {
+        replace_by_child(ast);
+    }
+}
+
+// Returns true if `ast` is one pattern, repeated some number of times (maybe just once),
+// setting `*pat` to the pattern and `*rep` to how many times
+bool as_repeated_pattern(const Ast* ast, const Pattern** pat, Repition* rep) {
+    if (ast->type == AST_PATTERN) {
+        *pat = &ast->pat;
+        rep->lower_bound = 1;
+        rep->upper_bound = 1;
+        rep->is_unbounded = false;
+        return true;
+    }
+    if (ast->type == AST_REPEAT && ast->children[0]->type == AST_PATTERN) {
+        *pat = &ast->children[0]->pat;
+        *rep = ast->rep;
+        return true;
+    }
+    return false;
+}
+
+// Returns true if `a` then `b` is the same as one repitition of their pattern, setting `*merged` to it
+// (`a*a*` is `a*`, `a{2}a?` is `a{2,3}`)
+bool merge_repeats(const Ast* a, const Ast* b, Repition* merged) {
+    const Pattern* pat_a;
+    const Pattern* pat_b;
+    Repition rep_a, rep_b;
+    if (!as_repeated_pattern(a, &pat_a, &rep_a) || !as_repeated_pattern(b, &pat_b, &rep_b) || !pats_equal(pat_a, pat_b)) {
+        return false;
+    }
+    merged->lower_bound = rep_a.lower_bound + rep_b.lower_bound;
+    merged->is_unbounded = rep_a.is_unbounded || rep_b.is_unbounded;
+    merged->upper_bound = merged->is_unbounded ? -1 : rep_a.upper_bound + rep_b.upper_bound;
+    // (bounds this large could never be compiled anyway, but should not wrap around)
+    return merged->lower_bound >= rep_a.lower_bound
+        && (merged->is_unbounded || merged->upper_bound >= rep_a.upper_bound);
+}
+
+// Returns true if repeating something `inner` times, `outer` times, is the same as repeating it some number of times,
+// setting `*merged` to that number (`(x+)*` is `x*`, `(x{2}){3}` is `x{6}`)
+bool merge_nested_repeats(Repition outer, Repition inner, Repition* merged) {
+    if (outer.is_unbounded && inner.lower_bound <= 1 && (inner.is_unbounded || inner.upper_bound >= 1)) {
+        // every count from the least on can be made up of inner repititions
+        merged->lower_bound = outer.lower_bound * inner.lower_bound;
+        merged->upper_bound = -1;
+        merged->is_unbounded = true;
+        return true;
+    }
+    if (!outer.is_unbounded && outer.lower_bound == 0 && outer.upper_bound == 1
+        && inner.is_unbounded && inner.lower_bound <= 1)
+    {
+        merged->lower_bound = 0;
+        merged->upper_bound = -1;
+        merged->is_unbounded = true;
+        return true;
+    }
+    if (!outer.is_unbounded && !inner.is_unbounded
+        && outer.lower_bound == outer.upper_bound && inner.lower_bound == inner.upper_bound
+        && (inner.lower_bound == 0 || outer.lower_bound <= (unsigned int)-1 / inner.lower_bound))
+    {
+        merged->lower_bound = outer.lower_bound * inner.lower_bound;
+        merged->upper_bound = merged->lower_bound;
+        merged->is_unbounded = false;
+        return true;
+    }
+    return false;
+}
+
+// Simplify the children of a concatenation: splice in the children of concatenations inside it,
+// and merge neighboring repititions of the same pattern
+void simplify_concat(Ast* ast) {
+    Ast** children = ast->children;
+    size_t num_children = ast->num_children;
+    ast->children = NULL;
+    ast->num_children = 0;
+    ast->cap_children = 0;
+    for (size_t i = 0; i < num_children; ++i) {
+        Ast* child = children[i];
+        if (child->type == AST_CONCAT) {
+            // (already simplified, so there are no concatenations inside it)
+            for (size_t j = 0; j < child->num_children; ++j) {
+                push_child(ast, child->children[j]);
+            }
+            child->num_children = 0;
+            destroy_ast(child);
+            continue;
+        }
+        Repition merged;
+        if (ast->num_children > 0 && merge_repeats(ast->children[ast->num_children - 1], child, &merged)) {
+            Ast* last = ast->children[ast->num_children - 1];
+            if (last->type == AST_PATTERN) {
+                Ast* repeat = make_ast(AST_REPEAT);
+                push_child(repeat, last);
+                ast->children[ast->num_children - 1] = repeat;
+                last = repeat;
+            }
+            last->rep = merged;
+            if (merged.lower_bound == 1 && merged.upper_bound == 1 && !merged.is_unbounded) {
+                // (as when `a{0}` meets `a`)
+                replace_by_child(&ast->children[ast->num_children - 1]);
+            }
+            destroy_ast(child);
+            continue;
+        }
+        push_child(ast, child);
+    }
+    free(children);
+}
+
+// Simplify the tree at `*ast`, from its leaves up, replacing it if need be
+void simplify_ast(Ast** ast) {
+    for (size_t i = 0; i < (*ast)->num_children; ++i) {
+        simplify_ast(&(*ast)->children[i]);
+    }
+    Ast* a = *ast;
+    switch (a->type) {
+        case AST_PATTERN:
+            if (a->pat.type == PAT_SET && a->pat.num_sub_pats == 1) {
+                // a set of one pattern is that pattern
+                Pattern only = copy_pat(&a->pat.sub_pats[0]);
+                destroy_pat(&a->pat);
+                a->pat = only;
+            }
+            break;
+        case AST_CONCAT:
+            simplify_concat(a);
+            if (a->num_children == 1) {
+                replace_by_child(ast);
+            }
+            break;
+        case AST_REPEAT: {
+            Repition merged;
+            Ast* child = a->children[0];
+            if (child->type == AST_REPEAT && merge_nested_repeats(a->rep, child->rep, &merged)) {
+                child->rep = merged;
+                replace_by_child(ast);
+                a = *ast;
+            }
+            if (a->type == AST_REPEAT && a->rep.lower_bound == 1 && a->rep.upper_bound == 1 && !a->rep.is_unbounded) {
+                replace_by_child(ast);
+            }
+            break;
+        }
+        case AST_GROUP:
+            break;
+    }
+}
+
+void optimize_ast(Ast** ast, bool keep_groups) {
+    if (!keep_groups) {
+        strip_groups(ast);
+    }
+    simplify_ast(ast);
+}
+
+// =================================================================================
+//                             Hoisting literals
+// =================================================================================
+
+// The literal bytes found one after the other so far, and the longest run of them yet
+typedef struct {
+    char* run;
+    size_t run_len;
+    size_t run_cap;
+    char* best;
+    size_t best_len;
+} LiteralRuns;
+
+void push_literal(LiteralRuns* runs, char ch) {
+    if (runs->run_len >= runs->run_cap) {
+        size_t new_cap = runs->run_cap == 0 ? 16 : 2 * runs->run_cap;
+        char* new_run = realloc(runs->run, new_cap);
+        if (!new_run) {
+            out_of_memory();
+        }
+        runs->run = new_run;
+        runs->run_cap = new_cap;
+    }
+    runs->run[runs->run_len++] = ch;
+}
+
+// Something that is not a literal byte comes next, so the current run is over
+void end_run(LiteralRuns* runs) {
+    if (runs->run_len > runs->best_len) {
+        free(runs->best);
+        runs->best = copy_between(runs->run, runs->run + runs->run_len);
+        runs->best_len = runs->run_len;
+    }
+    runs->run_len = 0;
+}
+
+// Add the literal bytes that every match of `ast` has one after the other to `runs`
+void find_literal_runs(const Ast* ast, LiteralRuns* runs) {
+    switch (ast->type) {
+        case AST_PATTERN:
+            if (ast->pat.type == PAT_LITERAL) {
+                push_literal(runs, ast->pat.literal);
+            } else {
+                end_run(runs);
+            }
+            break;
+        case AST_CONCAT:
+        case AST_GROUP:
+            for (size_t i = 0; i < ast->num_children; ++i) {
+                find_literal_runs(ast->children[i], runs);
+            }
+            break;
+        case AST_REPEAT: {
+            const Ast* child = ast->children[0];
+            const Repition* rep = &ast->rep;
+            if (child->type == AST_PATTERN && child->pat.type == PAT_LITERAL
+                && !rep->is_unbounded && rep->lower_bound == rep->upper_bound)
+            {
+                for (unsigned int i = 0; i < rep->lower_bound; ++i) {
+                    push_literal(runs, child->pat.literal);
+                }
+                break;
+            }
+            end_run(runs);
+            if (rep->lower_bound > 0) {
+                // what is inside is matched at least once, but not next to what is outside
+                find_literal_runs(child, runs);
+                end_run(runs);
+            }
+            break;
+        }
+    }
+}
+
+char* required_literal(const Ast* ast, size_t* len) {
+    LiteralRuns runs = { NULL, 0, 0, NULL, 0 };
+    find_literal_runs(ast, &runs);
+    end_run(&runs);
+    free(runs.run);
+    *len = runs.best_len;
+    return runs.best;
+}
+
+void debug_ast(const Ast* ast, int depth) {
+    printf("%*s", 4 * depth, "");
+    switch (ast->type) {
+        case AST_PATTERN:
+            debug_pat(&ast->pat);
+            break;
+        case AST_CONCAT:
+            printf("CONCAT");
+            break;
+        case AST_GROUP:
+            printf("GROUP %ld", ast->group);
+            break;
+        case AST_REPEAT:
+            if (ast->rep.is_unbounded) {
+                printf("REPEAT {%u,}", ast->rep.lower_bound);
+            } else {
+                printf("REPEAT {%u,%u}", ast->rep.lower_bound, ast->rep.upper_bound);
+            }
+            break;
+    }
+    printf("\n");
+    for (size_t i = 0; i < ast->num_children; ++i) {
+        debug_ast(ast->children[i], depth + 1);
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef __ast_h__
+#define __ast_h__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "pattern.h"
+#include "repition.h"
+
+// What kind of piece of the regex an Ast is
+enum AstType {
+    // one byte (or character, in UTF-8 mode) that matches `pat`
+    AST_PATTERN,
+    // every child, one after the other
+    AST_CONCAT,
+    // the only child, captured as group `group`
+    AST_GROUP,
+    // the only child, repeated as `rep` says
+    AST_REPEAT,
+};
+
+typedef struct Ast_s Ast;
+
+// The parsed regex, as a tree
+struct Ast_s {
+    enum AstType type;
+    // If we are an AST_PATTERN
+    Pattern pat;
+    // If we are an AST_REPEAT
+    Repition rep;
+    // If we are an AST_GROUP, which capture group (1 and up: 0 is the whole match)
+    size_t group;
+    // dynamically allocated array of owned children: any number for AST_CONCAT, exactly one otherwise
+    Ast** children;
+    size_t num_children;
+    size_t cap_children;
+};
+
+// Parse a sequence of patterns and groups from `*str`, into a newly allocated tree at `*ast`
+// Stops at the end of the string, a `)` that closes no group, or a `$` that ends the string,
+// leaving `*str` there. Groups are numbered in the order they open, after the first `*num_groups`,
+// which is updated to count them.
+// In UTF-8 mode (`utf8` set), a character that takes more than one byte is parsed as one pattern
+// Returns false (and prints a message to stderr) if the regex is malformed
+bool parse_ast(Ast** ast, const char** str, bool utf8, size_t* num_groups);
+
+// Rewrite `*ast` into a simpler tree that matches the same inputs:
+// adjacent repetitions of the same pattern are merged (`a*a*` is `a*`, `aa?` is `a{1,2}`), sets of one pattern
+// become that pattern, and nested concatenations and repetitions are flattened.
+// Unless `keep_groups` is set, the capture groups are removed first, which leaves more to simplify.
+// Captures that are kept are not changed
+void optimize_ast(Ast** ast, bool keep_groups);
+
+// Returns the longest run of literal bytes that every match of `ast` contains (dynamically allocated),
+// setting `*len` to its length, or NULL if there is none
+char* required_literal(const Ast* ast, size_t* len);
+
+// Prints a debug report to stdout
+void debug_ast(const Ast* ast, int depth);
+
+// Frees the tree, including the pointer itself
+void destroy_ast(Ast* ast);
+
+#endif
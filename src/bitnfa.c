@@ -0,0 +1,197 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "regex.h"
+#include "pattern.h"
+#include "util.h"
+
+//
+// This file contains the bit-parallel engine, for patterns small enough that the whole NFA fits in one 64-bit word.
+//
+// The compiled NFA is turned into its Glushkov automaton: there is a position for each consuming edge of the pattern,
+// and being in a position means the last byte read was consumed by that edge.
+// There are no empty edges left, so reading a byte is
+//
+//      active = (follow(active) | first) & byte_mask[byte]
+//
+// where `first` are the positions that can begin a match, and byte_mask[b] the positions whose edge matches `b`.
+// Positions are numbered along the pattern, so most of `follow` is a shift by one;
+// what is left over is looked up a byte of the word at a time.
+//
+
+// Fill `positions` with the consuming edges of the pattern proper (not the input around it), in the order they
+// are reached from `regex->start`, which is mostly the order they appear in the pattern.
+// Returns how many there are, stopping early once there are more than BIT_NFA_MAX_POSITIONS
+size_t find_positions(const Regex* regex, const Edge** positions) {
+    const Node** queue = alloc_or_die(regex->num_nodes, sizeof(Node*));
+    bool* seen = alloc_or_die(regex->num_nodes, sizeof(bool));
+    size_t num_queue = 0;
+    size_t num_positions = 0;
+    queue[num_queue++] = regex->start;
+    seen[regex->start->id] = true;
+    for (size_t i = 0; i < num_queue && num_positions <= BIT_NFA_MAX_POSITIONS; ++i) {
+        const Node* n = queue[i];
+        for (size_t j = 0; j < n->num_edges && num_positions <= BIT_NFA_MAX_POSITIONS; ++j) {
+            const Edge* e = &n->edges[j];
+            if (e->target == regex->tail || e->target == regex->trap) {
+                // the input after the match
+                continue;
+            }
+            if (pat_size(&e->pat) > 0) {
+                positions[num_positions++] = e;
+            }
+            if (!seen[e->target->id]) {
+                seen[e->target->id] = true;
+                queue[num_queue++] = e->target;
+            }
+        }
+    }
+    free(queue);
+    free(seen);
+    return num_positions;
+}
+
+// Returns the positions that can be taken next from `node`, and sets `*accepts` if the pattern can end there
+uint64_t positions_after(const Regex* regex, const Node* node, const Edge** positions, size_t num_positions,
+                         const Node** closure, bool* marks, bool* accepts)
+{
+    uint64_t after = 0;
+    *accepts = false;
+    size_t num = node_closure(node, closure, marks);
+    for (size_t i = 0; i < num; ++i) {
+        if (closure[i] == regex->final) {
+            *accepts = true;
+        }
+        for (size_t p = 0; p < num_positions; ++p) {
+            // (edges are kept inside their node, so this is one of its edges if the address is in range)
+            if (positions[p] >= closure[i]->edges && positions[p] < closure[i]->edges + closure[i]->num_edges) {
+                after |= (uint64_t)1 << p;
+            }
+        }
+    }
+    return after;
+}
+
+void build_bit_nfa(Regex* regex) {
+    regex->bits = NULL;
+    const Edge** positions = alloc_or_die(BIT_NFA_MAX_POSITIONS + 1, sizeof(Edge*));
+    size_t num_positions = find_positions(regex, positions);
+    if (num_positions > BIT_NFA_MAX_POSITIONS) {
+        free(positions);
+        return;
+    }
+
+    BitNfa* bits = alloc_or_die(1, sizeof(BitNfa));
+    bits->num_positions = num_positions;
+    bits->anchored_beg = regex->anchored_beg;
+    bits->anchored_end = regex->anchored_end;
+    const Node** closure = alloc_or_die(regex->num_nodes, sizeof(Node*));
+    bool* marks = alloc_or_die(regex->num_nodes, sizeof(bool));
+    bits->first = positions_after(regex, regex->start, positions, num_positions, closure, marks, &bits->nullable);
+
+    // what follows each position, besides the next one
+    uint64_t extra[BIT_NFA_MAX_POSITIONS];
+    for (size_t p = 0; p < num_positions; ++p) {
+        uint64_t bit = (uint64_t)1 << p;
+        bool accepts;
+        uint64_t follow = positions_after(regex, positions[p]->target, positions, num_positions, closure, marks, &accepts);
+        if (accepts) {
+            bits->last |= bit;
+        }
+        if (follow & (bit << 1)) {
+            bits->shift |= bit;
+        }
+        extra[p] = follow & ~(bit << 1);
+        for (int ch = 0; ch < 256; ++ch) {
+            if (pattern_matches(&positions[p]->pat, (char)ch)) {
+                bits->byte_mask[ch] |= bit;
+            }
+        }
+    }
+    free(closure);
+    free(marks);
+    for (int ch = 0; ch < 256; ++ch) {
+        bits->num_first_bytes += (bits->byte_mask[ch] & bits->first) != 0;
+    }
+
+    // a table for each byte of the word that has a position with extra follows
+    for (size_t k = 0; 8 * k < num_positions; ++k) {
+        bool any = false;
+        for (size_t p = 8 * k; p < 8 * k + 8 && p < num_positions; ++p) {
+            any = any || extra[p] != 0;
+        }
+        if (any) {
+            bits->chunks[bits->num_chunks++] = k;
+        }
+    }
+    bits->follow = alloc_or_die(bits->num_chunks * 256, sizeof(uint64_t));
+    for (size_t i = 0; i < bits->num_chunks; ++i) {
+        size_t k = bits->chunks[i];
+        for (int b = 0; b < 256; ++b) {
+            uint64_t follow = 0;
+            for (size_t j = 0; j < 8 && 8 * k + j < num_positions; ++j) {
+                if (b & (1 << j)) {
+                    follow |= extra[8 * k + j];
+                }
+            }
+            bits->follow[i * 256 + b] = follow;
+        }
+    }
+    free(positions);
+    regex->bits = bits;
+}
+
+void destroy_bit_nfa(const BitNfa* bits) {
+    if (bits) {
+        free(bits->follow);
+        free((BitNfa*)bits);
+    }
+}
+
+bool prefers_match_bits(const Regex* regex) {
+    // (beyond these, the Dfa's one lookup a byte is quicker)
+    return regex->bits && regex->bits->num_chunks <= 1 && regex->bits->num_first_bytes < 32;
+}
+
+bool match_bits(const BitNfa* bits, const char* buf, size_t len) {
+    if (bits->nullable && !bits->anchored_end) {
+        // the empty match is everywhere
+        return true;
+    }
+    const unsigned char* p = (const unsigned char*)buf;
+    const unsigned char* end = p + len;
+    uint64_t active = 0;
+    if (bits->anchored_beg) {
+        if (p == end) {
+            return bits->nullable;
+        }
+        active = bits->first & bits->byte_mask[*p++];
+    }
+    // a match can begin at any byte, unless it had to begin at the first
+    uint64_t first = bits->anchored_beg ? 0 : bits->first;
+    while (p < end) {
+        if (active == 0) {
+            if (bits->anchored_beg) {
+                return false;
+            }
+            // skip to the next byte a match can begin with
+            while (p < end && !(bits->byte_mask[*p] & first)) {
+                ++p;
+            }
+            if (p == end) {
+                break;
+            }
+        } else if (!bits->anchored_end && (active & bits->last)) {
+            return true;
+        }
+        uint64_t follow = (active & bits->shift) << 1;
+        for (size_t i = 0; i < bits->num_chunks; ++i) {
+            follow |= bits->follow[i * 256 + ((active >> (8 * bits->chunks[i])) & 0xFF)];
+        }
+        active = (follow | first) & bits->byte_mask[*p++];
+    }
+    return (active & bits->last) || (bits->nullable && !bits->anchored_beg);
+}
@@ -3,7 +3,9 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include "ast.h"
 #include "regex.h"
+#include "utf8.h"
 #include "util.h"
 
 //
@@ -13,12 +15,20 @@
 // A new node, with no transitions, that is non-accepting
 Node* make_node(Regex* regex) {
     // create the node
-    Node* node = malloc(sizeof(Node));
+    Node* node = alloc_or_die(1, sizeof(Node));
     node->id = regex->num_nodes; // this number is updated next
     node->edges = NULL;
     node->num_edges = 0;
     node->cap_edges = 0;
+    node->rev_edges = NULL;
+    node->num_rev_edges = 0;
+    node->ascii_edges = NULL;
+    node->num_ascii_edges = 0;
+    node->empty_edges = NULL;
+    node->num_empty_edges = 0;
     node->accepts = false;
+    node->dead = false;
+    node->sure = false;
     node->beg_capts = CAPT_NONE;
     node->end_capts = CAPT_NONE;
 
@@ -30,8 +40,7 @@ Node* make_node(Regex* regex) {
         }
         Node** new_data = realloc(regex->nodes, sizeof(Node*) * new_cap);
         if (new_data == NULL) {
-            fprintf(stderr, "ERROR: out of memory\n");
-            exit(EXIT_FAILURE);
+            out_of_memory();
         }
         regex->nodes = new_data;
         regex->cap = new_cap;
@@ -48,6 +57,9 @@ void destroy_node(Node* node) {
         destroy_pat(&node->edges[i].pat);
     }
     free(node->edges);
+    free(node->rev_edges);
+    free(node->ascii_edges);
+    free(node->empty_edges);
     free(node);
 }
 
@@ -56,15 +68,17 @@ void destroy_regex(const Regex* regex) {
         destroy_node(regex->nodes[i]);
     }
     free(regex->nodes);
+    destroy_bit_nfa(regex->bits);
+    free(regex->literal);
 }
 
 // Return the flag for a new capture group
 CaptureFlags new_group(Regex* regex) {
     if (regex->num_groups >= 64) {
-        fprintf(stderr, "ERROR: more than 64 capture groups not supported\n");
+        fprintf(error_output(), "ERROR: more than 64 capture groups not supported\n");
         exit(EXIT_FAILURE);
     }
-    CaptureFlags result = (1 << regex->num_groups);
+    CaptureFlags result = ((CaptureFlags)1 << regex->num_groups);
     ++regex->num_groups;
     return result;
 }
@@ -72,6 +86,7 @@ CaptureFlags new_group(Regex* regex) {
 // Create an edge from `node` to `target`
 // If the current state is `node`, then we may transition to `target` by consuming `pat`,
 // and capturing that character to the groups represented by `capt_by`
+// The edge gets its own copy of `pat`, so the caller still owns (and must destroy) the original
 void add_transition(Node* node, Node* target, Pattern pat) {
     if (node->num_edges >= node->cap_edges) {
         int new_cap = 2 * node->cap_edges;
@@ -80,119 +95,90 @@ void add_transition(Node* node, Node* target, Pattern pat) {
         }
         Edge* new_edges = realloc(node->edges, sizeof(Edge) * new_cap);
         if (!new_edges) {
-            fprintf(stderr, "ERROR: out of memory\n");
-            exit(EXIT_FAILURE);
+            out_of_memory();
         }
         node->edges = new_edges;
         node->cap_edges = new_cap;
     }
     node->edges[node->num_edges].target = target;
-    node->edges[node->num_edges].pat = pat;
+    node->edges[node->num_edges].pat = copy_pat(&pat);
     node->num_edges += 1;
 }
 
-bool compile_nodes(Regex* regex, Node* initial, Node** final, const char** str);
-
-bool compile_capture_group(Regex* regex, Node* initial, Node** final, const char** str) {
-    const char* begin = *str;
-    const char* end;
-    for (end = begin; *end && *end != ')'; ++end);
-    if (*end != ')') {
-        fprintf(stderr, "ERROR: unclosed ( ) capturing group. expected closing `)`, found %s\n",
-                *end? end : "end of input");
-        return false;
+// Give every node the reversed copy of each edge that leads to it,
+// so the automaton can also be run backwards (from the end of a match to its beginning)
+void build_reverse_edges(Regex* regex) {
+    for (size_t i = 0; i < regex->num_nodes; ++i) {
+        Node* node = regex->nodes[i];
+        for (size_t j = 0; j < node->num_edges; ++j) {
+            node->edges[j].target->num_rev_edges += 1;
+        }
     }
-    *str = end + 1;
-    Repition rep;
-    if (!parse_repition(&rep, str)) {
-        return false;
+    for (size_t i = 0; i < regex->num_nodes; ++i) {
+        Node* node = regex->nodes[i];
+        node->rev_edges = alloc_or_die(node->num_rev_edges, sizeof(Edge));
+        node->num_rev_edges = 0;
     }
-
-    // create a new capturing group, and update the flags so that all the nodes we create pipe output to it
-    CaptureFlags this_grp = new_group(regex);
-    
-    // Note about the compilation of a group: mostly mirrors the patterns used for the single-node variant,
-    // except we call `compile_nodes` to create the sub expressions,
-    // and we must join them by empty links in order to break the separate captures
-    Node* curr = initial;
-    int i = 0;
-    for (; i < rep.lower_bound; ++i) {
-        Node* next;
-        const char* _s = begin;
-        curr->beg_capts |= this_grp;
-        // append another copy of the group
-        if (!compile_nodes(regex, curr, &next, &_s)) {
-            return false;
+    for (size_t i = 0; i < regex->num_nodes; ++i) {
+        Node* node = regex->nodes[i];
+        for (size_t j = 0; j < node->num_edges; ++j) {
+            Edge* e = &node->edges[j];
+            Edge* rev = &e->target->rev_edges[e->target->num_rev_edges++];
+            rev->pat = e->pat;
+            rev->target = node;
         }
-        next->end_capts |= this_grp;
-        curr = next;
     }
-    if (rep.is_unbounded) {
-        Node* next;
-        const char* _s = begin;
-        curr->beg_capts |= this_grp;
-        // append a copy of the group
-        if (!compile_nodes(regex, curr, &next, &_s)) {
-            return false;
-        }
-        next->end_capts |= this_grp;
-        Node* final = make_node(regex);
-        // its possible to go back and repeat this section
-        add_transition(next, curr, EMPTY_PATTERN);
-        // or we can stop repeating any time
-        add_transition(next, final, EMPTY_PATTERN);
-        // we can also skip over it entirely
-        add_transition(curr, final, EMPTY_PATTERN);
-        curr = final;
-    } else {
-        for (; i < rep.upper_bound; ++i) {
-            Node* next;
-            const char* _s = begin;
-            curr->beg_capts |= this_grp;
-            // append another copy of the group
-            if (!compile_nodes(regex, curr, &next, &_s)) {
-                return false;
+}
+
+// Create the edges that take `node` to `target` by consuming `pat`
+// In UTF-8 mode, a pattern that can match a character of more than one byte gets a chain of new nodes
+// for each run of encodings it matches (see utf8.c), so it always consumes whole characters
+void add_pattern_transition(Regex* regex, Node* node, Node* target, Pattern pat) {
+    if (!regex->utf8 || pat_size(&pat) == 0) {
+        add_transition(node, target, pat);
+        return;
+    }
+    Pattern ascii;
+    if (ascii_part(&pat, &ascii)) {
+        add_transition(node, target, ascii);
+    }
+    destroy_pat(&ascii);
+
+    CodepointSet codepoints;
+    init_codepoint_set(&codepoints);
+    nonascii_codepoints(&pat, &codepoints);
+    ByteSeqList seqs;
+    init_byte_seqs(&seqs);
+    utf8_sequences(&codepoints, &seqs);
+    for (size_t i = 0; i < seqs.len; ++i) {
+        const ByteSeq* seq = &seqs.seqs[i];
+        Node* curr = node;
+        for (size_t j = 0; j < seq->len; ++j) {
+            Pattern byte = EMPTY_PATTERN;
+            if (seq->first[j] == seq->last[j]) {
+                byte.type = PAT_LITERAL;
+            } else {
+                byte.type = PAT_RANGE;
+                byte.last = seq->last[j];
             }
-            next->end_capts |= this_grp;
-            // we could also just skip over the group
-            add_transition(curr, next, EMPTY_PATTERN);
+            byte.literal = seq->first[j];
+            Node* next = j + 1 == seq->len ? target : make_node(regex);
+            add_transition(curr, next, byte);
             curr = next;
         }
     }
-
-    *final = curr;
-    return true;
+    destroy_byte_seqs(&seqs);
+    destroy_codepoint_set(&codepoints);
 }
 
-// Given an initial node, append a chain of nodes after that one, based on the current state of `*str`
-// Overwrites `*final` to be the last node we create,
-// and `*str` to noe character after the last consumed one
-//
-// Stops parsing at end of string or a parenthesis
-bool compile_nodes(Regex* regex, Node* initial, Node** final, const char** str) {
-    Node* curr = initial;
-    while (**str != '\0' && **str != ')') {
-        if (**str == '$' && *(*str + 1) == '\0') {
-            break;
-        }
-        if (**str == '(') {
-            ++*str;
-            Node* next;
-            if (!compile_capture_group(regex, curr, &next, str)) {
-                return false;
-            }
-            curr = next;
-            continue;
-        }
+void compile_ast(Regex* regex, const Ast* ast, Node* initial, Node** final);
 
-        Pattern pat;
-        Repition rep;
-        if (!parse_pattern(&pat, str)) {
-            return false;
-        }
-        if (!parse_repition(&rep, str)) {
-            return false;
-        }
+// Given an initial node, append the nodes for `ast` repeated as `rep` says
+// Overwrites `*final` to be the last node we create
+void compile_repeat(Regex* regex, const Ast* ast, Repition rep, Node* initial, Node** final) {
+    Node* curr = initial;
+    unsigned int i = 0;
+    if (ast->type == AST_PATTERN) {
         // a straightforward chain of required nodes
         // if we have `A{3}`:
         //
@@ -203,10 +189,9 @@ bool compile_nodes(Regex* regex, Node* initial, Node** final, const char** str)
         //   |                                 |
         //   initial                          *final
         //  
-        int i = 0;
         for (; i < rep.lower_bound; ++i) {
             Node* next = make_node(regex);
-            add_transition(curr, next, pat);
+            add_pattern_transition(regex, curr, next, ast->pat);
             curr = next;
         }
         if (rep.is_unbounded) {
@@ -225,9 +210,10 @@ bool compile_nodes(Regex* regex, Node* initial, Node** final, const char** str)
             //  
             // we can keep going back to `curr` as many times as we like if we match `pat`
             Node* next = make_node(regex);
-            add_transition(curr, curr, pat);
+            add_pattern_transition(regex, curr, curr, ast->pat);
             // or we can stop any time
             add_transition(curr, next, EMPTY_PATTERN);
+            curr = next;
         } else {
             // a straightforward chain of required nodes, except we can skip any link if we want
             // if we have `A{0,3}`:
@@ -243,20 +229,100 @@ bool compile_nodes(Regex* regex, Node* initial, Node** final, const char** str)
             for (; i < rep.upper_bound; ++i) {
                 Node* next = make_node(regex);
                 // we have a choice: we can match another 'pat'
-                add_transition(curr, next, pat);
+                add_pattern_transition(regex, curr, next, ast->pat);
                 // but we don't have to, instead we can bypass it
                 add_transition(curr, next, EMPTY_PATTERN);
                 curr = next;
             }
         }
+        *final = curr;
+        return;
+    }
+
+    // Anything bigger mostly mirrors the patterns used for a single pattern,
+    // except we call `compile_ast` to create each copy of the sub expression,
+    // and we must join them by empty links in order to break the separate captures.
+    // A copy that can be repeated or skipped begins at a node of its own, after an empty edge from `curr`:
+    // the repeat and skip edges go to and from `curr`, and if the copy began there,
+    // a loop at its beginning (as in `(a*b)*`) could be taken and then skip the rest of the copy
+    for (; i < rep.lower_bound; ++i) {
+        Node* next;
+        // append another copy
+        compile_ast(regex, ast, curr, &next);
+        curr = next;
+    }
+    if (rep.is_unbounded) {
+        Node* entry = make_node(regex);
+        add_transition(curr, entry, EMPTY_PATTERN);
+        Node* next;
+        // append a copy
+        compile_ast(regex, ast, entry, &next);
+        Node* final = make_node(regex);
+        // its possible to go back and repeat this section
+        add_transition(next, curr, EMPTY_PATTERN);
+        // or we can stop repeating any time
+        add_transition(next, final, EMPTY_PATTERN);
+        // we can also skip over it entirely
+        add_transition(curr, final, EMPTY_PATTERN);
+        curr = final;
+    } else {
+        for (; i < rep.upper_bound; ++i) {
+            Node* entry = make_node(regex);
+            add_transition(curr, entry, EMPTY_PATTERN);
+            Node* next;
+            // append another copy
+            compile_ast(regex, ast, entry, &next);
+            // we could also just skip over it
+            add_transition(curr, next, EMPTY_PATTERN);
+            curr = next;
+        }
+    }
+    *final = curr;
+}
+
+// Given an initial node, append the nodes that match `ast` after it
+// Overwrites `*final` to be the last node we create
+void compile_ast(Regex* regex, const Ast* ast, Node* initial, Node** final) {
+    Node* curr = initial;
+    switch (ast->type) {
+        case AST_PATTERN: {
+            Node* next = make_node(regex);
+            add_pattern_transition(regex, curr, next, ast->pat);
+            curr = next;
+            break;
+        }
+        case AST_CONCAT:
+            for (size_t i = 0; i < ast->num_children; ++i) {
+                Node* next;
+                compile_ast(regex, ast->children[i], curr, &next);
+                curr = next;
+            }
+            break;
+        case AST_GROUP: {
+            // every node we create between here and the end of the group pipes its input to the group
+            CaptureFlags this_grp = (CaptureFlags)1 << ast->group;
+            Node* next;
+            curr->beg_capts |= this_grp;
+            compile_ast(regex, ast->children[0], curr, &next);
+            next->end_capts |= this_grp;
+            curr = next;
+            break;
+        }
+        case AST_REPEAT:
+            compile_repeat(regex, ast->children[0], ast->rep, curr, &curr);
+            break;
     }
     *final = curr;
-    return true;
 }
+
 // Parses regex until we hit a closing paren or final '$' anchor, or null byte
 // `*str` is avanced to the last unconsumed byte (which will be one of those 3)
 // returns if the regex object was successfully initialized
 bool compile(Regex* regex, const char* str) {
+    return compile_with(regex, str, 0);
+}
+
+bool compile_with(Regex* regex, const char* str, int flags) {
 #ifdef DEBUG
     printf("compiling `%s`...\n", str);
 #endif
@@ -264,43 +330,88 @@ bool compile(Regex* regex, const char* str) {
     regex->num_nodes = 0;
     regex->cap = 0;
     regex->num_groups = 0;
+    regex->utf8 = flags & COMPILE_UTF8;
+    regex->bits = NULL;
+    regex->literal = NULL;
+    regex->literal_len = 0;
     
     regex->trap = make_node(regex);
     add_transition(regex->trap, regex->trap, PATTERN_ANY);
 
+    regex->tail = make_node(regex);
+    regex->tail->accepts = true;
+    add_transition(regex->tail, regex->tail, PATTERN_ANY);
+
     regex->initial = make_node(regex);
-    CaptureFlags group0 = new_group(regex);
-    regex->initial->beg_capts |= group0;
+    // where the match itself (and so group 0) begins
+    Node* start = regex->initial;
 
-    if (*str == '^') {
+    regex->anchored_beg = *str == '^';
+    if (regex->anchored_beg) {
         ++str;
         // must match from beginning of line
     } else {
-        // we can accept any amount of input before the match
+        // we can accept any amount of input before the match.
+        // the match begins on a node of its own, so that input is not captured,
+        // and the empty edge comes first so that we prefer the leftmost match
+        start = make_node(regex);
+        add_transition(regex->initial, start, EMPTY_PATTERN);
         add_transition(regex->initial, regex->initial, PATTERN_ANY);
     }
+    CaptureFlags group0 = new_group(regex);
+    start->beg_capts |= group0;
 
-    Node* final;
+    // the regex is parsed once, and simplified before it is compiled
+    Ast* ast;
+    size_t num_groups = regex->num_groups;
     const char* advance_to = str;
-    if (!compile_nodes(regex, regex->initial, &final, &advance_to)) {
+    if (!parse_ast(&ast, &advance_to, regex->utf8, &num_groups)) {
         return false;
     }
+
+    regex->anchored_end = *advance_to == '$';
+    if (regex->anchored_end) {
+        ++advance_to;
+    }
+    if (*advance_to != '\0') {
+        fprintf(error_output(), "ERROR: unanticipated extra characters after parsing was finished: `%s`\n.       Was there an unclosed `)`?\n", advance_to);
+        destroy_ast(ast);
+        return false;
+    }
+    if (num_groups > 64) {
+        fprintf(error_output(), "ERROR: more than 64 capture groups not supported\n");
+        destroy_ast(ast);
+        return false;
+    }
+    bool keep_groups = !(flags & COMPILE_NO_CAPTURES);
+    if (keep_groups) {
+        regex->num_groups = num_groups;
+    }
+    optimize_ast(&ast, keep_groups);
+#ifdef DEBUG
+    debug_ast(ast, 0);
+#endif
+    regex->literal = required_literal(ast, &regex->literal_len);
+
+    Node* final;
+    compile_ast(regex, ast, start, &final);
+    destroy_ast(ast);
     final->accepts = true;
     final->end_capts |= group0;
+    regex->start = start;
+    regex->final = final;
 
-    if (*advance_to == '$') {
-        ++advance_to;
+    if (regex->anchored_end) {
         // any extra input causes us to reject
         add_transition(final, regex->trap, PATTERN_ANY);
     } else {
-        // we can stay at the match forever
-        add_transition(final, final, PATTERN_ANY);
+        // we can consume the rest of the input after the match, and still accept
+        add_transition(final, regex->tail, PATTERN_ANY);
     }
 
-    if (*advance_to != '\0') {
-        fprintf(stderr, "ERROR: unanticipated extra characters after parsing was finished: `%s`\n.       Was there an unclosed `)`?\n", advance_to);
-        return false;
-    }
+    build_reverse_edges(regex);
+    analyze_nodes(regex);
+    build_bit_nfa(regex);
 
     return true;
 }
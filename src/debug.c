@@ -1,5 +1,6 @@
 #include "regex.h"
 #include "pattern.h"
+#include "trigram.h"
 
 //
 // This file contains a variety of methods intended to be useful for debugging various structs
@@ -51,12 +52,35 @@ void debug_pat(const Pattern* pat) {
             }
             printf("]");
             break;
+        case PAT_ASCII_NONALPHA:
+            printf("PAT_ASCII_NONALPHA");
+            break;
+        case PAT_ASCII_NONDIGIT:
+            printf("PAT_ASCII_NONDIGIT");
+            break;
+        case PAT_ASCII_NEG_SET:
+            printf("PAT_ASCII_NEG_SET[");
+            for (size_t i = 0; i < pat->num_sub_pats; ++i) {
+                if (i != 0) {
+                    printf(", ");
+                }
+                debug_pat(&pat->sub_pats[i]);
+            }
+            printf("]");
+            break;
+        case PAT_RANGE:
+            printf("PAT_RANGE[%02x-%02x]", (unsigned char)pat->literal, (unsigned char)pat->last);
+            break;
+        case PAT_CODEPOINT:
+            printf("PAT_CODEPOINT[U+%04x]", pat->codepoint);
+            break;
     }
 }
 
 void debug_node(const Node* node) {
     printf(" +--\n");
-    printf(" | Node %ld (%s):\n", node->id, node->accepts? "accepts" : "rejects");
+    printf(" | Node %ld (%s%s%s):\n", node->id, node->accepts? "accepts" : "rejects",
+           node->dead? ", dead" : "", node->sure? ", sure" : "");
     printf(" |     %ld edge(s), beg_capts = %ld, end_capts = %ld\n", node->num_edges, node->beg_capts, node->end_capts);
     for (size_t i = 0; i < node->num_edges; ++i) {
         printf(" |     ");
@@ -64,13 +88,37 @@ void debug_node(const Node* node) {
         debug_pat(&e->pat);
         printf(" -> Node %ld\n", e->target->id);
     }
+    for (size_t i = 0; i < node->num_rev_edges; ++i) {
+        printf(" |     ");
+        Edge* e = &node->rev_edges[i];
+        debug_pat(&e->pat);
+        printf(" <- Node %ld\n", e->target->id);
+    }
 }
 
 void debug_regex(const Regex* regex) {
     printf("----------------------------------------------------------------------------\n");
     printf("Initial: Node %ld\n", regex->initial->id);
     printf("Trap:    Node %ld\n", regex->trap->id);
-    printf("Num Groups: %ld\n", regex->num_groups);
+    printf("Tail:    Node %ld\n", regex->tail->id);
+    printf("Start:   Node %ld%s\n", regex->start->id, regex->anchored_beg ? " (anchored)" : "");
+    printf("Final:   Node %ld%s\n", regex->final->id, regex->anchored_end ? " (anchored)" : "");
+    printf("Num Groups: %ld%s\n", regex->num_groups, regex->utf8 ? " (UTF-8)" : "");
+    printf("Byte Classes: %ld\n", regex->num_classes);
+    if (regex->literal) {
+        printf("Required Literal: `%s`\n", regex->literal);
+    }
+    if (regex->bits) {
+        printf("Bit-Parallel: %ld positions, %ld follow tables, %ld first bytes%s\n", regex->bits->num_positions,
+               regex->bits->num_chunks, regex->bits->num_first_bytes, prefers_match_bits(regex) ? " (preferred)" : "");
+    } else {
+        printf("Bit-Parallel: too many positions\n");
+    }
+    TrigramQuery query;
+    required_trigrams(regex, &query);
+    printf("Required Trigrams: ");
+    debug_trigram_query(&query);
+    destroy_trigram_query(&query);
     for (size_t i = 0; i < regex->num_nodes; ++i) {
         debug_node(regex->nodes[i]);
     }
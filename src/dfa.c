@@ -0,0 +1,314 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "regex.h"
+#include "util.h"
+
+//
+// This file builds a DFA out of the NFA lazily: a state is only made when the input leads to it,
+// and a transition is only worked out (by one step of the set simulation) the first time it is taken.
+// The transition table has a column for each class of byte (see Regex), rather than one for each of the 256 bytes,
+// which keeps it small enough to stay in cache.
+// Once there are too many states, they are all thrown away and we start over from the state we are in.
+//
+
+#define NO_STATE -1
+
+void grow_or_die(void** data, size_t* cap, size_t need, size_t size) {
+    if (need <= *cap) {
+        return;
+    }
+    size_t new_cap = *cap == 0 ? 16 : *cap;
+    while (new_cap < need) {
+        new_cap *= 2;
+    }
+    void* new_data = realloc(*data, new_cap * size);
+    if (!new_data) {
+        out_of_memory();
+    }
+    *data = new_data;
+    *cap = new_cap;
+}
+
+int compare_ids(const void* a, const void* b) {
+    uint32_t ia = *(const uint32_t*)a;
+    uint32_t ib = *(const uint32_t*)b;
+    return (ia > ib) - (ia < ib);
+}
+
+uint64_t hash_ids(const uint32_t* ids, size_t num) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < num; ++i) {
+        hash ^= ids[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Forget every state
+void clear_dfa(Dfa* dfa) {
+    dfa->num_states = 0;
+    dfa->num_ids = 0;
+    dfa->ids_beg[0] = 0;
+    for (size_t i = 0; i < dfa->table_cap; ++i) {
+        dfa->table[i] = NO_STATE;
+    }
+}
+
+// Copy the ids of the nodes in the current set of `dfa->sets` to `dfa->new_ids`, sorted, and work out their DFA_ flags
+// Returns how many there are
+size_t collect_ids(Dfa* dfa, uint8_t* flags) {
+    const MatchState* sets = &dfa->sets;
+    size_t num = sets->num_curr;
+    *flags = 0;
+    for (size_t i = 0; i < num; ++i) {
+        dfa->new_ids[i] = sets->curr[i]->id;
+        if (sets->curr[i]->accepts) {
+            *flags |= DFA_ACCEPTS;
+        }
+    }
+    qsort(dfa->new_ids, num, sizeof(uint32_t), compare_ids);
+    if (sets->curr_sure) {
+        *flags |= DFA_SURE | DFA_ACCEPTS;
+    }
+    if (num == 0) {
+        *flags |= DFA_DEAD;
+    }
+    return num;
+}
+
+// Returns the state for the `num` node ids in `dfa->new_ids`, making it (with `flags`) if it is new
+int32_t state_of_ids(Dfa* dfa, size_t num, uint8_t flags) {
+    size_t mask = dfa->table_cap - 1;
+    size_t slot = hash_ids(dfa->new_ids, num) & mask;
+    for (; dfa->table[slot] != NO_STATE; slot = (slot + 1) & mask) {
+        int32_t s = dfa->table[slot];
+        size_t beg = dfa->ids_beg[s];
+        size_t len = dfa->ids_beg[s + 1] - beg;
+        if (len == num && memcmp(dfa->ids + beg, dfa->new_ids, num * sizeof(uint32_t)) == 0) {
+            return s;
+        }
+    }
+
+    // a new state
+    int32_t s = dfa->num_states++;
+    grow_or_die((void**)&dfa->flags, &dfa->cap_states, dfa->num_states, sizeof(uint8_t));
+    size_t cap_states = dfa->cap_states;
+    // the other per-state arrays grow along with `flags`
+    dfa->trans = realloc(dfa->trans, cap_states * dfa->num_classes * sizeof(int32_t));
+    dfa->ids_beg = realloc(dfa->ids_beg, (cap_states + 1) * sizeof(size_t));
+    if (!dfa->trans || !dfa->ids_beg) {
+        out_of_memory();
+    }
+    for (size_t c = 0; c < dfa->num_classes; ++c) {
+        dfa->trans[s * dfa->num_classes + c] = NO_STATE;
+    }
+    dfa->flags[s] = flags;
+
+    grow_or_die((void**)&dfa->ids, &dfa->cap_ids, dfa->num_ids + num, sizeof(uint32_t));
+    memcpy(dfa->ids + dfa->num_ids, dfa->new_ids, num * sizeof(uint32_t));
+    dfa->num_ids += num;
+    dfa->ids_beg[s + 1] = dfa->num_ids;
+
+    dfa->table[slot] = s;
+    return s;
+}
+
+// Load the nodes of state `s` into the current set of `dfa->sets`
+void load_state(Dfa* dfa, const Regex* regex, int32_t s) {
+    MatchState* sets = &dfa->sets;
+    sets->num_curr = 0;
+    for (size_t i = dfa->ids_beg[s]; i < dfa->ids_beg[s + 1]; ++i) {
+        sets->curr[sets->num_curr++] = regex->nodes[dfa->ids[i]];
+    }
+    sets->curr_sure = (dfa->flags[s] & DFA_SURE) != 0;
+    sets->num_next = 0;
+    sets->next_sure = false;
+}
+
+// Returns the state for the set of nodes the current set of `dfa->sets` holds, making it if it is new
+int32_t state_of_sets(Dfa* dfa) {
+    uint8_t flags;
+    size_t num = collect_ids(dfa, &flags);
+    return state_of_ids(dfa, num, flags);
+}
+
+// Work out where state `s` goes on reading `ch`, and remember it
+int32_t add_transition_for(Dfa* dfa, const Regex* regex, int32_t s, char ch) {
+    load_state(dfa, regex, s);
+    feed_match_state(&dfa->sets, &ch, 1);
+    if (dfa->num_states >= DFA_MAX_STATES) {
+        // start over, with only where we are going and the start state
+        uint8_t flags;
+        size_t num = collect_ids(dfa, &flags);
+        clear_dfa(dfa);
+        ++dfa->num_clears;
+        int32_t t = state_of_ids(dfa, num, flags);
+        reset_match_state(&dfa->sets, regex);
+        dfa->start = state_of_sets(dfa);
+        return t;
+    }
+    int32_t t = state_of_sets(dfa);
+    dfa->trans[s * dfa->num_classes + regex->byte_class[(unsigned char)ch]] = t;
+    return t;
+}
+
+void init_dfa(Dfa* dfa, const Regex* regex) {
+    dfa->num_classes = regex->num_classes;
+    dfa->trans = NULL;
+    dfa->flags = NULL;
+    dfa->num_states = 0;
+    dfa->cap_states = 0;
+    dfa->ids = NULL;
+    dfa->num_ids = 0;
+    dfa->cap_ids = 0;
+    dfa->ids_beg = alloc_or_die(1, sizeof(size_t));
+    // at most half full
+    dfa->table_cap = 2 * DFA_MAX_STATES;
+    dfa->table = alloc_or_die(dfa->table_cap, sizeof(int32_t));
+    dfa->new_ids = alloc_or_die(regex->num_nodes, sizeof(uint32_t));
+    init_match_state(&dfa->sets, regex);
+    dfa->num_clears = 0;
+    clear_dfa(dfa);
+    dfa->start = state_of_sets(dfa);
+    dfa->curr = dfa->start;
+}
+
+void reset_dfa(Dfa* dfa) {
+    dfa->curr = dfa->start;
+}
+
+void feed_dfa(Dfa* dfa, const Regex* regex, const char* buf, size_t len) {
+    int32_t s = dfa->curr;
+    const int32_t* trans = dfa->trans;
+    size_t num_classes = dfa->num_classes;
+    for (size_t pos = 0; pos < len; ++pos) {
+        if (dfa->flags[s] & (DFA_SURE | DFA_DEAD)) {
+            break;
+        }
+        int32_t t = trans[s * num_classes + regex->byte_class[(unsigned char)buf[pos]]];
+        if (t == NO_STATE) {
+            t = add_transition_for(dfa, regex, s, buf[pos]);
+            // the table may have moved
+            trans = dfa->trans;
+        }
+        s = t;
+    }
+    dfa->curr = s;
+}
+
+// how many bytes each line steps through between looking for lines that are done
+#define STREAM_CHUNK 16
+
+void match_dfa_lines(Dfa* dfa, const Regex* regex, const StrView* lines, size_t num_lines, bool* accepts) {
+    // the lines still going are kept at the front: which line, where it is up to, and its state
+    size_t which[DFA_STREAMS];
+    const unsigned char* pos[DFA_STREAMS];
+    const unsigned char* end[DFA_STREAMS];
+    int32_t states[DFA_STREAMS];
+    size_t num_going = num_lines;
+    for (size_t i = 0; i < num_lines; ++i) {
+        which[i] = i;
+        pos[i] = (const unsigned char*)lines[i].beg;
+        end[i] = pos[i] + lines[i].len;
+        states[i] = dfa->start;
+    }
+    size_t num_clears = dfa->num_clears;
+    const uint8_t* byte_class = regex->byte_class;
+    size_t num_classes = dfa->num_classes;
+    while (num_going > 0) {
+        // take lines out once they are over, or settled
+        for (size_t i = 0; i < num_going;) {
+            if (pos[i] == end[i] || (dfa->flags[states[i]] & (DFA_SURE | DFA_DEAD))) {
+                accepts[which[i]] = dfa->flags[states[i]] & DFA_ACCEPTS;
+                --num_going;
+                which[i] = which[num_going];
+                pos[i] = pos[num_going];
+                end[i] = end[num_going];
+                states[i] = states[num_going];
+            } else {
+                ++i;
+            }
+        }
+        // every line still going can take this many steps
+        size_t steps = STREAM_CHUNK;
+        for (size_t i = 0; i < num_going; ++i) {
+            if ((size_t)(end[i] - pos[i]) < steps) {
+                steps = end[i] - pos[i];
+            }
+        }
+        const int32_t* trans = dfa->trans;
+        for (size_t k = 0; k < steps; ++k) {
+            for (size_t i = 0; i < num_going; ++i) {
+                int32_t t = trans[states[i] * num_classes + byte_class[pos[i][k]]];
+                if (t == NO_STATE) {
+                    t = add_transition_for(dfa, regex, states[i], pos[i][k]);
+                    if (dfa->num_clears != num_clears) {
+                        // the states the other lines are in are gone: go through them one at a time instead
+                        for (size_t j = 0; j < num_lines; ++j) {
+                            reset_dfa(dfa);
+                            feed_dfa(dfa, regex, lines[j].beg, lines[j].len);
+                            accepts[j] = dfa_accepts(dfa);
+                        }
+                        reset_dfa(dfa);
+                        return;
+                    }
+                    // the table may have moved
+                    trans = dfa->trans;
+                }
+                states[i] = t;
+            }
+        }
+        for (size_t i = 0; i < num_going; ++i) {
+            pos[i] += steps;
+        }
+    }
+    reset_dfa(dfa);
+}
+
+bool explore_dfa(Dfa* dfa, const Regex* regex) {
+    // any byte will do to stand for its class
+    char byte_of_class[256];
+    for (int ch = 255; ch >= 0; --ch) {
+        byte_of_class[regex->byte_class[ch]] = (char)ch;
+    }
+    // (states are added at the end, so this goes on until no new ones turn up)
+    for (size_t s = 0; s < dfa->num_states; ++s) {
+        if (dfa->flags[s] & (DFA_SURE | DFA_DEAD)) {
+            continue;
+        }
+        for (size_t c = 0; c < dfa->num_classes; ++c) {
+            if (dfa->trans[s * dfa->num_classes + c] != NO_STATE) {
+                continue;
+            }
+            if (dfa->num_states >= DFA_MAX_STATES) {
+                // one more would throw them all away
+                return false;
+            }
+            add_transition_for(dfa, regex, s, byte_of_class[c]);
+        }
+    }
+    return true;
+}
+
+bool dfa_accepts(const Dfa* dfa) {
+    return dfa->flags[dfa->curr] & DFA_ACCEPTS;
+}
+
+bool dfa_settled(const Dfa* dfa) {
+    return dfa->flags[dfa->curr] & (DFA_SURE | DFA_DEAD);
+}
+
+void destroy_dfa(const Dfa* dfa) {
+    free(dfa->trans);
+    free(dfa->flags);
+    free(dfa->ids);
+    free(dfa->ids_beg);
+    free(dfa->table);
+    free(dfa->new_ids);
+    destroy_match_state(&dfa->sets);
+}
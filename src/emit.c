@@ -0,0 +1,146 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "regex.h"
+#include "util.h"
+
+//
+// This file turns a compiled regex into C source for a matcher that needs nothing else:
+// the DFA is built all the way ahead of time, each state becomes a label, and each state's transitions
+// become a `switch` on the class of the next byte, with a `goto` for each target.
+// States that settle the outcome (sure or dead) return straight away.
+//
+
+// Write `str` as the contents of a C string literal
+void emit_c_string(const char* str, FILE* out) {
+    for (; *str; ++str) {
+        unsigned char ch = *str;
+        if (ch == '"' || ch == '\\') {
+            fprintf(out, "\\%c", ch);
+        } else if (ch >= 0x20 && ch < 0x7F) {
+            fputc(ch, out);
+        } else {
+            fprintf(out, "\\%03o", ch);
+        }
+    }
+}
+
+// Returns the target most classes go to from the (unsettled) state `s`, setting `*count` to how many do
+int32_t common_target(const Dfa* dfa, int32_t s, size_t* count) {
+    const int32_t* trans = &dfa->trans[s * dfa->num_classes];
+    int32_t common = trans[0];
+    *count = 0;
+    for (size_t c = 0; c < dfa->num_classes; ++c) {
+        size_t n = 0;
+        for (size_t d = 0; d < dfa->num_classes; ++d) {
+            n += trans[d] == trans[c];
+        }
+        if (n > *count) {
+            common = trans[c];
+            *count = n;
+        }
+    }
+    return common;
+}
+
+// Returns true if state `s` has to look at the class of the next byte (rather than settling, or going the same way for any byte)
+bool needs_switch(const Dfa* dfa, int32_t s) {
+    if (dfa->flags[s] & (DFA_SURE | DFA_DEAD)) {
+        return false;
+    }
+    size_t count;
+    common_target(dfa, s, &count);
+    return count < dfa->num_classes;
+}
+
+// Write the code for state `s`: return if it is settled, or at the end of input, otherwise go where the next byte says
+void emit_state(const Dfa* dfa, int32_t s, FILE* out) {
+    fprintf(out, "s%d:\n", s);
+    uint8_t flags = dfa->flags[s];
+    if (flags & DFA_SURE) {
+        fprintf(out, "    return 1;\n");
+        return;
+    }
+    if (flags & DFA_DEAD) {
+        fprintf(out, "    return 0;\n");
+        return;
+    }
+    fprintf(out, "    if (p == end) {\n        return %d;\n    }\n", (flags & DFA_ACCEPTS) ? 1 : 0);
+
+    const int32_t* trans = &dfa->trans[s * dfa->num_classes];
+    // the target most classes go to is the `default`
+    size_t common_count;
+    int32_t common = common_target(dfa, s, &common_count);
+    if (common_count == dfa->num_classes) {
+        fprintf(out, "    ++p;\n    goto s%d;\n", common);
+        return;
+    }
+    fprintf(out, "    switch (CLASS_OF[*p++]) {\n");
+    // one group of cases per target, in order of each target's first class
+    bool* done = alloc_or_die(dfa->num_classes, sizeof(bool));
+    for (size_t c = 0; c < dfa->num_classes; ++c) {
+        if (done[c] || trans[c] == common) {
+            continue;
+        }
+        fprintf(out, "       ");
+        for (size_t d = c; d < dfa->num_classes; ++d) {
+            if (trans[d] == trans[c]) {
+                fprintf(out, " case %ld:", d);
+                done[d] = true;
+            }
+        }
+        fprintf(out, "\n            goto s%d;\n", trans[c]);
+    }
+    free(done);
+    fprintf(out, "        default:\n            goto s%d;\n    }\n", common);
+}
+
+bool emit_c(const Regex* regex, const char* pattern, const char* name, FILE* out) {
+    Dfa dfa;
+    init_dfa(&dfa, regex);
+    if (!explore_dfa(&dfa, regex)) {
+        fprintf(stderr, "ERROR: The regex needs more than %d DFA states, which is too many to write out\n", DFA_MAX_STATES);
+        destroy_dfa(&dfa);
+        return false;
+    }
+
+    fprintf(out, "// Generated by mygrep --emit-c from the regex \"");
+    emit_c_string(pattern, out);
+    fprintf(out, "\"%s\n", regex->utf8 ? " (UTF-8)" : "");
+    fprintf(out, "// %ld states, %ld classes of bytes\n\n", dfa.num_states, dfa.num_classes);
+    fprintf(out, "#include <stddef.h>\n\n");
+    // the table is left out if no state needs it, so that it is not an unused variable
+    bool needs_table = false;
+    for (size_t s = 0; s < dfa.num_states; ++s) {
+        needs_table = needs_table || needs_switch(&dfa, s);
+    }
+    if (needs_table) {
+        fprintf(out, "#define CLASS_OF %s_class_of\n\n", name);
+        fprintf(out, "static const unsigned char CLASS_OF[256] = {");
+        for (int ch = 0; ch < 256; ++ch) {
+            fprintf(out, "%s%3d,", ch % 16 == 0 ? "\n   " : "", regex->byte_class[ch]);
+        }
+        fprintf(out, "\n};\n\n");
+    }
+
+    fprintf(out, "// Returns 1 if the `len` bytes at `buf` (one line, without its newline) contain a match, and 0 if not\n");
+    fprintf(out, "int %s(const char* buf, size_t len) {\n", name);
+    fprintf(out, "    const unsigned char* p = (const unsigned char*)buf;\n");
+    fprintf(out, "    const unsigned char* end = p + len;\n");
+    if (dfa.flags[dfa.start] & (DFA_SURE | DFA_DEAD)) {
+        // decided before reading anything
+        fprintf(out, "    (void)end;\n");
+    }
+    fprintf(out, "    goto s%d;\n", dfa.start);
+    for (size_t s = 0; s < dfa.num_states; ++s) {
+        emit_state(&dfa, s, out);
+    }
+    fprintf(out, "}\n");
+    if (needs_table) {
+        fprintf(out, "\n#undef CLASS_OF\n");
+    }
+
+    destroy_dfa(&dfa);
+    return !ferror(out);
+}
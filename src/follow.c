@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "follow.h"
+#include "input.h"
+#include "util.h"
+
+//
+// This file contains `--follow`, which keeps matching lines as they are appended to files.
+//
+// Each file has a LineScanner (and a MatchScratch) of its own, so a line that is only partly written
+// has been fed to the DFA as far as it goes, and the rest is fed as it arrives, without going over it again.
+// inotify tells us when a file is written to (so waiting costs nothing), and when something is created
+// or moved into its directory under its name (which is how a rotated log comes back).
+//
+
+// room for a good number of events at once
+#define EVENT_BUF_SIZE (64 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+
+typedef struct {
+    const char* path;
+    // where in the directory it is: a dynamically allocated copy of the directory, and the name within it
+    char* dir;
+    const char* name;
+    // the open file (or -1 if it is not there), which it is, and how far we have read into it
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    off_t offset;
+    // the watch on the file we have open (or -1), and on its directory (or -1)
+    int file_wd;
+    int dir_wd;
+    // set when an event for this file is waiting to be handled
+    bool pending;
+    MatchScratch scratch;
+    LineScanner scanner;
+} Followed;
+
+// Open the file at `f->path` (as it is now), and start watching it
+// Returns false (with a message printed to `err`, unless there is no such file yet) if it can not be followed
+bool open_followed(Followed* f, int inotify_fd, FILE* err) {
+    int fd = open(f->path, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            fprintf(err, "ERROR: Can not open input file `%s` to read: %s\n", f->path, strerror(errno));
+        }
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        fprintf(err, "ERROR: `%s` is not a regular file, and can not be followed\n", f->path);
+        close(fd);
+        return false;
+    }
+    char head[MAGIC_LEN];
+    ssize_t head_len = pread(fd, head, MAGIC_LEN, 0);
+    if (head_len > 0 && is_compressed(head, head_len)) {
+        fprintf(err, "ERROR: `%s` is compressed, and can not be followed\n", f->path);
+        close(fd);
+        return false;
+    }
+    f->fd = fd;
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+    f->offset = 0;
+    restart_line_scanner(&f->scanner);
+    f->file_wd = inotify_add_watch(inotify_fd, f->path, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+    return true;
+}
+
+// Stop following the file we have open, after matching its last line (even if it never got a newline)
+void close_followed(Followed* f, int inotify_fd) {
+    scan_lines(&f->scanner, 0, true);
+    close(f->fd);
+    f->fd = -1;
+    if (f->file_wd >= 0) {
+        // (a watch on a file that has since been deleted is gone already)
+        inotify_rm_watch(inotify_fd, f->file_wd);
+        f->file_wd = -1;
+    }
+}
+
+// Read and match whatever has been appended to the file since we last looked,
+// and switch to the new file if another has taken its name
+void catch_up(Followed* f, int inotify_fd, FILE* err) {
+    for (;;) {
+        if (f->fd >= 0) {
+            struct stat st;
+            if (fstat(f->fd, &st) == 0 && st.st_size < f->offset) {
+                close_followed(f, inotify_fd);
+                fprintf(err, "NOTE: `%s` was truncated, following it from the start\n", f->path);
+                if (!open_followed(f, inotify_fd, err)) {
+                    return;
+                }
+            }
+            for (;;) {
+                size_t room;
+                char* space = scanner_space(&f->scanner, &room);
+                if (!space) {
+                    break;
+                }
+                ssize_t got = read(f->fd, space, room);
+                if (got < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (got <= 0) {
+                    break;
+                }
+                f->offset += got;
+                scan_lines(&f->scanner, got, false);
+            }
+        }
+        // if the name now belongs to another file, the one we have is done with (we have read all of it)
+        struct stat st;
+        if (stat(f->path, &st) != 0 || (f->fd >= 0 && st.st_dev == f->dev && st.st_ino == f->ino)) {
+            return;
+        }
+        if (f->fd >= 0) {
+            close_followed(f, inotify_fd);
+        }
+        if (!open_followed(f, inotify_fd, err)) {
+            return;
+        }
+    }
+}
+
+bool follow_files(const Regex* regex, char** paths, FILE* out, FILE* err, const SearchOptions* opts) {
+    if (!*paths) {
+        fprintf(err, "ERROR: --follow needs files to follow\n");
+        return false;
+    }
+    int inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        fprintf(err, "ERROR: Can not watch files: %s\n", strerror(errno));
+        return false;
+    }
+    size_t num_followed = 0;
+    while (paths[num_followed]) {
+        ++num_followed;
+    }
+    Followed* followed = alloc_or_die(num_followed, sizeof(Followed));
+    bool any_watched = false;
+    for (size_t i = 0; i < num_followed; ++i) {
+        Followed* f = &followed[i];
+        f->path = paths[i];
+        const char* slash = strrchr(f->path, '/');
+        f->dir = slash ? copy_between(f->path, slash + 1) : make_copy(".");
+        f->name = slash ? slash + 1 : f->path;
+        f->fd = -1;
+        f->file_wd = -1;
+        f->dir_wd = inotify_add_watch(inotify_fd, f->dir, IN_CREATE | IN_MOVED_TO);
+        f->pending = false;
+        init_match_scratch(&f->scratch, regex);
+        init_line_scanner(&f->scanner, regex, &f->scratch, out, NULL, opts, NULL);
+        if (!open_followed(f, inotify_fd, err) && errno == ENOENT) {
+            fprintf(err, "NOTE: There is no input file `%s` yet, waiting for it to appear...\n", f->path);
+        }
+        if (f->dir_wd >= 0 || f->file_wd >= 0) {
+            any_watched = true;
+        }
+        // what is there already is searched as usual
+        catch_up(f, inotify_fd, err);
+    }
+
+    char* events = alloc_or_die(EVENT_BUF_SIZE, 1);
+    while (any_watched) {
+        // everything found so far goes out before we sleep
+        fflush(out);
+        ssize_t len = read(inotify_fd, events, EVENT_BUF_SIZE);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            fprintf(err, "ERROR: Can not watch files: %s\n", strerror(errno));
+            break;
+        }
+        for (ssize_t pos = 0; pos < len;) {
+            const struct inotify_event* ev = (const struct inotify_event*)(events + pos);
+            pos += sizeof(struct inotify_event) + ev->len;
+            for (size_t i = 0; i < num_followed; ++i) {
+                Followed* f = &followed[i];
+                if (  ev->mask & IN_Q_OVERFLOW
+                   || (ev->wd == f->file_wd)
+                   || (ev->wd == f->dir_wd && ev->len > 0 && strcmp(ev->name, f->name) == 0))
+                {
+                    f->pending = true;
+                }
+            }
+        }
+        for (size_t i = 0; i < num_followed; ++i) {
+            if (followed[i].pending) {
+                followed[i].pending = false;
+                catch_up(&followed[i], inotify_fd, err);
+            }
+        }
+    }
+
+    free(events);
+    for (size_t i = 0; i < num_followed; ++i) {
+        Followed* f = &followed[i];
+        if (f->fd >= 0) {
+            close_followed(f, inotify_fd);
+        }
+        destroy_line_scanner(&f->scanner);
+        destroy_match_scratch(&f->scratch);
+        free(f->dir);
+    }
+    free(followed);
+    close(inotify_fd);
+    return false;
+}
@@ -0,0 +1,17 @@
+#ifndef __follow_h__
+#define __follow_h__
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "regex.h"
+#include "search.h"
+
+// Search the files named in the null-terminated array `paths`, and then keep watching them (with inotify),
+// matching lines as they are appended. A file that is truncated is followed from its start again,
+// and a file that is replaced (as when a log is rotated) is followed under its name, once the old one is read to the end.
+// Matches are printed to `out`, and files that can not be followed are reported to `err`
+// Only returns (false) if nothing can be watched
+bool follow_files(const Regex* regex, char** paths, FILE* out, FILE* err, const SearchOptions* opts);
+
+#endif
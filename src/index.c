@@ -0,0 +1,509 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "index.h"
+#include "input.h"
+#include "trigram.h"
+#include "walk.h"
+#include "util.h"
+
+//
+// This file contains the trigram index behind `--index` and `--use-index`.
+//
+// The index lists every file it was built from, and for each trigram, which of those files contain it
+// (the files' decompressed contents, if they are compressed). A search works out which trigrams a match needs
+// (see trigram.c) and only reads the files that have them, plus any that changed since the index was built.
+//
+// On disk, in the byte order of the machine that built it:
+//     the magic number INDEX_MAGIC
+//     uint32 number of files, uint32 number of trigrams
+//     for each file: uint64 size, int64 modification time (ns), uint32 length of the path, then the path
+//     for each trigram, in increasing order: uint32 trigram, uint32 number of files that have it
+//     for each trigram, in the same order: the uint32 ids (positions in the file list) of those files, in increasing order
+//
+
+#define INDEX_MAGIC "MYGREPI1"
+#define INDEX_MAGIC_LEN 8
+
+// how much input we read at once
+#define INDEX_READ_SIZE (256 * 1024)
+// how much of a file we inspect to decide if it is binary (the same as `-r`)
+#define SNIFF_SIZE 4096
+
+typedef struct {
+    // dynamically allocated
+    char* path;
+    uint64_t size;
+    int64_t mtime_ns;
+} IndexedFile;
+
+typedef struct {
+    // dynamically allocated array of the files indexed so far
+    IndexedFile* files;
+    size_t num_files;
+    size_t cap_files;
+    // dynamically allocated array of (trigram << 32) | file id, for every trigram of every file
+    uint64_t* pairs;
+    size_t num_pairs;
+    size_t cap_pairs;
+    // a bit for each trigram, set if the file being read has it
+    uint64_t* seen;
+    char* buf;
+    // set if any file could not be read
+    bool failed;
+} IndexBuilder;
+
+typedef struct {
+    // dynamically allocated array of files
+    IndexedFile* files;
+    size_t num_files;
+    // dynamically allocated array of the trigrams any file has, in increasing order
+    Trigram* trigrams;
+    size_t num_trigrams;
+    // the files that have trigrams[i] are postings[postings_beg[i] .. postings_beg[i + 1])
+    size_t* postings_beg;
+    uint32_t* postings;
+} TrigramIndex;
+
+int64_t mtime_ns_of(const struct stat* st) {
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+void push_pair(IndexBuilder* b, uint64_t pair) {
+    if (b->num_pairs >= b->cap_pairs) {
+        size_t new_cap = b->cap_pairs == 0 ? 1024 : 2 * b->cap_pairs;
+        uint64_t* new_pairs = realloc(b->pairs, new_cap * sizeof(uint64_t));
+        if (!new_pairs) {
+            out_of_memory();
+        }
+        b->pairs = new_pairs;
+        b->cap_pairs = new_cap;
+    }
+    b->pairs[b->num_pairs++] = pair;
+}
+
+void push_file(IndexBuilder* b, const char* path, const struct stat* st) {
+    if (b->num_files >= b->cap_files) {
+        size_t new_cap = b->cap_files == 0 ? 64 : 2 * b->cap_files;
+        IndexedFile* new_files = realloc(b->files, new_cap * sizeof(IndexedFile));
+        if (!new_files) {
+            out_of_memory();
+        }
+        b->files = new_files;
+        b->cap_files = new_cap;
+    }
+    IndexedFile* f = &b->files[b->num_files++];
+    f->path = make_copy(path);
+    f->size = st->st_size;
+    f->mtime_ns = mtime_ns_of(st);
+}
+
+// Add the trigrams of the open file `fd` to the index, as the next file.
+// Returns false if it could not be read to the end, in which case nothing is added
+bool read_trigrams(IndexBuilder* b, int fd, const char* path) {
+    uint64_t file_id = b->num_files;
+    size_t first_pair = b->num_pairs;
+    Input input;
+    bool opened = open_input(&input, fd, path);
+    bool ok = opened;
+    // the last three bytes read, and how many have been read (up to three)
+    uint32_t window = 0;
+    int known = 0;
+    while (ok) {
+        ssize_t got = read_input(&input, b->buf, INDEX_READ_SIZE);
+        if (got < 0) {
+            ok = false;
+        }
+        if (got <= 0) {
+            break;
+        }
+        for (ssize_t i = 0; i < got; ++i) {
+            window = ((window << 8) | (unsigned char)b->buf[i]) & (NUM_TRIGRAMS - 1);
+            if (known < 3) {
+                ++known;
+                if (known < 3) {
+                    continue;
+                }
+            }
+            uint64_t bit = (uint64_t)1 << (window & 63);
+            if (!(b->seen[window >> 6] & bit)) {
+                b->seen[window >> 6] |= bit;
+                push_pair(b, ((uint64_t)window << 32) | file_id);
+            }
+        }
+    }
+    if (opened) {
+        close_input(&input);
+    }
+    // every bit set for this file is one of its pairs
+    for (size_t i = first_pair; i < b->num_pairs; ++i) {
+        Trigram trigram = b->pairs[i] >> 32;
+        b->seen[trigram >> 6] &= ~((uint64_t)1 << (trigram & 63));
+    }
+    if (!ok) {
+        b->num_pairs = first_pair;
+    }
+    return ok;
+}
+
+void index_file(IndexBuilder* b, const char* path) {
+    int fd = open(path, O_RDONLY | O_NOCTTY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "ERROR: Can not open input file `%s` to read, skipping...\n", path);
+        b->failed = true;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    // a null byte in the first block means this is not text (unless it is compressed text)
+    char sniff[SNIFF_SIZE];
+    ssize_t sniffed = pread(fd, sniff, SNIFF_SIZE, 0);
+    if (sniffed > 0 && !is_compressed(sniff, sniffed) && memchr(sniff, '\0', sniffed)) {
+        close(fd);
+        return;
+    }
+    if (read_trigrams(b, fd, path)) {
+        push_file(b, path, &st);
+    } else {
+        fprintf(stderr, "ERROR: Can not read input file `%s`, skipping...\n", path);
+        b->failed = true;
+    }
+    close(fd);
+}
+
+// Index every regular file below the directory at `path` (never following symbolic links, as with -r)
+void index_dir(IndexBuilder* b, const char* path) {
+    DIR* dir = opendir(path);
+    if (!dir) {
+        fprintf(stderr, "ERROR: Can not open directory `%s` to read, skipping...\n", path);
+        b->failed = true;
+        return;
+    }
+    struct dirent* ent;
+    while ((ent = readdir(dir))) {
+        const char* name = ent->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+        unsigned char type = ent->d_type;
+        if (type == DT_UNKNOWN) {
+            // not every file system fills in the type, so ask for it
+            struct stat st;
+            if (fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                continue;
+            }
+            if (S_ISDIR(st.st_mode)) {
+                type = DT_DIR;
+            } else if (S_ISREG(st.st_mode)) {
+                type = DT_REG;
+            }
+        }
+        if (type == DT_DIR || type == DT_REG) {
+            char* child = join_path(path, name);
+            if (type == DT_DIR) {
+                index_dir(b, child);
+            } else {
+                index_file(b, child);
+            }
+            free(child);
+        }
+    }
+    closedir(dir);
+}
+
+int compare_pairs(const void* a, const void* b) {
+    uint64_t pa = *(const uint64_t*)a;
+    uint64_t pb = *(const uint64_t*)b;
+    return (pa > pb) - (pa < pb);
+}
+
+// Write the index to `out`, returning false if any write fails
+bool write_index(IndexBuilder* b, FILE* out) {
+    qsort(b->pairs, b->num_pairs, sizeof(uint64_t), compare_pairs);
+    uint32_t num_files = b->num_files;
+    uint32_t num_trigrams = 0;
+    for (size_t i = 0; i < b->num_pairs; ++i) {
+        if (i == 0 || (b->pairs[i] >> 32) != (b->pairs[i - 1] >> 32)) {
+            ++num_trigrams;
+        }
+    }
+    fwrite(INDEX_MAGIC, 1, INDEX_MAGIC_LEN, out);
+    fwrite(&num_files, sizeof(uint32_t), 1, out);
+    fwrite(&num_trigrams, sizeof(uint32_t), 1, out);
+    for (size_t i = 0; i < b->num_files; ++i) {
+        const IndexedFile* f = &b->files[i];
+        uint32_t path_len = strlen(f->path);
+        fwrite(&f->size, sizeof(uint64_t), 1, out);
+        fwrite(&f->mtime_ns, sizeof(int64_t), 1, out);
+        fwrite(&path_len, sizeof(uint32_t), 1, out);
+        fwrite(f->path, 1, path_len, out);
+    }
+    for (size_t i = 0; i < b->num_pairs;) {
+        uint32_t trigram = b->pairs[i] >> 32;
+        size_t j = i;
+        while (j < b->num_pairs && (b->pairs[j] >> 32) == trigram) {
+            ++j;
+        }
+        uint32_t num_postings = j - i;
+        fwrite(&trigram, sizeof(uint32_t), 1, out);
+        fwrite(&num_postings, sizeof(uint32_t), 1, out);
+        i = j;
+    }
+    for (size_t i = 0; i < b->num_pairs; ++i) {
+        uint32_t file_id = (uint32_t)b->pairs[i];
+        fwrite(&file_id, sizeof(uint32_t), 1, out);
+    }
+    return !ferror(out);
+}
+
+bool build_index(const char* index_path, char** paths) {
+    IndexBuilder b;
+    b.files = NULL;
+    b.num_files = 0;
+    b.cap_files = 0;
+    b.pairs = NULL;
+    b.num_pairs = 0;
+    b.cap_pairs = 0;
+    b.seen = alloc_or_die(NUM_TRIGRAMS / 64, sizeof(uint64_t));
+    b.buf = alloc_or_die(INDEX_READ_SIZE, 1);
+    b.failed = false;
+
+    for (; *paths; ++paths) {
+        struct stat st;
+        if (stat(*paths, &st) == 0 && S_ISDIR(st.st_mode)) {
+            index_dir(&b, *paths);
+        } else {
+            index_file(&b, *paths);
+        }
+    }
+
+    // written beside the old index and moved over it, so a search never sees half of one
+    char* tmp_path = alloc_or_die(strlen(index_path) + strlen(".tmp") + 1, 1);
+    strcpy(tmp_path, index_path);
+    strcat(tmp_path, ".tmp");
+    FILE* out = fopen(tmp_path, "wb");
+    bool written = out && write_index(&b, out);
+    if (out && fclose(out) != 0) {
+        written = false;
+    }
+    if (written && rename(tmp_path, index_path) != 0) {
+        written = false;
+    }
+    if (!written) {
+        fprintf(stderr, "ERROR: Can not write the index `%s`\n", index_path);
+        unlink(tmp_path);
+    }
+
+    free(tmp_path);
+    for (size_t i = 0; i < b.num_files; ++i) {
+        free(b.files[i].path);
+    }
+    free(b.files);
+    free(b.pairs);
+    free(b.seen);
+    free(b.buf);
+    return written && !b.failed;
+}
+
+
+// =================================================================================
+//                               Reading an index
+// =================================================================================
+
+// Copy the next `len` bytes of `data` to `out`, returning false if there are not that many left
+bool take_bytes(const char* data, size_t data_len, size_t* pos, void* out, size_t len) {
+    if (data_len - *pos < len) {
+        return false;
+    }
+    memcpy(out, data + *pos, len);
+    *pos += len;
+    return true;
+}
+
+void destroy_index(const TrigramIndex* index) {
+    for (size_t i = 0; i < index->num_files; ++i) {
+        free(index->files[i].path);
+    }
+    free(index->files);
+    free(index->trigrams);
+    free(index->postings_beg);
+    free(index->postings);
+}
+
+// Parse the `len` bytes of an index at `data`
+// Returns false if they are not an index (everything parsed so far is still destroyed by `destroy_index`)
+bool parse_index(TrigramIndex* index, const char* data, size_t len) {
+    size_t pos = 0;
+    char magic[INDEX_MAGIC_LEN];
+    uint32_t num_files;
+    uint32_t num_trigrams;
+    if (  !take_bytes(data, len, &pos, magic, INDEX_MAGIC_LEN)
+       || memcmp(magic, INDEX_MAGIC, INDEX_MAGIC_LEN) != 0
+       || !take_bytes(data, len, &pos, &num_files, sizeof(uint32_t))
+       || !take_bytes(data, len, &pos, &num_trigrams, sizeof(uint32_t))
+       || num_files > len || num_trigrams > len)
+    {
+        return false;
+    }
+    index->files = alloc_or_die(num_files + 1, sizeof(IndexedFile));
+    for (; index->num_files < num_files; ++index->num_files) {
+        IndexedFile* f = &index->files[index->num_files];
+        uint32_t path_len;
+        if (  !take_bytes(data, len, &pos, &f->size, sizeof(uint64_t))
+           || !take_bytes(data, len, &pos, &f->mtime_ns, sizeof(int64_t))
+           || !take_bytes(data, len, &pos, &path_len, sizeof(uint32_t))
+           || len - pos < path_len)
+        {
+            return false;
+        }
+        f->path = copy_between(data + pos, data + pos + path_len);
+        pos += path_len;
+    }
+    index->trigrams = alloc_or_die(num_trigrams + 1, sizeof(Trigram));
+    index->postings_beg = alloc_or_die(num_trigrams + 1, sizeof(size_t));
+    index->num_trigrams = num_trigrams;
+    for (size_t i = 0; i < num_trigrams; ++i) {
+        uint32_t num_postings;
+        if (  !take_bytes(data, len, &pos, &index->trigrams[i], sizeof(uint32_t))
+           || !take_bytes(data, len, &pos, &num_postings, sizeof(uint32_t)))
+        {
+            return false;
+        }
+        index->postings_beg[i + 1] = index->postings_beg[i] + num_postings;
+    }
+    size_t num_postings = index->postings_beg[num_trigrams];
+    if ((len - pos) / sizeof(uint32_t) < num_postings) {
+        return false;
+    }
+    index->postings = alloc_or_die(num_postings + 1, sizeof(uint32_t));
+    take_bytes(data, len, &pos, index->postings, num_postings * sizeof(uint32_t));
+    for (size_t i = 0; i < num_postings; ++i) {
+        if (index->postings[i] >= num_files) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Read the index at `path`, returning false (with a message printed to `err`) if it can not be read
+bool load_index(TrigramIndex* index, const char* path, FILE* err) {
+    index->files = NULL;
+    index->num_files = 0;
+    index->trigrams = NULL;
+    index->num_trigrams = 0;
+    index->postings_beg = NULL;
+    index->postings = NULL;
+
+    FILE* file = fopen(path, "rb");
+    struct stat st;
+    if (!file || fstat(fileno(file), &st) != 0) {
+        fprintf(err, "ERROR: Can not open the index `%s` to read\n", path);
+        if (file) {
+            fclose(file);
+        }
+        return false;
+    }
+    size_t len = st.st_size;
+    char* data = alloc_or_die(len + 1, 1);
+    bool ok = fread(data, 1, len, file) == len && parse_index(index, data, len);
+    if (!ok) {
+        fprintf(err, "ERROR: `%s` is not an index, or it is corrupt (build it again with --index)\n", path);
+        destroy_index(index);
+    }
+    free(data);
+    fclose(file);
+    return ok;
+}
+
+// Returns the position of `trigram` in the index, or -1 if no file has it
+ssize_t find_trigram(const TrigramIndex* index, Trigram trigram) {
+    size_t lo = 0;
+    size_t hi = index->num_trigrams;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (index->trigrams[mid] < trigram) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < index->num_trigrams && index->trigrams[lo] == trigram ? (ssize_t)lo : -1;
+}
+
+// Set wanted[i] for every file whose trigrams satisfy `query`
+void find_candidates(const TrigramIndex* index, const TrigramQuery* query, bool* wanted) {
+    uint32_t* counts = alloc_or_die(index->num_files + 1, sizeof(uint32_t));
+    for (size_t c = 0; c < query->num_clauses; ++c) {
+        const TrigramClause* clause = &query->clauses[c];
+        // count, for each file, how many of the clause's trigrams it has
+        memset(counts, 0, index->num_files * sizeof(uint32_t));
+        bool possible = true;
+        for (size_t k = 0; k < clause->num_trigrams && possible; ++k) {
+            ssize_t t = find_trigram(index, clause->trigrams[k]);
+            if (t < 0) {
+                possible = false;
+                break;
+            }
+            for (size_t p = index->postings_beg[t]; p < index->postings_beg[t + 1]; ++p) {
+                counts[index->postings[p]] += 1;
+            }
+        }
+        for (size_t i = 0; i < index->num_files && possible; ++i) {
+            if (counts[i] == clause->num_trigrams) {
+                wanted[i] = true;
+            }
+        }
+    }
+    free(counts);
+}
+
+bool search_indexed(const Regex* regex, MatchScratch* scratch, FILE* out, FILE* err, const SearchOptions* opts) {
+    TrigramIndex index;
+    if (!load_index(&index, opts->index_path, err)) {
+        return false;
+    }
+    TrigramQuery query;
+    required_trigrams(regex, &query);
+    bool* wanted = alloc_or_die(index.num_files + 1, sizeof(bool));
+    find_candidates(&index, &query, wanted);
+
+    bool ok = true;
+    for (size_t i = 0; i < index.num_files; ++i) {
+        const IndexedFile* f = &index.files[i];
+        struct stat st;
+        if (stat(f->path, &st) != 0) {
+            fprintf(err, "ERROR: Can not open input file `%s` to read, skipping...\n", f->path);
+            ok = false;
+            continue;
+        }
+        // what the index says about a file that has changed since can not be trusted
+        bool changed = (uint64_t)st.st_size != f->size || mtime_ns_of(&st) != f->mtime_ns;
+        if (!wanted[i] && !changed) {
+            continue;
+        }
+        FILE* file = fopen(f->path, "r");
+        if (!file) {
+            fprintf(err, "ERROR: Can not open input file `%s` to read, skipping...\n", f->path);
+            ok = false;
+            continue;
+        }
+        if (!match_lines_with(regex, scratch, file, f->path, out, true, opts)) {
+            ok = false;
+        }
+        fclose(file);
+    }
+
+    free(wanted);
+    destroy_trigram_query(&query);
+    destroy_index(&index);
+    return ok;
+}
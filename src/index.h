@@ -0,0 +1,21 @@
+#ifndef __index_h__
+#define __index_h__
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "regex.h"
+#include "search.h"
+
+// Write a trigram index of every text file in `paths` (searching directories recursively) to the file `index_path`
+// Returns false (with a message printed to stderr) if the index could not be written.
+// Files that can not be read are reported and left out
+bool build_index(const char* index_path, char** paths);
+
+// Search the files in the index at `opts->index_path` that could have a match, according to their trigrams,
+// along with any that changed since the index was built. Lines are labeled with the file they came from, as with -r.
+// Matches are printed to `out`, and files that can not be searched are reported to `err`
+// Returns false if the index or any file could not be read
+bool search_indexed(const Regex* regex, MatchScratch* scratch, FILE* out, FILE* err, const SearchOptions* opts);
+
+#endif
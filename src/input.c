@@ -0,0 +1,402 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "input.h"
+#include "util.h"
+
+//
+// This file contains where input comes from, and how compressed input is decompressed.
+// Decompression runs on a thread of its own, handing blocks of decompressed bytes to the matcher
+// through a small bounded queue, so that decompressing one block overlaps with matching the last.
+//
+
+// how many bytes of compressed input we read at once
+#define COMPRESSED_READ_SIZE (128 * 1024)
+// how many decompressed bytes are in each block handed to the matcher
+#define DECOMPRESSED_BLOCK_SIZE (256 * 1024)
+// how many decompressed blocks may be waiting for the matcher
+#define QUEUE_LEN 4
+
+static const unsigned char GZIP_MAGIC[] = { 0x1f, 0x8b };
+static const unsigned char ZSTD_MAGIC[] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+enum Codec {
+    CODEC_GZIP,
+    CODEC_ZSTD,
+};
+
+typedef struct {
+    char* data;
+    size_t len;
+} Block;
+
+struct Decompressor_s {
+    Input* in;
+    enum Codec codec;
+    const char* name;
+    // where the thread's error messages go: the same place as those of the matcher
+    FILE* err;
+    pthread_t thread;
+    // guards every field below
+    pthread_mutex_t lock;
+    // signalled whenever a block is pushed or popped, or the stream ends or is cancelled
+    pthread_cond_t changed;
+    // circular queue of decompressed blocks waiting for the matcher
+    Block queue[QUEUE_LEN];
+    size_t queue_beg;
+    size_t queue_len;
+    // set by the thread once it has pushed its last block
+    bool done;
+    // set by the thread if the stream is corrupt or unreadable
+    bool failed;
+    // set by the matcher if it stops reading before the end
+    bool cancelled;
+    // the block the matcher is reading from (not guarded: only the matcher touches it)
+    Block curr;
+    size_t curr_pos;
+};
+
+bool is_compressed(const char* buf, size_t len) {
+    if (len >= sizeof(GZIP_MAGIC) && memcmp(buf, GZIP_MAGIC, sizeof(GZIP_MAGIC)) == 0) {
+        return true;
+    }
+    if (len >= sizeof(ZSTD_MAGIC) && memcmp(buf, ZSTD_MAGIC, sizeof(ZSTD_MAGIC)) == 0) {
+        return true;
+    }
+    return false;
+}
+
+// read() from `fd`, starting over if we are interrupted by a signal
+ssize_t read_retry(int fd, char* buf, size_t cap) {
+    while (1) {
+        ssize_t got = read(fd, buf, cap);
+        if (got >= 0 || errno != EINTR) {
+            return got;
+        }
+    }
+}
+
+// The raw (possibly compressed) bytes of the input: first the sniffed head, then the rest of the file
+ssize_t read_raw(Input* in, char* buf, size_t cap) {
+    if (in->head_pos < in->head_len) {
+        size_t n = in->head_len - in->head_pos;
+        if (n > cap) {
+            n = cap;
+        }
+        memcpy(buf, in->head + in->head_pos, n);
+        in->head_pos += n;
+        return n;
+    }
+    return read_retry(in->fd, buf, cap);
+}
+
+// Hand a full block to the matcher, waiting for room in the queue.
+// Returns false if the matcher has gone away
+bool push_block(Decompressor* d, Block block) {
+    pthread_mutex_lock(&d->lock);
+    while (d->queue_len == QUEUE_LEN && !d->cancelled) {
+        pthread_cond_wait(&d->changed, &d->lock);
+    }
+    bool cancelled = d->cancelled;
+    if (!cancelled) {
+        d->queue[(d->queue_beg + d->queue_len) % QUEUE_LEN] = block;
+        d->queue_len += 1;
+        pthread_cond_broadcast(&d->changed);
+    }
+    pthread_mutex_unlock(&d->lock);
+    if (cancelled) {
+        free(block.data);
+    }
+    return !cancelled;
+}
+
+// A fresh, empty block to decompress into
+Block new_block() {
+    Block block;
+    block.data = alloc_or_die(DECOMPRESSED_BLOCK_SIZE, 1);
+    block.len = 0;
+    return block;
+}
+
+// Decompress gzip members (one after another, as `cat a.gz b.gz` produces) into blocks
+// Returns false if the stream is corrupt, unreadable, or the matcher went away
+bool inflate_gzip(Decompressor* d) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // 15 bits of window, +16 to expect a gzip header
+    if (inflateInit2(&zs, 15 + 16) != Z_OK) {
+        return false;
+    }
+    char* raw = alloc_or_die(COMPRESSED_READ_SIZE, 1);
+    Block block = new_block();
+    bool at_eof = false;
+    bool in_member = true;
+    bool ok = true;
+    while (ok) {
+        if (zs.avail_in == 0 && !at_eof) {
+            ssize_t got = read_raw(d->in, raw, COMPRESSED_READ_SIZE);
+            if (got < 0) {
+                ok = false;
+                break;
+            }
+            at_eof = got == 0;
+            zs.next_in = (Bytef*)raw;
+            zs.avail_in = got;
+        }
+        if (zs.avail_in == 0 && at_eof) {
+            // a member cut off in the middle is corrupt
+            ok = !in_member;
+            break;
+        }
+        if (!in_member) {
+            // more input after the end of a member is the start of the next one
+            inflateReset(&zs);
+            in_member = true;
+        }
+        zs.next_out = (Bytef*)block.data + block.len;
+        zs.avail_out = DECOMPRESSED_BLOCK_SIZE - block.len;
+        int ret = inflate(&zs, Z_NO_FLUSH);
+        block.len = DECOMPRESSED_BLOCK_SIZE - zs.avail_out;
+        if (ret == Z_STREAM_END) {
+            in_member = false;
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            ok = false;
+        }
+        if (block.len == DECOMPRESSED_BLOCK_SIZE) {
+            if (!push_block(d, block)) {
+                ok = false;
+            }
+            block = new_block();
+        }
+    }
+    // what was decompressed before the stream went wrong is still matched, before the error is reported
+    if (block.len > 0) {
+        ok = push_block(d, block) && ok;
+    } else {
+        free(block.data);
+    }
+    free(raw);
+    inflateEnd(&zs);
+    return ok;
+}
+
+#ifdef HAVE_ZSTD
+// Decompress zstd frames (one after another) into blocks
+// Returns false if the stream is corrupt, unreadable, or the matcher went away
+bool decompress_zstd(Decompressor* d) {
+    ZSTD_DStream* zs = ZSTD_createDStream();
+    if (!zs) {
+        return false;
+    }
+    ZSTD_initDStream(zs);
+    char* raw = alloc_or_die(COMPRESSED_READ_SIZE, 1);
+    ZSTD_inBuffer zin = { raw, 0, 0 };
+    Block block = new_block();
+    bool at_eof = false;
+    // the value of the last ZSTD_decompressStream call: 0 between frames
+    size_t hint = 0;
+    bool ok = true;
+    while (ok) {
+        if (zin.pos == zin.size && !at_eof) {
+            ssize_t got = read_raw(d->in, raw, COMPRESSED_READ_SIZE);
+            if (got < 0) {
+                ok = false;
+                break;
+            }
+            at_eof = got == 0;
+            zin.size = got;
+            zin.pos = 0;
+        }
+        if (zin.pos == zin.size && at_eof) {
+            // a frame cut off in the middle is corrupt
+            ok = hint == 0;
+            break;
+        }
+        ZSTD_outBuffer zout = { block.data, DECOMPRESSED_BLOCK_SIZE, block.len };
+        hint = ZSTD_decompressStream(zs, &zout, &zin);
+        block.len = zout.pos;
+        if (ZSTD_isError(hint)) {
+            ok = false;
+        }
+        if (block.len == DECOMPRESSED_BLOCK_SIZE) {
+            if (!push_block(d, block)) {
+                ok = false;
+            }
+            block = new_block();
+        }
+    }
+    // what was decompressed before the stream went wrong is still matched, before the error is reported
+    if (block.len > 0) {
+        ok = push_block(d, block) && ok;
+    } else {
+        free(block.data);
+    }
+    free(raw);
+    ZSTD_freeDStream(zs);
+    return ok;
+}
+#endif
+
+void* decompress_worker(void* arg) {
+    Decompressor* d = arg;
+    set_error_output(d->err);
+    // running out of memory fails the stream (losing whatever the decompressor had), not the whole search
+    volatile bool ok = false;
+    jmp_buf env;
+    catch_out_of_memory(&env);
+    if (setjmp(env) == 0) {
+        switch (d->codec) {
+            case CODEC_GZIP:
+                ok = inflate_gzip(d);
+                break;
+            case CODEC_ZSTD:
+#ifdef HAVE_ZSTD
+                ok = decompress_zstd(d);
+#endif
+                break;
+        }
+    }
+    catch_out_of_memory(NULL);
+    pthread_mutex_lock(&d->lock);
+    d->done = true;
+    d->failed = !ok && !d->cancelled;
+    pthread_cond_broadcast(&d->changed);
+    pthread_mutex_unlock(&d->lock);
+    return NULL;
+}
+
+bool open_input(Input* in, int fd, const char* name) {
+    in->fd = fd;
+    in->head_len = 0;
+    in->head_pos = 0;
+    in->decomp = NULL;
+    // a pipe may hand us fewer bytes than we ask for, so keep asking until we know
+    while (in->head_len < MAGIC_LEN) {
+        ssize_t got = read_retry(fd, in->head + in->head_len, MAGIC_LEN - in->head_len);
+        if (got < 0) {
+            fprintf(stderr, "ERROR: Can not read input file `%s`\n", name);
+            return false;
+        }
+        if (got == 0) {
+            break;
+        }
+        in->head_len += got;
+    }
+    if (!is_compressed(in->head, in->head_len)) {
+        return true;
+    }
+
+    enum Codec codec = CODEC_GZIP;
+    if (in->head_len >= sizeof(ZSTD_MAGIC) && memcmp(in->head, ZSTD_MAGIC, sizeof(ZSTD_MAGIC)) == 0) {
+        codec = CODEC_ZSTD;
+#ifndef HAVE_ZSTD
+        fprintf(stderr, "ERROR: `%s` is zstd compressed, but mygrep was built without zstd support\n", name);
+        return false;
+#endif
+    }
+    Decompressor* d = alloc_or_die(1, sizeof(Decompressor));
+    d->in = in;
+    d->codec = codec;
+    d->name = name;
+    d->err = error_output();
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->changed, NULL);
+    d->queue_beg = 0;
+    d->queue_len = 0;
+    d->done = false;
+    d->failed = false;
+    d->cancelled = false;
+    d->curr.data = NULL;
+    d->curr.len = 0;
+    d->curr_pos = 0;
+    if (pthread_create(&d->thread, NULL, decompress_worker, d) != 0) {
+        fprintf(stderr, "ERROR: Can not start a thread to decompress `%s`\n", name);
+        pthread_cond_destroy(&d->changed);
+        pthread_mutex_destroy(&d->lock);
+        free(d);
+        return false;
+    }
+    in->decomp = d;
+    return true;
+}
+
+void open_plain_input(Input* in, int fd) {
+    in->fd = fd;
+    in->head_len = 0;
+    in->head_pos = 0;
+    in->decomp = NULL;
+}
+
+// Take the next decompressed block off the queue, waiting for one if needed.
+// Returns false at the end of the stream
+bool pop_block(Decompressor* d) {
+    free(d->curr.data);
+    d->curr.data = NULL;
+    d->curr.len = 0;
+    d->curr_pos = 0;
+
+    pthread_mutex_lock(&d->lock);
+    while (d->queue_len == 0 && !d->done) {
+        pthread_cond_wait(&d->changed, &d->lock);
+    }
+    bool got_block = d->queue_len > 0;
+    if (got_block) {
+        d->curr = d->queue[d->queue_beg];
+        d->queue_beg = (d->queue_beg + 1) % QUEUE_LEN;
+        d->queue_len -= 1;
+        pthread_cond_broadcast(&d->changed);
+    }
+    pthread_mutex_unlock(&d->lock);
+    return got_block;
+}
+
+ssize_t read_input(Input* in, char* buf, size_t cap) {
+    Decompressor* d = in->decomp;
+    if (!d) {
+        return read_raw(in, buf, cap);
+    }
+    if (d->curr_pos == d->curr.len && !pop_block(d)) {
+        // no more blocks: either that is the end, or something went wrong
+        if (d->failed) {
+            fprintf(stderr, "ERROR: compressed input `%s` is corrupt or unreadable\n", d->name);
+            return -1;
+        }
+        return 0;
+    }
+    size_t n = d->curr.len - d->curr_pos;
+    if (n > cap) {
+        n = cap;
+    }
+    memcpy(buf, d->curr.data + d->curr_pos, n);
+    d->curr_pos += n;
+    return n;
+}
+
+void close_input(Input* in) {
+    Decompressor* d = in->decomp;
+    if (!d) {
+        return;
+    }
+    pthread_mutex_lock(&d->lock);
+    d->cancelled = true;
+    pthread_cond_broadcast(&d->changed);
+    pthread_mutex_unlock(&d->lock);
+    pthread_join(d->thread, NULL);
+
+    free(d->curr.data);
+    for (size_t i = 0; i < d->queue_len; ++i) {
+        free(d->queue[(d->queue_beg + i) % QUEUE_LEN].data);
+    }
+    pthread_cond_destroy(&d->changed);
+    pthread_mutex_destroy(&d->lock);
+    free(d);
+    in->decomp = NULL;
+}
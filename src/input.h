@@ -0,0 +1,43 @@
+#ifndef __input_h__
+#define __input_h__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// how many bytes we need to see to recognize a compressed stream
+#define MAGIC_LEN 4
+
+typedef struct Decompressor_s Decompressor;
+
+// A source of input bytes, which are transparently decompressed if the file turns out to be compressed
+typedef struct {
+    int fd;
+    // the first bytes of `fd`, which we read to look for a magic number
+    char head[MAGIC_LEN];
+    size_t head_len;
+    size_t head_pos;
+    // NULL for plain input, otherwise the thread decompressing `fd`
+    Decompressor* decomp;
+} Input;
+
+// Returns true if the `len` bytes at `buf` begin with the magic number of a gzip or zstd stream
+bool is_compressed(const char* buf, size_t len);
+
+// Start reading from `fd`, looking at the first few bytes to see if it is compressed.
+// If it is, a thread is started to decompress it ahead of whoever calls `read_input`.
+// `name` is only used for error messages.
+// Returns false (and prints a message to stderr) if the input can not be read
+bool open_input(Input* in, int fd, const char* name);
+
+// Start reading from `fd`, which is known not to be compressed (and may be some way into the file already)
+void open_plain_input(Input* in, int fd);
+
+// Fill up to `cap` bytes of `buf` with the next bytes of input
+// Returns how many bytes were read, 0 at the end of input, or -1 if the input is corrupt or unreadable
+ssize_t read_input(Input* in, char* buf, size_t cap);
+
+// Stop any decompression thread and free its memory. Does not close `fd`
+void close_input(Input* in);
+
+#endif
@@ -2,107 +2,162 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <ctype.h>
+#include <unistd.h>
 
+#include "index.h"
 #include "regex.h"
+#include "report.h"
+#include "search.h"
+#include "server.h"
 #include "util.h"
 
-#define MAX_LINE_SIZE 1024
-
-// Use the compiled regex object to read lines from the open file 
-// trim_to_match - flag to indicate if we should only print the matched segment
-// print_captures - flag indicating if we print out all of the captured groups
-void match_lines(const Regex* regex, FILE* file, bool trim_to_match, bool print_captures) {
-    // put a null byte before the beginning of the line to help with the anchor testing
-    char buf[MAX_LINE_SIZE + 1];
-    buf[0] = '\0';
-    char* line = buf + 1;
-
-    while (1) {
-        char* ret = fgets(line, MAX_LINE_SIZE, file);
-        if (!ret) {
-            break; // stop reading
-        }
-        trim_newline(line);
-
-        Captures captures;
-        if (!is_match(regex, line, &captures)) {
-            continue;
-        }
-        if (trim_to_match) {
-            size_t _num;
-            StrView s = get_capts(&captures, 0, &_num)[0]; // capture group 0 is the whole regex
-            printf("%.*s\n", (int)s.len, s.beg);
-        } else {
-            printf("%s\n", line);
-        }
-        if (print_captures) {
-            for (size_t group_idx = 1; group_idx < captures.num_groups; ++group_idx) {
-                size_t num;
-                StrView* capts = get_capts(&captures, group_idx, &num);
-                printf("    [%ld]", group_idx);
-                for (size_t capt_idx = 0; capt_idx < num; ++capt_idx) {
-                    StrView s = capts[capt_idx];
-                    printf(" %.*s", (int)s.len, s.beg);
-                }
-                printf("\n");
-            }
+// Returns true if `str` can name a C function
+bool is_identifier(const char* str) {
+    if (!(isalpha((unsigned char)*str) || *str == '_')) {
+        return false;
+    }
+    for (; *str; ++str) {
+        if (!(isalnum((unsigned char)*str) || *str == '_')) {
+            return false;
         }
     }
-
+    return true;
 }
 
 int main(int argc, char** argv) {
     if (argc == 2 && strcmp(argv[1], "--help") == 0) {
         printf("HELP:\n");
         printf("USAGE: a.out <regex> [options] <input-file1> [ <input-file2> ... ]\n");
+        printf("       with no input files, or an input file of `-`, reads standard input\n");
         printf("OPTIONS: -t, --trim reports only matched portion, instead of entire line\n");
         printf("         -c, --print-captures prints the capture ( ) groups\n");
+        printf("         -o, --only-matching reports every match in the line, each on its own line\n");
+        printf("         -n, --line-number prefixes each printed line with its line number\n");
+        printf("         -b, --byte-offset prefixes each printed line with the byte offset of what is printed\n");
+        printf("         -u, --utf8 makes `.`, [ ] sets, \\W and \\D match whole UTF-8 characters instead of single bytes\n");
+        printf("         -r, --recursive searches every text file below any directory given as input\n");
+        printf("         --include=<glob> with -r, only searches files whose name matches <glob>\n");
+        printf("         --exclude=<glob> with -r, skips files and directories whose name matches <glob>\n");
+        printf("         -j <n>, --threads <n> with -r, walks directories with <n> threads\n");
+        printf("         --step-budget <n> with -c, how many steps finding the captures of a line may take\n");
+        printf("                           before switching to a slower engine that always finishes (0 for no limit)\n");
+        printf("         --report=json when done, writes to standard error how long reading and matching each input took\n");
+        printf("         -f, --follow keeps watching the input files once their end is reached, matching lines as they are appended\n");
+        printf("         --use-index=<index> searches the files in <index> that could have a match, instead of input files\n");
+        printf("INDEX:  a.out --index <index> <path1> [ <path2> ... ] writes a trigram index of every text file\n");
+        printf("                  in the paths (and below any directories) to <index>\n");
+        printf("EMIT C: a.out --emit-c <regex> [-u] [--name=<function>] writes to standard output a C file defining\n");
+        printf("                  int <function>(const char* buf, size_t len), which returns 1 if the line at buf matches\n");
+        printf("SERVER: a.out --serve <socket> [--cache-size <n>] searches for clients connecting to <socket>,\n");
+        printf("                  keeping <n> compiled regexes between searches\n");
+        printf("        a.out --client <socket> <regex> [options] [ <input-file1> ... ] has the server search\n");
         return EXIT_SUCCESS;
     }
-    if (argc < 3) {
+    if (argc < 2) {
         fprintf(stderr, "ERROR: Invalid arguments\n");
         fprintf(stderr, "USAGE: a.out <regex> [options] <input-file1> [ <input-file2> ... ]\n");
         fprintf(stderr, "USAGE: a.out --help\n");
         return EXIT_FAILURE;
     }
+    if (strcmp(argv[1], "--emit-c") == 0 && argc >= 3) {
+        const char* name = "mygrep_match";
+        for (char** arg = argv + 3; *arg; ++arg) {
+            if (strncmp(*arg, "--name=", strlen("--name=")) == 0) {
+                name = *arg + strlen("--name=");
+            }
+        }
+        if (!is_identifier(name)) {
+            fprintf(stderr, "ERROR: `%s` is not a C identifier\n", name);
+            return EXIT_FAILURE;
+        }
+        SearchOptions opts;
+        init_search_options(&opts);
+        int compile_flags = 0;
+        bool want_report = false;
+        bool parsed = parse_search_options(argv + 3, &opts, &compile_flags, &want_report, stderr) != NULL;
+        destroy_search_options(&opts);
+        Regex regex;
+        if (!parsed || !compile_with(&regex, argv[2], compile_flags)) {
+            return EXIT_FAILURE;
+        }
+        bool ok = emit_c(&regex, argv[2], name, stdout);
+        destroy_regex(&regex);
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (strcmp(argv[1], "--index") == 0 && argc >= 4) {
+        return build_index(argv[2], argv + 3) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (strcmp(argv[1], "--serve") == 0 && argc >= 3) {
+        size_t cache_size = DEFAULT_CACHE_SIZE;
+        if (argc >= 5 && strcmp(argv[3], "--cache-size") == 0) {
+            cache_size = strtoul(argv[4], NULL, 10);
+        }
+        serve(argv[2], cache_size);
+        return EXIT_FAILURE;
+    }
+    if (strcmp(argv[1], "--client") == 0 && argc >= 4) {
+        return run_client(argv[2], argv + 3);
+    }
+    uint64_t start_ns = now_ns();
     ++argv; // eat argv[0]
-    Regex regex;
-    compile(&regex, *argv);
+    // compiled once we know the options
+    const char* pattern = *argv;
+    int compile_flags = 0;
     ++argv;
 
+    SearchOptions opts;
+    init_search_options(&opts);
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_cpus > 0) {
+        opts.num_threads = num_cpus;
+    }
+    bool want_report = false;
+    argv = parse_search_options(argv, &opts, &compile_flags, &want_report, stderr);
+    if (!argv) {
+        destroy_search_options(&opts);
+        return EXIT_FAILURE;
+    }
+    Report report;
+    if (want_report) {
+        init_report(&report, start_ns);
+        opts.report = &report;
+    }
+
+    Regex regex;
+    uint64_t compile_start_ns = now_ns();
+    if (!compile_with(&regex, pattern, compile_flags)) {
+        destroy_search_options(&opts);
+        return EXIT_FAILURE;
+    }
+    if (opts.report) {
+        opts.report->compile_ns = now_ns() - compile_start_ns;
+    }
+
 #ifdef DEBUG
     debug_regex(&regex);
 #endif
-    
-    bool trim_to_match = false;
-    bool print_captures = false;
-    for (; *argv; ++argv) {
-        if (**argv != '-') {
-            break;
-        }
-        if (  strcmp(*argv, "-t") == 0
-           || strcmp(*argv, "--trim") == 0)
-        {
-            trim_to_match = true;
-        }
-        if (  strcmp(*argv, "-c") == 0
-           || strcmp(*argv, "--print-captures") == 0)
-        {
-            print_captures = true;
-        }
-    }
     int success = EXIT_SUCCESS; // set to EXIT_FAILURE if any problems occured
-   
-    for (; *argv; ++argv) {
-        FILE* file = fopen(*argv, "r");
-        if (!file) {
-            fprintf(stderr, "ERROR: Can not open input file `%s` to read, skipping...\n", *argv);
-            success = EXIT_FAILURE;
-            continue;
-        }
-        match_lines(&regex, file, trim_to_match, print_captures);
+
+    size_t num_fallbacks = 0;
+    opts.fallback_lines = &num_fallbacks;
+    MatchScratch scratch;
+    init_match_scratch(&scratch, &regex);
+    if (!search_inputs(&regex, &scratch, argv, stdin, stdout, stderr, &opts)) {
+        success = EXIT_FAILURE;
+    }
+    destroy_match_scratch(&scratch);
+
+    if (num_fallbacks > 0) {
+        fprintf(stderr, "NOTE: %ld line(s) went over the step budget, and their captures were found by the linear-time engine\n",
+                num_fallbacks);
+    }
+    if (opts.report) {
+        write_report_json(opts.report, stderr);
+        destroy_report(opts.report);
     }
 
+    destroy_search_options(&opts);
     destroy_regex(&regex);
 
     return success;
@@ -1,9 +1,12 @@
+#define _GNU_SOURCE
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "regex.h"
 #include "pattern.h"
+#include "util.h"
 
 //
 // This file performs the brute-force execution of an NFA,
@@ -15,14 +18,8 @@
 //      a Path struct is a growable array of non-owning Edge pointers
 // =================================================================================
 
-typedef struct {
-    Edge** edges;
-    size_t len;
-    size_t cap;
-} Path;
-
-// Add an edge pointer to the list of traversed edges.
-void push_edge(Path* path, Edge* e) {
+// Add an edge pointer to the list of traversed edges, whose target is entered at `input`
+void push_edge(Path* path, Edge* e, const char* input) {
     if (path->len >= path->cap) {
         size_t new_cap = 2 * path->cap;
         if (new_cap == 0) {
@@ -30,13 +27,25 @@ void push_edge(Path* path, Edge* e) {
         }
         Edge** new_edges = realloc(path->edges, sizeof(Edge*) * new_cap);
         if (!new_edges) {
-            fprintf(stderr, "ERROR: out of memory when realloc'ing `path->edges` from %ld to %ld\n", path->cap, new_cap);
-            exit(EXIT_FAILURE);
+            out_of_memory();
         }
         path->edges = new_edges;
+        // (each is kept as soon as it has moved, so the path can still be destroyed if the next can not)
+        const char** new_inputs = realloc(path->inputs, sizeof(const char*) * new_cap);
+        if (!new_inputs) {
+            out_of_memory();
+        }
+        path->inputs = new_inputs;
+        size_t* new_tried = realloc(path->tried, sizeof(size_t) * new_cap);
+        if (!new_tried) {
+            out_of_memory();
+        }
+        path->tried = new_tried;
         path->cap = new_cap;
     }
     path->edges[path->len] = e;
+    path->inputs[path->len] = input;
+    path->tried[path->len] = 0;
     ++path->len;
 }
 
@@ -53,13 +62,17 @@ Edge* pop_edge(Path* path) {
 // Initialize the Path's fields
 void init_path(Path* path) {
     path->edges = NULL;
+    path->inputs = NULL;
+    path->tried = NULL;
     path->len = 0;
     path->cap = 0;
 }
 
 // Free the memory allocated by this Path
-void destroy_path(Path* path) {
+void destroy_path(const Path* path) {
     free(path->edges);
+    free(path->inputs);
+    free(path->tried);
 }
 
 
@@ -72,31 +85,72 @@ void destroy_path(Path* path) {
 //                        The path searching functions
 // =================================================================================
 
-// modifies captures to include all the capture groups if it successfully matches
-// Returns true if there is a path starting at the Node object at `node` leading to an accepting state
-//    that consumes `input`.
+// Returns true if `path` already entered `node` at `input`, without consuming anything since:
+// entering it again would only go round a cycle of empty edges, and find nothing new
+bool on_empty_cycle(const Path* path, const Node* node, const char* input) {
+    for (size_t i = path->len; i > 0 && path->inputs[i - 1] == input; --i) {
+        if (path->edges[i - 1]->target == node) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns true if there is a path starting at the target of the last edge in `path` leading to an accepting state
+//    that consumes all of the input between where that edge left off (inclusive) and `end` (exclusive).
 // If so, that path is appended to `path`.
-bool search_from(const Node* node, const char* input, Path* path) {
-    if (*input == '\0') {
-        // it's over, now we see if we landed on an accepting node
-        return node->accepts;
-    }
-    // try each possible path from this point
-    for (size_t i = 0; i < node->num_edges; ++i) {
-        Edge* e = &node->edges[i];
-        Pattern* pat = &e->pat;
-        if (!pattern_matches(pat, *input)) {
+// The search is depth first, trying each node's edges in order, but keeps its place in `path`
+// rather than on the call stack, so a long input can not overflow it.
+// Each node visited spends a step of `budget`; once it runs out, the search gives up and returns false
+bool search_from(Path* path, const char* end, StepBudget* budget) {
+    // the edges before the last one are not ours to take back
+    size_t first = path->len;
+    bool entered = true;
+    while (path->len >= first) {
+        size_t top = path->len - 1;
+        const Node* node = path->edges[top]->target;
+        const char* input = path->inputs[top];
+        if (entered) {
+            entered = false;
+            if (!budget->unlimited) {
+                if (budget->left == 0) {
+                    budget->exhausted = true;
+                    return false;
+                }
+                --budget->left;
+            }
+            if (node->dead) {
+                // there is no point looking any further
+                pop_edge(path);
+                continue;
+            }
+            if (input == end && node->accepts) {
+                // it's over, and we landed on an accepting node
+                return true;
+            }
+        }
+        if (path->tried[top] == node->num_edges) {
+            // no match possible from here, so back up
+            pop_edge(path);
             continue;
         }
-        push_edge(path, e);
+        // try the next possible path from this point
+        Edge* e = &node->edges[path->tried[top]++];
+        Pattern* pat = &e->pat;
         size_t skip = pat_size(pat);
-        if (search_from(e->target, input + skip, path)) {
-            // we found the end!
-            return true;
+        if (input + skip > end) {
+            // out of input, but empty edges may still lead us to an accepting node
+            continue;
+        }
+        if (skip > 0 && !pattern_matches(pat, *input)) {
+            continue;
         }
-        pop_edge(path);
+        if (skip == 0 && on_empty_cycle(path, e->target, input)) {
+            continue;
+        }
+        push_edge(path, e, input + skip);
+        entered = true;
     }
-    // no match possible
     return false;
 }
 
@@ -114,7 +168,7 @@ StrView* captures_from_path(const Path* path, const char* input, size_t* match_c
             ++*match_count;
         }
     }
-    StrView* captures = malloc(*match_count * sizeof(StrView));
+    StrView* captures = alloc_or_die(*match_count, sizeof(StrView));
     size_t capt_idx = 0;
 
     enum State { LOOKING_FOR_BEG, LOOKING_FOR_END };
@@ -123,57 +177,200 @@ StrView* captures_from_path(const Path* path, const char* input, size_t* match_c
 
     for (size_t i = 0; i < path->len; ++i) {
         Edge* e = path->edges[i];
-        if (state == LOOKING_FOR_BEG && (e->target->beg_capts & grp)) {
-            beg = input;
-            state = LOOKING_FOR_END;
-        }
-        // no `else if`: we want to find captures that might take place over a single node
+        // we are inside `e->target` only after consuming what `e` matched
+        const char* after = input + pat_size(&e->pat);
+        // the end comes first: between two repititions of a group,
+        // the same node ends one capture and begins the next
         if (state == LOOKING_FOR_END && (e->target->end_capts & grp)) {
             captures[capt_idx].beg = beg;
-            captures[capt_idx].len = (input + 1) - beg;
+            captures[capt_idx].len = after - beg;
             ++capt_idx;
             state = LOOKING_FOR_BEG;
         }
+        if (state == LOOKING_FOR_BEG && (e->target->beg_capts & grp)) {
+            beg = after;
+            state = LOOKING_FOR_END;
+        }
         input += pat_size(&e->pat);
     }
+    // a capture that never ended (because the group was bypassed) does not count
+    *match_count = capt_idx;
 
     return captures;
 }
 
-// Returns true if the regex object at regex matches the input.
+// Search for a path through `regex` that consumes the `len` bytes at `input`, leaving it in `path`
+// `dummy` is the storage for the edge that leads into the initial node, and must outlive the path
+// The search takes at most `step_budget` steps (0 for no limit): if it returns false with `budget->exhausted` set,
+// it gave up before finding out if there is a path
+bool find_path(const Regex* regex, const char* input, size_t len, Path* path, Edge* dummy,
+               size_t step_budget, StepBudget* budget)
+{
+    dummy->pat = EMPTY_PATTERN;
+    dummy->target = regex->initial;
+    path->len = 0;
+    push_edge(path, dummy, input);
+    budget->left = step_budget;
+    budget->unlimited = step_budget == 0;
+    budget->exhausted = false;
+    return search_from(path, input + len, budget);
+}
+
+// Returns true if the regex object at regex matches the `len` bytes starting at `input`.
 // Then, captures is initialized with all the information
 //  associated with the number of groups and their captures
+bool is_match_len(const Regex* regex, const char* input, size_t len, Captures* captures) {
+    if (regex->bits && !match_bits(regex->bits, input, len)) {
+        // no need to search for a path that is not there
+        return false;
+    }
+    MatchScratch scratch;
+    init_match_scratch(&scratch, regex);
+    bool success = capture_all_len(regex, &scratch, input, len, captures);
+    destroy_match_scratch(&scratch);
+    return success;
+}
+
 bool is_match(const Regex* regex, const char* input, Captures* captures) {
-    Path path;
-    init_path(&path);
-    
-    Edge dummy_edge;
-    dummy_edge.pat = EMPTY_PATTERN;
-    dummy_edge.target = regex->initial;
+    return is_match_len(regex, input, strlen(input), captures);
+}
 
-    push_edge(&path, &dummy_edge);
+StrView* get_capts(const Captures* captures, size_t group_idx, size_t* match_count) {
+    *match_count = captures->num_capts[group_idx];
+    return captures->group_capts[group_idx];
+}
 
-    bool success = search_from(regex->initial, input, &path);
-    if (!success) {
-        return false;
+void destroy_captures(const Captures* captures) {
+    for (size_t group_idx = 0; group_idx < captures->num_groups; ++group_idx) {
+        free(captures->group_capts[group_idx]);
     }
-    // now construct the capture from the path we took
-    captures->group_capts = malloc(regex->num_groups * sizeof(StrView*));
-    captures->num_capts   = malloc(regex->num_groups * sizeof(size_t));
-    captures->num_groups  = regex->num_groups;
+    free(captures->group_capts);
+    free(captures->num_capts);
+}
+
+
+
+
+
+
+// =================================================================================
+//            Matching with caller-owned scratch space and result storage
+// =================================================================================
+
+void init_match_scratch(MatchScratch* scratch, const Regex* regex) {
+    init_path(&scratch->path);
+    init_match_state(&scratch->state, regex);
+    init_dfa(&scratch->dfa, regex);
+    memset(&scratch->pike, 0, sizeof(scratch->pike));
+    scratch->step_budget = DEFAULT_STEP_BUDGET;
+    scratch->num_fallbacks = 0;
+}
 
-    for (size_t group_idx = 0; group_idx < regex->num_groups; ++group_idx) {
-        size_t num;
-        captures->group_capts[group_idx] = captures_from_path(&path, input, &num, 1 << group_idx);
-        captures->num_capts[group_idx] = num;
+void destroy_match_scratch(const MatchScratch* scratch) {
+    destroy_path(&scratch->path);
+    destroy_match_state(&scratch->state);
+    destroy_dfa(&scratch->dfa);
+    destroy_pike_state(&scratch->pike);
+}
+
+// Like `captures_from_path`, but records only the last capture of each of the first `num_groups` groups,
+// all in one pass and without allocating
+void last_captures_from_path(const Path* path, const char* input, StrView* groups, size_t num_groups) {
+    // where each open group began
+    const char* beg[64];
+    CaptureFlags open = CAPT_NONE;
+    for (size_t group_idx = 0; group_idx < num_groups; ++group_idx) {
+        groups[group_idx].beg = NULL;
+        groups[group_idx].len = 0;
+    }
+    for (size_t i = 0; i < path->len; ++i) {
+        Edge* e = path->edges[i];
+        const char* after = input + pat_size(&e->pat);
+        // as in `captures_from_path`, ends come before beginnings
+        CaptureFlags ending = e->target->end_capts & open;
+        CaptureFlags beginning = e->target->beg_capts & ~(open & ~ending);
+        for (size_t group_idx = 0; group_idx < num_groups && (ending | beginning); ++group_idx) {
+            CaptureFlags grp = (CaptureFlags)1 << group_idx;
+            if (ending & grp) {
+                groups[group_idx].beg = beg[group_idx];
+                groups[group_idx].len = after - beg[group_idx];
+            }
+            if (beginning & grp) {
+                beg[group_idx] = after;
+            }
+        }
+        open = (open & ~ending) | beginning;
+        input = after;
     }
+}
 
-    destroy_path(&path);
+bool match_len(const Regex* regex, MatchScratch* scratch, const char* buf, size_t len) {
+    if (regex->literal && !memmem(buf, len, regex->literal, regex->literal_len)) {
+        return false;
+    }
+    if (prefers_match_from_end(regex)) {
+        return match_from_end(regex, &scratch->state, buf, len);
+    }
+    if (prefers_match_bits(regex)) {
+        return match_bits(regex->bits, buf, len);
+    }
+    reset_dfa(&scratch->dfa);
+    feed_dfa(&scratch->dfa, regex, buf, len);
+    return dfa_accepts(&scratch->dfa);
+}
 
-    return success;
+bool capture_len(const Regex* regex, MatchScratch* scratch, const char* buf, size_t len,
+                 StrView* groups, size_t num_groups)
+{
+    if (num_groups > regex->num_groups) {
+        num_groups = regex->num_groups;
+    }
+    Edge dummy_edge;
+    StepBudget budget;
+    if (!find_path(regex, buf, len, &scratch->path, &dummy_edge, scratch->step_budget, &budget)) {
+        if (!budget.exhausted) {
+            return false;
+        }
+        // too much for the path search: start over with an engine that can not take long
+        ++scratch->num_fallbacks;
+        return pike_captures(regex, &scratch->pike, buf, len, groups, num_groups);
+    }
+    last_captures_from_path(&scratch->path, buf, groups, num_groups);
+    return true;
 }
 
-StrView* get_capts(const Captures* captures, size_t group_idx, size_t* match_count) {
-    *match_count = captures->num_capts[group_idx];
-    return captures->group_capts[group_idx];
+bool capture_all_len(const Regex* regex, MatchScratch* scratch, const char* buf, size_t len, Captures* captures) {
+    captures->group_capts = alloc_or_die(regex->num_groups, sizeof(StrView*));
+    captures->num_capts   = alloc_or_die(regex->num_groups, sizeof(size_t));
+    captures->num_groups  = regex->num_groups;
+
+    Edge dummy_edge;
+    StepBudget budget;
+    if (find_path(regex, buf, len, &scratch->path, &dummy_edge, scratch->step_budget, &budget)) {
+        // now construct the capture from the path we took
+        for (size_t group_idx = 0; group_idx < regex->num_groups; ++group_idx) {
+            size_t num;
+            captures->group_capts[group_idx] = captures_from_path(&scratch->path, buf, &num, (CaptureFlags)1 << group_idx);
+            captures->num_capts[group_idx] = num;
+        }
+        return true;
+    }
+    bool success = false;
+    if (budget.exhausted) {
+        // the linear-time engine only keeps the last capture of each group
+        ++scratch->num_fallbacks;
+        StrView groups[64];
+        success = pike_captures(regex, &scratch->pike, buf, len, groups, regex->num_groups);
+        for (size_t group_idx = 0; success && group_idx < regex->num_groups; ++group_idx) {
+            if (groups[group_idx].beg) {
+                captures->group_capts[group_idx] = alloc_or_die(1, sizeof(StrView));
+                captures->group_capts[group_idx][0] = groups[group_idx];
+                captures->num_capts[group_idx] = 1;
+            }
+        }
+    }
+    if (!success) {
+        destroy_captures(captures);
+    }
+    return success;
 }
@@ -3,6 +3,8 @@
 #include <ctype.h>
 
 #include "pattern.h"
+#include "utf8.h"
+#include "util.h"
 
 bool matches_in_set(const Pattern* sub_pats, int num_sub_pats, int ch) {
     for (int i = 0; i < num_sub_pats; ++i) {
@@ -27,6 +29,13 @@ bool pattern_matches(const Pattern *pattern, char ch) {
             return matches_in_set(pattern->sub_pats, pattern->num_sub_pats, ch);
         case PAT_NEG_SET:
             return !matches_in_set(pattern->sub_pats, pattern->num_sub_pats, ch);
+        case PAT_ASCII_NONALPHA: return (unsigned char)ch < 0x80 && !isalpha(ch);
+        case PAT_ASCII_NONDIGIT: return (unsigned char)ch < 0x80 && !isdigit(ch);
+        case PAT_ASCII_NEG_SET:
+            return (unsigned char)ch < 0x80 && !matches_in_set(pattern->sub_pats, pattern->num_sub_pats, ch);
+        case PAT_RANGE:
+            return (unsigned char)pattern->literal <= (unsigned char)ch && (unsigned char)ch <= (unsigned char)pattern->last;
+        case PAT_CODEPOINT:  return  false;
     }
     fprintf(stderr, "Unanticipated enum variant of PatternType");
     exit(EXIT_FAILURE);
@@ -69,7 +78,7 @@ bool parse_escape_code(Pattern* pat, const char** str) {
             pat->type = PAT_NONDIGIT;
             break;
         default:
-            fprintf(stderr, "ERROR: unexpected escape sequence \\%c\n", **str);
+            fprintf(error_output(), "ERROR: unexpected escape sequence \\%c\n", **str);
             return false;
     }
     ++*str;
@@ -77,7 +86,7 @@ bool parse_escape_code(Pattern* pat, const char** str) {
 }
 
 // a matching set like [abc] or [^abc]           
-bool parse_pattern_set(Pattern* pat, const char** str) {
+bool parse_pattern_set(Pattern* pat, const char** str, bool utf8) {
     if (**str == '^') {
         ++*str;
         // a negated matching set [^abc]
@@ -91,10 +100,10 @@ bool parse_pattern_set(Pattern* pat, const char** str) {
     for (; *end != ']'; ++end) {
         // check that there are no illegal characters
         if (*end == '\0') {
-            fprintf(stderr, "ERROR: end of input inside [ ] set\n");
+            fprintf(error_output(), "ERROR: end of input inside [ ] set\n");
             return false;
         } else if (*end == '[') {
-            fprintf(stderr, "ERROR: nested [ ] sets\n");
+            fprintf(error_output(), "ERROR: nested [ ] sets\n");
             return false;
         }
     }
@@ -104,11 +113,11 @@ bool parse_pattern_set(Pattern* pat, const char** str) {
     //  *str   end
     // there are (end - 1 - *str) characters so *at most* that many patterns
     int cap = end - *str; // note: this might allocate more than we need. oh well
-    pat->sub_pats = malloc(cap * sizeof(Pattern));
+    pat->sub_pats = alloc_or_die(cap, sizeof(Pattern));
     // fill the dynamically allocated array with all the patterns
     pat->num_sub_pats = 0;
     while (*str < end) {
-        bool success = parse_pattern(&pat->sub_pats[pat->num_sub_pats], str);
+        bool success = parse_pattern(&pat->sub_pats[pat->num_sub_pats], str, utf8);
         if (!success) {
             return false;
         }
@@ -119,8 +128,10 @@ bool parse_pattern_set(Pattern* pat, const char** str) {
     return true;
 }
 
-bool parse_pattern(Pattern* pat, const char** str) {
+bool parse_pattern(Pattern* pat, const char** str, bool utf8) {
     pat->literal = 0; // left this way unless we are a literal expression
+    pat->last = 0;
+    pat->codepoint = 0;
     pat->sub_pats = NULL;
     pat->num_sub_pats = 0;
     bool result = false;
@@ -130,14 +141,19 @@ bool parse_pattern(Pattern* pat, const char** str) {
         result = parse_escape_code(pat, str);
     } else if (**str == '[') {
         ++*str;
-        result = parse_pattern_set(pat, str);
+        result = parse_pattern_set(pat, str, utf8);
     } else if (**str == '.') {
         // match anything
         pat->type = PAT_ANY;
         ++*str;
         result = true;
+    } else if (utf8 && (*str)[0] & 0x80 && decode_utf8(*str, &pat->codepoint) > 1) {
+        // a character that takes more than one byte
+        pat->type = PAT_CODEPOINT;
+        *str += decode_utf8(*str, &pat->codepoint);
+        result = true;
     } else {
-        // just a literal character
+        // just a literal character (or a byte that is not valid UTF-8)
         pat->type = PAT_LITERAL;
         pat->literal = **str;
         ++*str;
@@ -146,6 +162,31 @@ bool parse_pattern(Pattern* pat, const char** str) {
     return result;
 }
 
+bool pats_equal(const Pattern* a, const Pattern* b) {
+    if (a->type != b->type || a->literal != b->literal || a->last != b->last || a->codepoint != b->codepoint
+        || a->num_sub_pats != b->num_sub_pats)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < a->num_sub_pats; ++i) {
+        if (!pats_equal(&a->sub_pats[i], &b->sub_pats[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+Pattern copy_pat(const Pattern* pat) {
+    Pattern copy = *pat;
+    if (pat->num_sub_pats > 0) {
+        copy.sub_pats = alloc_or_die(pat->num_sub_pats, sizeof(Pattern));
+        for (size_t i = 0; i < pat->num_sub_pats; ++i) {
+            copy.sub_pats[i] = copy_pat(&pat->sub_pats[i]);
+        }
+    }
+    return copy;
+}
+
 void destroy_pat(const Pattern* pat) {
     for (size_t i = 0; i < pat->num_sub_pats; ++i) {
         destroy_pat(&pat->sub_pats[i]);
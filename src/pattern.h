@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 // Represent what type of pattern we are matching
 enum PatternType {
@@ -26,6 +27,17 @@ enum PatternType {
     PAT_SET,
     // Matches anything not in the set of patterns
     PAT_NEG_SET,
+    // Match any byte from `literal` to `last` (inclusive). Only made by the compiler, never parsed
+    PAT_RANGE,
+    // Matches any ASCII byte not in the set of patterns. Only made by the compiler, for UTF-8 mode
+    PAT_ASCII_NEG_SET,
+    // Match an ASCII byte that is not alphabetic (\W in UTF-8 mode, for single bytes)
+    PAT_ASCII_NONALPHA,
+    // Match an ASCII byte that is not a digit (\D in UTF-8 mode, for single bytes)
+    PAT_ASCII_NONDIGIT,
+    // A non-ASCII character (in UTF-8 mode), which takes more than one byte.
+    // It never matches a byte on its own: the compiler turns it into a chain of byte edges (see utf8.c)
+    PAT_CODEPOINT,
 };
 
 typedef struct Pattern_s Pattern;
@@ -35,13 +47,17 @@ struct Pattern_s {
     enum PatternType type;
     // If we are a PAT_LTIERAl type, then what literal we expect. otherwise, 0
     char literal;
+    // If we are a PAT_RANGE type, the last byte in the range
+    char last;
+    // If we are a PAT_CODEPOINT type, which code point
+    uint32_t codepoint;
     // If we are a PAT_SET or PAT_NEG_SET type, then the set of subpatterns we could match, otherwise NULL
     Pattern* sub_pats;
     size_t num_sub_pats;
 };
 
-static const struct Pattern_s EMPTY_PATTERN = { PAT_EMPTY, '\0', NULL };
-static const struct Pattern_s PATTERN_ANY = { PAT_ANY, '\0', NULL };
+static const struct Pattern_s EMPTY_PATTERN = { PAT_EMPTY, '\0', '\0', 0, NULL };
+static const struct Pattern_s PATTERN_ANY = { PAT_ANY, '\0', '\0', 0, NULL };
 
 // Parse the regex pattern from the string pointer, advancing it to just after the repition text
 // BEFORE: we start looking at a character in the string
@@ -54,7 +70,8 @@ static const struct Pattern_s PATTERN_ANY = { PAT_ANY, '\0', NULL };
 //               ^
 //               |
 //               *str
-bool parse_pattern(Pattern* pat, const char** str);
+// In UTF-8 mode (`utf8` set), a character that takes more than one byte is parsed as one PAT_CODEPOINT
+bool parse_pattern(Pattern* pat, const char** str, bool utf8);
 
 // returns the size of a match by `pat` in characters:
 size_t pat_size(const Pattern* pat);
@@ -66,6 +83,12 @@ void debug_pat(const Pattern* pat);
 // For example, '.' will match anything and 'a' will match the literal 'a'
 bool pattern_matches(const Pattern *pattern, char ch);
 
+// Returns true if `a` and `b` are the same pattern (so they match the same bytes)
+bool pats_equal(const Pattern* a, const Pattern* b);
+
+// Returns a deep copy of `pat`, which must be destroyed on its own
+Pattern copy_pat(const Pattern* pat);
+
 void destroy_pat(const Pattern* pat);
 
 #endif
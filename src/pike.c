@@ -0,0 +1,212 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "regex.h"
+#include "pattern.h"
+#include "util.h"
+
+//
+// This file is the linear-time capture engine, which takes over from the path search in match.c
+// when an input is too much work for it.
+//
+// It steps through the input once, like the set simulation in simulate.c, but instead of a set of nodes
+// it keeps a list of threads in the order the path search would try them.
+// When two threads reach the same node at the same position, only the first is kept:
+// the path search would have found a match through the first one before ever trying the second.
+// So the first thread to accept at the end of the input took the same path the path search would have.
+//
+
+// where each group's slots begin, among a node's slots
+#define SLOT_OPEN 0
+#define SLOT_BEG 1
+#define SLOT_END 2
+#define SLOTS_PER_GROUP 3
+
+#define NO_POS SIZE_MAX
+
+void init_pike_state(PikeState* pike, const Regex* regex) {
+    size_t num_edges = 0;
+    for (size_t i = 0; i < regex->num_nodes; ++i) {
+        num_edges += regex->nodes[i]->num_edges;
+    }
+    pike->stride = SLOTS_PER_GROUP * regex->num_groups;
+    pike->curr_slots = alloc_or_die(regex->num_nodes * pike->stride, sizeof(size_t));
+    pike->next_slots = alloc_or_die(regex->num_nodes * pike->stride, sizeof(size_t));
+    pike->curr_open = alloc_or_die(regex->num_nodes, sizeof(CaptureFlags));
+    pike->next_open = alloc_or_die(regex->num_nodes, sizeof(CaptureFlags));
+    pike->curr_edges = alloc_or_die(num_edges, sizeof(Edge*));
+    pike->curr_from = alloc_or_die(num_edges, sizeof(size_t));
+    pike->next_edges = alloc_or_die(num_edges, sizeof(Edge*));
+    pike->next_from = alloc_or_die(num_edges, sizeof(size_t));
+    pike->marks = alloc_or_die(regex->num_nodes, sizeof(size_t));
+    // (every node is entered at most once per position, so each edge is on the stack at most once)
+    pike->stack_edges = alloc_or_die(num_edges, sizeof(Edge*));
+    pike->stack_from = alloc_or_die(num_edges, sizeof(size_t));
+    pike->found = alloc_or_die(pike->stride, sizeof(size_t));
+}
+
+void destroy_pike_state(const PikeState* pike) {
+    free(pike->curr_slots);
+    free(pike->next_slots);
+    free(pike->curr_open);
+    free(pike->next_open);
+    free(pike->curr_edges);
+    free(pike->curr_from);
+    free(pike->next_edges);
+    free(pike->next_from);
+    free(pike->marks);
+    free(pike->stack_edges);
+    free(pike->stack_from);
+    free(pike->found);
+}
+
+// Enter `node` at position `pos`, having made the captures in `slots` with the groups `open` still open
+// (NULL slots for none at all). At the end of the input, the first accepting node we come to is the match.
+// Returns the node's index among those entered at `pos`, or NO_POS if its edges are not to be followed
+// (it was already entered, leads nowhere, or is the end of the match)
+size_t pike_add(PikeState* pike, const Node* node, const size_t* slots, CaptureFlags open,
+                size_t pos, size_t len)
+{
+    if (pike->marks[node->id] == pike->generation || node->dead) {
+        return NO_POS;
+    }
+    pike->marks[node->id] = pike->generation;
+
+    size_t idx = pike->num_next_nodes++;
+    size_t* mine = pike->next_slots + idx * pike->stride;
+    if (slots) {
+        memcpy(mine, slots, pike->stride * sizeof(size_t));
+    } else {
+        for (size_t i = 0; i < pike->stride; ++i) {
+            mine[i] = NO_POS;
+        }
+    }
+    // as in `captures_from_path`, ends come before beginnings
+    CaptureFlags ending = node->end_capts & open;
+    CaptureFlags beginning = node->beg_capts & ~(open & ~ending);
+    size_t num_groups = pike->stride / SLOTS_PER_GROUP;
+    for (size_t group_idx = 0; group_idx < num_groups && (ending | beginning); ++group_idx) {
+        CaptureFlags grp = (CaptureFlags)1 << group_idx;
+        size_t* group = mine + group_idx * SLOTS_PER_GROUP;
+        if (ending & grp) {
+            group[SLOT_BEG] = group[SLOT_OPEN];
+            group[SLOT_END] = pos;
+        }
+        if (beginning & grp) {
+            group[SLOT_OPEN] = pos;
+        }
+    }
+    open = (open & ~ending) | beginning;
+    pike->next_open[idx] = open;
+
+    if (pos == len && node->accepts) {
+        if (!pike->matched) {
+            pike->matched = true;
+            memcpy(pike->found, mine, pike->stride * sizeof(size_t));
+        }
+        return NO_POS;
+    }
+    return idx;
+}
+
+// Enter `node` as `pike_add` does, and follow its edges in the order the path search would,
+// entering the targets of empty edges in turn. Every consuming edge becomes a thread for the byte at `pos`
+void pike_enter(PikeState* pike, const Node* node, const size_t* slots, CaptureFlags open,
+                size_t pos, size_t len)
+{
+    // (kept on a stack rather than by recursing, as a long chain of empty edges would run out of call stack)
+    size_t num_stack = 0;
+    size_t idx = pike_add(pike, node, slots, open, pos, len);
+    while (1) {
+        if (idx != NO_POS) {
+            // pushed last first, so that they come off in order
+            for (size_t i = node->num_edges; i-- > 0; ) {
+                pike->stack_edges[num_stack] = &node->edges[i];
+                pike->stack_from[num_stack] = idx;
+                ++num_stack;
+            }
+        }
+        if (num_stack == 0) {
+            break;
+        }
+        --num_stack;
+        const Edge* e = pike->stack_edges[num_stack];
+        size_t from = pike->stack_from[num_stack];
+        idx = NO_POS;
+        if (pat_size(&e->pat) == 0) {
+            node = e->target;
+            idx = pike_add(pike, node, pike->next_slots + from * pike->stride, pike->next_open[from], pos, len);
+        } else if (pos < len) {
+            pike->next_edges[pike->num_next] = e;
+            pike->next_from[pike->num_next] = from;
+            ++pike->num_next;
+        }
+    }
+}
+
+// Make the threads for the next byte the current ones, and start an empty list for the byte after
+void pike_swap(PikeState* pike) {
+    size_t* tmp_slots = pike->curr_slots;
+    pike->curr_slots = pike->next_slots;
+    pike->next_slots = tmp_slots;
+    CaptureFlags* tmp_open = pike->curr_open;
+    pike->curr_open = pike->next_open;
+    pike->next_open = tmp_open;
+    const Edge** tmp_edges = pike->curr_edges;
+    pike->curr_edges = pike->next_edges;
+    pike->next_edges = tmp_edges;
+    size_t* tmp_from = pike->curr_from;
+    pike->curr_from = pike->next_from;
+    pike->next_from = tmp_from;
+    pike->num_curr = pike->num_next;
+    pike->num_next_nodes = 0;
+    pike->num_next = 0;
+    ++pike->generation;
+}
+
+bool pike_captures(const Regex* regex, PikeState* pike, const char* buf, size_t len,
+                   StrView* groups, size_t num_groups)
+{
+    if (!pike->marks) {
+        init_pike_state(pike, regex);
+    }
+    if (num_groups > regex->num_groups) {
+        num_groups = regex->num_groups;
+    }
+    pike->matched = false;
+    pike->num_next_nodes = 0;
+    pike->num_next = 0;
+    ++pike->generation;
+    pike_enter(pike, regex->initial, NULL, CAPT_NONE, 0, len);
+    for (size_t pos = 0; pos < len && !pike->matched; ++pos) {
+        pike_swap(pike);
+        if (pike->num_curr == 0) {
+            break;
+        }
+        for (size_t i = 0; i < pike->num_curr; ++i) {
+            const Edge* e = pike->curr_edges[i];
+            if (pattern_matches(&e->pat, buf[pos])) {
+                size_t from = pike->curr_from[i];
+                pike_enter(pike, e->target, pike->curr_slots + from * pike->stride, pike->curr_open[from],
+                           pos + 1, len);
+            }
+        }
+    }
+    if (!pike->matched) {
+        return false;
+    }
+    for (size_t group_idx = 0; group_idx < num_groups; ++group_idx) {
+        const size_t* group = pike->found + group_idx * SLOTS_PER_GROUP;
+        if (group[SLOT_BEG] == NO_POS) {
+            groups[group_idx].beg = NULL;
+            groups[group_idx].len = 0;
+        } else {
+            groups[group_idx].beg = buf + group[SLOT_BEG];
+            groups[group_idx].len = group[SLOT_END] - group[SLOT_BEG];
+        }
+    }
+    return true;
+}
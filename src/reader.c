@@ -0,0 +1,403 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "reader.h"
+#include "util.h"
+
+//
+// This file keeps many files being opened and read at once, so that searching a tree of small files
+// waits on the disk once for a whole batch of them, rather than once per file for each open and read.
+//
+// Files are kept in a circular queue of slots, in the order they were submitted.
+// With io_uring, each slot's open is handed to the kernel, and the read as soon as the open completes:
+// the kernel works on every slot at once, and we only make a system call when we have to wait.
+// Where io_uring is missing (or not allowed), a few threads take the slots in order and open and read them.
+//
+
+// how many threads read files when there is no io_uring
+#define READ_THREADS 4
+
+enum SlotState {
+    // submitted, but nothing has been done yet
+    SLOT_PENDING,
+    // the file is being opened
+    SLOT_OPENING,
+    // the file is open, and its first block is being read
+    SLOT_READING,
+    // ready to be taken back
+    SLOT_DONE,
+};
+
+typedef struct {
+    ReadAhead file;
+    enum SlotState state;
+} Slot;
+
+// The parts of an io_uring that are mapped from the kernel
+typedef struct {
+    int fd;
+    // the submission queue: `array` is indices into `sqes`
+    void* sq_ring;
+    size_t sq_ring_size;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    // how many entries have been queued and not yet handed to the kernel
+    unsigned to_submit;
+    // the completion queue (in the same mapping as the submission queue, on kernels that allow it)
+    void* cq_ring;
+    size_t cq_ring_size;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+} Ring;
+
+struct FileReader_s {
+    // circular queue of the files submitted and not yet taken back
+    Slot* slots;
+    size_t depth;
+    size_t beg;
+    size_t len;
+    // whether `ring` is in use, rather than the threads
+    bool uring;
+    Ring ring;
+    // without io_uring: the threads, and the next slot (counting from `beg`) one of them should take
+    pthread_t threads[READ_THREADS];
+    size_t num_threads;
+    size_t next_pending;
+    // guards `next_pending`, `stopping`, and the state of every slot
+    pthread_mutex_t lock;
+    // signalled when a slot is submitted or done, and when the threads should stop
+    pthread_cond_t changed;
+    bool stopping;
+};
+
+int io_uring_setup(unsigned entries, struct io_uring_params* params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Returns true if the kernel behind the ring `fd` can open and read files (from Linux 5.6 on)
+bool ring_can_read_files(int fd) {
+    size_t num_ops = IORING_OP_LAST;
+    struct io_uring_probe* probe = alloc_or_die(1, sizeof(struct io_uring_probe) + num_ops * sizeof(struct io_uring_probe_op));
+    bool ok = io_uring_register(fd, IORING_REGISTER_PROBE, probe, num_ops) == 0
+        && probe->last_op >= IORING_OP_OPENAT && probe->last_op >= IORING_OP_READ
+        && (probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED)
+        && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return ok;
+}
+
+// Set up an io_uring with room for `entries` operations at once
+// Returns false if the kernel does not have it, or will not let us use it
+bool open_ring(Ring* ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = io_uring_setup(entries, &params);
+    if (ring->fd < 0) {
+        return false;
+    }
+    if (!ring_can_read_files(ring->fd)) {
+        close(ring->fd);
+        return false;
+    }
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap && ring->cq_ring_size > ring->sq_ring_size) {
+        ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        close(ring->fd);
+        return false;
+    }
+    if (single_mmap) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            close(ring->fd);
+            return false;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (!single_mmap) {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        return false;
+    }
+    char* sq = ring->sq_ring;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    char* cq = ring->cq_ring;
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    ring->to_submit = 0;
+    return true;
+}
+
+void close_ring(const Ring* ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+// Returns a cleared submission queue entry to fill in, which is handed to the kernel with the next `enter_ring`.
+// There is always room, as each slot has at most one operation on its way
+struct io_uring_sqe* queue_operation(Ring* ring) {
+    // (we are the only one moving the tail, but the kernel reads it)
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit += 1;
+    return sqe;
+}
+
+// Hand the queued operations to the kernel, and wait until at least one has completed (if `wait` is set)
+void enter_ring(Ring* ring, bool wait) {
+    while (1) {
+        int done = io_uring_enter(ring->fd, ring->to_submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0);
+        if (done >= 0) {
+            ring->to_submit -= done;
+            return;
+        }
+        if (errno != EINTR) {
+            fprintf(stderr, "ERROR: io_uring_enter failed: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void queue_open(FileReader* reader, size_t index) {
+    Slot* slot = &reader->slots[index];
+    struct io_uring_sqe* sqe = queue_operation(&reader->ring);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)slot->file.path;
+    sqe->open_flags = O_RDONLY | O_NOCTTY;
+    sqe->user_data = index;
+    slot->state = SLOT_OPENING;
+}
+
+void queue_read(FileReader* reader, size_t index) {
+    Slot* slot = &reader->slots[index];
+    struct io_uring_sqe* sqe = queue_operation(&reader->ring);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = slot->file.fd;
+    sqe->addr = (uintptr_t)slot->file.buf;
+    sqe->len = READ_AHEAD_SIZE;
+    sqe->off = 0;
+    sqe->user_data = index;
+    slot->state = SLOT_READING;
+}
+
+// Take in every operation that has completed: an open is followed by a read, and a read finishes the slot
+void reap_ring(FileReader* reader) {
+    Ring* ring = &reader->ring;
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        const struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+        Slot* slot = &reader->slots[cqe->user_data];
+        if (slot->state == SLOT_OPENING) {
+            if (cqe->res < 0) {
+                slot->file.fd = -1;
+                slot->state = SLOT_DONE;
+            } else {
+                slot->file.fd = cqe->res;
+                queue_read(reader, cqe->user_data);
+            }
+        } else {
+            slot->file.len = cqe->res < 0 ? -1 : cqe->res;
+            slot->state = SLOT_DONE;
+        }
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Open and read the file in `slot`, the plain way
+void read_slot(Slot* slot) {
+    ReadAhead* file = &slot->file;
+    file->fd = open(file->path, O_RDONLY | O_NOCTTY);
+    if (file->fd < 0) {
+        return;
+    }
+    ssize_t got;
+    do {
+        got = pread(file->fd, file->buf, READ_AHEAD_SIZE, 0);
+    } while (got < 0 && errno == EINTR);
+    file->len = got;
+}
+
+void* read_worker(void* arg) {
+    FileReader* reader = arg;
+    pthread_mutex_lock(&reader->lock);
+    while (1) {
+        while (reader->next_pending == reader->len && !reader->stopping) {
+            pthread_cond_wait(&reader->changed, &reader->lock);
+        }
+        if (reader->stopping) {
+            break;
+        }
+        Slot* slot = &reader->slots[(reader->beg + reader->next_pending) % reader->depth];
+        reader->next_pending += 1;
+        slot->state = SLOT_READING;
+        pthread_mutex_unlock(&reader->lock);
+        read_slot(slot);
+        pthread_mutex_lock(&reader->lock);
+        slot->state = SLOT_DONE;
+        pthread_cond_broadcast(&reader->changed);
+    }
+    pthread_mutex_unlock(&reader->lock);
+    return NULL;
+}
+
+FileReader* open_file_reader(size_t depth) {
+    FileReader* reader = alloc_or_die(1, sizeof(FileReader));
+    reader->slots = alloc_or_die(depth, sizeof(Slot));
+    reader->depth = depth;
+    reader->beg = 0;
+    reader->len = 0;
+    reader->uring = open_ring(&reader->ring, depth);
+    reader->num_threads = 0;
+    reader->next_pending = 0;
+    reader->stopping = false;
+    pthread_mutex_init(&reader->lock, NULL);
+    pthread_cond_init(&reader->changed, NULL);
+    if (!reader->uring) {
+        // (if no thread can be started, `next_file` reads each file itself)
+        for (; reader->num_threads < READ_THREADS; ++reader->num_threads) {
+            if (pthread_create(&reader->threads[reader->num_threads], NULL, read_worker, reader) != 0) {
+                break;
+            }
+        }
+    }
+    return reader;
+}
+
+bool file_reader_full(const FileReader* reader) {
+    return reader->len == reader->depth;
+}
+
+bool file_reader_busy(const FileReader* reader) {
+    return reader->len > 0;
+}
+
+void submit_file(FileReader* reader, char* path) {
+    size_t index = (reader->beg + reader->len) % reader->depth;
+    Slot* slot = &reader->slots[index];
+    slot->file.path = path;
+    slot->file.fd = -1;
+    slot->file.buf = alloc_or_die(READ_AHEAD_SIZE, 1);
+    slot->file.len = -1;
+    slot->state = SLOT_PENDING;
+    if (reader->uring) {
+        reader->len += 1;
+        // (handed to the kernel along with any others, the next time we wait)
+        queue_open(reader, index);
+        return;
+    }
+    pthread_mutex_lock(&reader->lock);
+    reader->len += 1;
+    pthread_cond_signal(&reader->changed);
+    pthread_mutex_unlock(&reader->lock);
+}
+
+bool next_file(FileReader* reader, ReadAhead* file) {
+    if (reader->len == 0) {
+        return false;
+    }
+    Slot* slot = &reader->slots[reader->beg];
+    if (reader->uring) {
+        reap_ring(reader);
+        while (slot->state != SLOT_DONE) {
+            enter_ring(&reader->ring, true);
+            reap_ring(reader);
+        }
+        // hand the kernel whatever was queued (opens submitted, and reads of files that have opened),
+        // so that it gets on with them while the caller is busy with this file
+        if (reader->ring.to_submit > 0) {
+            enter_ring(&reader->ring, false);
+        }
+    } else {
+        pthread_mutex_lock(&reader->lock);
+        if (reader->next_pending == 0) {
+            // no thread has got to it yet (or there are none), so it is quickest to read it ourselves
+            reader->next_pending = 1;
+            pthread_mutex_unlock(&reader->lock);
+            read_slot(slot);
+            pthread_mutex_lock(&reader->lock);
+            slot->state = SLOT_DONE;
+        }
+        while (slot->state != SLOT_DONE) {
+            pthread_cond_wait(&reader->changed, &reader->lock);
+        }
+    }
+    *file = slot->file;
+    reader->beg = (reader->beg + 1) % reader->depth;
+    reader->len -= 1;
+    if (!reader->uring) {
+        reader->next_pending -= 1;
+        pthread_mutex_unlock(&reader->lock);
+    }
+    return true;
+}
+
+void destroy_file_reader(FileReader* reader) {
+    if (reader->uring) {
+        close_ring(&reader->ring);
+    } else {
+        pthread_mutex_lock(&reader->lock);
+        reader->stopping = true;
+        pthread_cond_broadcast(&reader->changed);
+        pthread_mutex_unlock(&reader->lock);
+        for (size_t i = 0; i < reader->num_threads; ++i) {
+            pthread_join(reader->threads[i], NULL);
+        }
+    }
+    pthread_cond_destroy(&reader->changed);
+    pthread_mutex_destroy(&reader->lock);
+    free(reader->slots);
+    free(reader);
+}
@@ -0,0 +1,46 @@
+#ifndef __reader_h__
+#define __reader_h__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// how many bytes at the start of each file are read ahead (all of a small file)
+#define READ_AHEAD_SIZE (64 * 1024)
+
+// A file opened and read ahead by a FileReader
+typedef struct {
+    // the path it was opened by (dynamically allocated)
+    char* path;
+    // the open file, or -1 if it could not be opened
+    int fd;
+    // dynamically allocated block of READ_AHEAD_SIZE bytes, the first `len` of which are the start of the file
+    // (`len` is -1 if it could not be read)
+    char* buf;
+    ssize_t len;
+} ReadAhead;
+
+typedef struct FileReader_s FileReader;
+
+// Start a reader that keeps up to `depth` files being opened and read at once.
+// It uses io_uring where the kernel has it, and otherwise a few threads of its own doing plain reads
+FileReader* open_file_reader(size_t depth);
+
+// Returns true if `depth` files are already on their way, so no more can be submitted until one is taken back
+bool file_reader_full(const FileReader* reader);
+
+// Returns true if any file submitted has not been taken back yet
+bool file_reader_busy(const FileReader* reader);
+
+// Start opening the file at the owned `path`, and reading its first READ_AHEAD_SIZE bytes.
+// The reader must not be full
+void submit_file(FileReader* reader, char* path);
+
+// Wait for the file submitted longest ago to be read, and hand it (and everything in it) over to the caller.
+// Files come back in the order they were submitted. Returns false if there are none
+bool next_file(FileReader* reader, ReadAhead* file);
+
+// Stop the reader, which must not be busy
+void destroy_file_reader(FileReader* reader);
+
+#endif
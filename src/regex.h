@@ -33,8 +33,23 @@ struct Node_s {
     Edge* edges;
     size_t num_edges;
     size_t cap_edges;
+    // the reversed automaton: one edge back to the source of each edge that leads here.
+    // their patterns are borrowed from the forward edges
+    Edge* rev_edges;
+    size_t num_rev_edges;
+    // the edges that can consume an ASCII byte, and the empty edges (each in their order among `edges`).
+    // Those are all the set simulation needs to look at for ASCII input, and for following empty edges,
+    // which skips the chains of edges that match longer UTF-8 characters
+    const Edge** ascii_edges;
+    size_t num_ascii_edges;
+    const Edge** empty_edges;
+    size_t num_empty_edges;
     // whether or not this accepts the input string if we stop here
     bool accepts;
+    // no accepting node can be reached from here
+    bool dead;
+    // from here, every input is accepted, no matter what comes next
+    bool sure;
     CaptureFlags beg_capts;
     CaptureFlags end_capts;
 };
@@ -46,25 +61,102 @@ void debug_node(const Node* node);
 // Also free's the pointer itself
 void destroy_node(Node* node);
 
+// The most positions (consuming edges) a pattern can have and still be matched by the bit-parallel engine
+#define BIT_NFA_MAX_POSITIONS 64
+
+// The pattern as a Glushkov automaton, whose set of states fits in one 64-bit word (see bitnfa.c).
+// Bit p stands for position p: the last byte read was consumed by the p-th consuming edge of the pattern
+typedef struct {
+    size_t num_positions;
+    // byte_mask[b] has the positions whose edge matches byte `b`
+    uint64_t byte_mask[256];
+    // the positions a match can begin with, and end with
+    uint64_t first;
+    uint64_t last;
+    // how many bytes a match can begin with
+    size_t num_first_bytes;
+    // the positions followed by the next one
+    uint64_t shift;
+    // what else follows the positions in a byte of the word: if the i-th of these bytes is byte chunks[i],
+    // with the value `b`, those positions are followed by follow[i * 256 + b]
+    uint64_t* follow;
+    uint8_t chunks[8];
+    size_t num_chunks;
+    // whether the pattern matches the empty string
+    bool nullable;
+    bool anchored_beg;
+    bool anchored_end;
+} BitNfa;
+
 typedef struct {
     // the node to start at
     Node* initial;
     // a common node to trap ireedemable failures
     Node* trap;
+    // a common node that accepts whatever follows the match (unless the pattern ends in `$`)
+    Node* tail;
+    // where the pattern proper begins and ends, not counting the input around the match
+    // (when the pattern begins with `^`, `start` is the initial node)
+    Node* start;
+    Node* final;
+    // whether the pattern begins with `^` or ends with `$`
+    bool anchored_beg;
+    bool anchored_end;
     // dynamically allocated array of Node pointers
     Node** nodes;
     size_t num_nodes;
     size_t cap;
     // how many capturing groups we have
     size_t num_groups;
+    // whether `.`, sets and the negated classes match whole UTF-8 characters, rather than single bytes
+    bool utf8;
+    // bytes in the same class are matched by exactly the same edges, so they can share a column of a transition table.
+    // byte_class[b] is the class of byte `b`, from 0 to num_classes - 1
+    uint8_t byte_class[256];
+    size_t num_classes;
+    // the bit-parallel automaton, or NULL if the pattern has too many positions for it
+    BitNfa* bits;
+    // the longest run of bytes every match contains (dynamically allocated), or NULL if there is none.
+    // Input without it can not match, so it can be skipped over with a quick search for this
+    char* literal;
+    size_t literal_len;
 } Regex;
 
+// flags for `compile_with`: match whole UTF-8 characters (see utf8.c)
+#define COMPILE_UTF8 1
+// nothing but the whole match (group 0) will be asked for, so the capture groups can be compiled away
+#define COMPILE_NO_CAPTURES 2
 
 // Attempts to compile `regex` from the input string `str`
 // Returns true if this was successful.
 // Otherwise, returns false and prints a message to stderr
 bool compile(Regex* regex, const char* str);
 
+// Like `compile`, with any of the COMPILE_ flags or'd together in `flags`
+bool compile_with(Regex* regex, const char* str, int flags);
+
+// Marks which nodes of the compiled `regex` are dead and which are sure, sorts out their ASCII and empty edges (see Node),
+// and splits the bytes into classes (see Regex)
+void analyze_nodes(Regex* regex);
+
+// Fill `closure` with `node` and every node reachable from it by empty edges
+// `marks` must be all false, and is left that way. Returns the size of the closure
+size_t node_closure(const Node* node, const Node** closure, bool* marks);
+
+// Build `regex->bits` from the compiled NFA, if it has at most BIT_NFA_MAX_POSITIONS positions
+void build_bit_nfa(Regex* regex);
+
+// Returns true if `bits` matches the `len` bytes at `buf`
+bool match_bits(const BitNfa* bits, const char* buf, size_t len);
+
+// Returns true if `regex` is quicker to match with `match_bits` than with a Dfa:
+// it has a bit-parallel automaton, with few positions that follow others out of order,
+// and few bytes a match can begin with, so most of the input is skipped over
+bool prefers_match_bits(const Regex* regex);
+
+// Free the memory alloc'd by `bits` (which may be NULL), and the pointer itself
+void destroy_bit_nfa(const BitNfa* bits);
+
 // Prints a debug report to stdout
 void debug_regex(const Regex* regex);
 
@@ -83,12 +175,284 @@ typedef struct {
     size_t num_groups;
 } Captures;
 
-// Matches `regex` against `str`.
+// Matches `regex` against the null terminated string `str`.
 // Returns true if the entire string matched
 bool is_match(const Regex* regex, const char* str, Captures* captures);
 
+// Matches `regex` against the `len` bytes starting at `buf`, which need not be null terminated
+// (and may contain null bytes of their own).
+// Returns true if all of them matched
+bool is_match_len(const Regex* regex, const char* buf, size_t len, Captures* captures);
+
 StrView* get_capts(const Captures* captures, size_t group_idx, size_t* num_capts);
 
+// Free the memory alloc'd by a successful `is_match` or `is_match_len`
+void destroy_captures(const Captures* captures);
+
+// The set of nodes the NFA could be in after reading some input.
+// Input can be fed to it a piece at a time, so a match can be suspended at the end of one buffer
+// and resumed with the next, without keeping (or copying) the input it already read
+typedef struct {
+    // the current set of nodes, and the set being built from it
+    const Node** curr;
+    size_t num_curr;
+    const Node** next;
+    size_t num_next;
+    // scratch space for following empty edges
+    const Node** stack;
+    // marks[id] == generation if node `id` is in the `next` set
+    size_t* marks;
+    size_t generation;
+    // whether a sure node is in the current or next set, in which case the input is accepted whatever follows
+    bool curr_sure;
+    bool next_sure;
+    // for `find_span`, which keeps its threads in the order the path search would try them:
+    // the consuming edges that take the current and the next byte,
+    // and which edge each node on `stack` is up to
+    const Edge** curr_edges;
+    size_t num_curr_edges;
+    const Edge** next_edges;
+    size_t num_next_edges;
+    size_t* stack_next;
+} MatchState;
+
+// Allocate a match state for `regex`, starting at its initial node
+void init_match_state(MatchState* state, const Regex* regex);
+
+// Go back to the initial node, so we can match a new input
+void reset_match_state(MatchState* state, const Regex* regex);
+
+// Advance the match state by consuming the `len` bytes at `buf`
+void feed_match_state(MatchState* state, const char* buf, size_t len);
+
+// Returns true if the input fed so far (since the last reset) matched
+bool match_state_accepts(const MatchState* state);
+
+// Returns true if the outcome can no longer change, whatever more input is fed:
+// either a sure node was reached, or every node died.
+// Feeding a settled state is free, so there is no need to
+bool match_state_settled(const MatchState* state);
+
+// Returns true if `regex` is anchored only at the end, so the quickest way to decide a match
+// is to read the input backwards from its end, with `match_from_end`
+bool prefers_match_from_end(const Regex* regex);
+
+// Decide if `regex` matches the `len` bytes at `buf` by running the reversed automaton from the end of the input,
+// stopping at the first place a match can begin. Only right for patterns ending in `$`
+bool match_from_end(const Regex* regex, MatchState* state, const char* buf, size_t len);
+
+// Free the memory alloc'd by `state`
+void destroy_match_state(const MatchState* state);
+
+// The most states a Dfa holds before it throws them all away and starts over
+#define DFA_MAX_STATES 4096
+
+// flags of a Dfa state
+#define DFA_ACCEPTS 1
+// every input is accepted from here, whatever comes next
+#define DFA_SURE 2
+// no input is accepted from here
+#define DFA_DEAD 4
+
+// A deterministic automaton for a Regex, built lazily as the input needs it.
+// Each of its states is a set of NFA nodes (the set a MatchState would be holding).
+// The first time a state sees a class of byte, the set simulation works out where it goes,
+// and from then on it is one lookup in the transition table.
+// Like a MatchState, input can be fed to it a piece at a time.
+typedef struct {
+    // the transition table: the state after `s` reads a byte of class `c` is trans[s * num_classes + c],
+    // or -1 if that has not been worked out yet
+    int32_t* trans;
+    size_t num_classes;
+    // DFA_ flags for each state
+    uint8_t* flags;
+    size_t num_states;
+    size_t cap_states;
+    // the node ids of each state, sorted: state `s` has ids[ids_beg[s] .. ids_beg[s + 1])
+    uint32_t* ids;
+    size_t num_ids;
+    size_t cap_ids;
+    size_t* ids_beg;
+    // open addressing hash table from a set of node ids to its state (-1 for an empty slot)
+    int32_t* table;
+    size_t table_cap;
+    // the state before any input, and the state we are in
+    int32_t start;
+    int32_t curr;
+    // for working out new transitions
+    MatchState sets;
+    uint32_t* new_ids;
+    // how many times every state was thrown away (which makes the numbers of the old states meaningless)
+    size_t num_clears;
+} Dfa;
+
+// Allocate a Dfa for `regex`, in its start state. It knows nothing but its start state
+void init_dfa(Dfa* dfa, const Regex* regex);
+
+// Go back to the start state, so we can match a new input (what was learned about `regex` is kept)
+void reset_dfa(Dfa* dfa);
+
+// Advance the Dfa by consuming the `len` bytes at `buf`
+void feed_dfa(Dfa* dfa, const Regex* regex, const char* buf, size_t len);
+
+// Returns true if the input fed so far (since the last reset) matched
+bool dfa_accepts(const Dfa* dfa);
+
+// Returns true if the outcome can no longer change, whatever more input is fed (see `match_state_settled`)
+bool dfa_settled(const Dfa* dfa);
+
+// How many lines `match_dfa_lines` steps through the Dfa together
+#define DFA_STREAMS 4
+
+// Decide whether each of the `num_lines` (at most DFA_STREAMS) lines lines[i] matches, setting accepts[i].
+// The lines take a step through the Dfa each in turn, so that the lookups for one line do not have to wait
+// for those of another, and the processor can have all of them on the way at once.
+// Leaves the Dfa in its start state
+void match_dfa_lines(Dfa* dfa, const Regex* regex, const StrView* lines, size_t num_lines, bool* accepts);
+
+// Work out every state and transition the Dfa can reach, so it never needs the set simulation again
+// Returns false if that would take more than DFA_MAX_STATES states (in which case the Dfa is only partly built)
+bool explore_dfa(Dfa* dfa, const Regex* regex);
+
+// Free the memory alloc'd by `dfa`
+void destroy_dfa(const Dfa* dfa);
+
+// Write to `out` a C source file that defines `int name(const char* buf, size_t len)`,
+// which returns 1 if the `len` bytes at `buf` contain a match of `regex` (as one line of input would) and 0 if not.
+// The whole DFA is built ahead of time, each state becoming a label and each byte class a `case`.
+// `pattern` is what `regex` was compiled from, for a comment.
+// Returns false (and prints a message to stderr) if the DFA has too many states
+bool emit_c(const Regex* regex, const char* pattern, const char* name, FILE* out);
+
+// A growable array of the (non-owning) edges taken through the NFA
+typedef struct {
+    Edge** edges;
+    // for each edge, where in the input its target was entered, and how many of the target's edges have been tried
+    const char** inputs;
+    size_t* tried;
+    size_t len;
+    size_t cap;
+} Path;
+
+// =================================================================================
+//   Matching from many threads at once
+//
+// Once `compile` returns, a Regex is never written to again, so any number of threads
+// may match against the same one without locking.
+// Everything that changes during a match lives in a MatchScratch instead, which belongs to one thread at a time.
+// It is allocated once and reused for every match: after the first few matches have grown it
+// to fit the pattern and input, matching allocates nothing.
+// =================================================================================
+
+// How many steps (nodes visited) the path search may take on one input, unless told otherwise.
+// Past that, the input is handed to the linear-time capture engine instead
+#define DEFAULT_STEP_BUDGET 50000
+
+// What the path search has left to spend on the current input
+typedef struct {
+    // how many more steps it may take (unlimited if `unlimited`)
+    size_t left;
+    bool unlimited;
+    // set once the search ran out of steps and gave up
+    bool exhausted;
+} StepBudget;
+
+// Scratch space for the linear-time capture engine (see pike.c).
+// It keeps a list of threads, one per consuming edge that could take the next byte, in the order
+// the path search would try them, along with what each one captured on the way.
+// Its arrays are only allocated the first time the engine runs
+typedef struct {
+    // the nodes entered at the current and next position, and the captures made getting to each.
+    // node i has `stride` slots, starting at slots[i * stride]:
+    // for each group, where it was last opened, and where its last capture began and ended
+    size_t* curr_slots;
+    size_t* next_slots;
+    CaptureFlags* curr_open;
+    CaptureFlags* next_open;
+    size_t num_next_nodes;
+    size_t stride;
+    // the threads for the current and next byte: an edge, and the node (index) it leaves from
+    const Edge** curr_edges;
+    size_t* curr_from;
+    size_t num_curr;
+    const Edge** next_edges;
+    size_t* next_from;
+    size_t num_next;
+    // marks[id] == generation if node `id` was already entered at the next position
+    size_t* marks;
+    size_t generation;
+    // explicit stack of the edges still to be followed from the nodes entered, and the node (index) each leaves from
+    const Edge** stack_edges;
+    size_t* stack_from;
+    // the slots of the first thread to accept
+    size_t* found;
+    bool matched;
+} PikeState;
+
+typedef struct {
+    Path path;
+    MatchState state;
+    Dfa dfa;
+    PikeState pike;
+    // the step budget given to the path search for each input (0 means no limit)
+    size_t step_budget;
+    // how many inputs went over the step budget and were matched by the linear-time engine instead
+    size_t num_fallbacks;
+} MatchScratch;
+
+// Allocate scratch space for matching against `regex`
+void init_match_scratch(MatchScratch* scratch, const Regex* regex);
+
+// Free the memory alloc'd by `scratch`
+void destroy_match_scratch(const MatchScratch* scratch);
+
+// Returns true if `regex` matches the `len` bytes at `buf`
+bool match_len(const Regex* regex, MatchScratch* scratch, const char* buf, size_t len);
+
+// Returns true if `regex` matches the `len` bytes at `buf`.
+// If so, groups[i] is set to the last capture of group i (group 0 is the whole match),
+// or a NULL `beg` if the group did not capture anything, for each i < num_groups.
+// The captures point into `buf`.
+bool capture_len(const Regex* regex, MatchScratch* scratch, const char* buf, size_t len,
+                 StrView* groups, size_t num_groups);
+
+// Like `is_match_len`, recording every capture of every group in `captures`,
+// but with the step budget and scratch space of `scratch`.
+// An input that goes over budget only records the last capture of each group
+bool capture_all_len(const Regex* regex, MatchScratch* scratch, const char* buf, size_t len, Captures* captures);
+
+// Matches `regex` against the `len` bytes at `buf` in time linear in `len`, whatever the pattern.
+// Gives the same result as the path search, filling groups[i] the way `capture_len` does
+bool pike_captures(const Regex* regex, PikeState* pike, const char* buf, size_t len,
+                   StrView* groups, size_t num_groups);
+
+// Free the memory alloc'd by `pike`, if it ever ran
+void destroy_pike_state(const PikeState* pike);
+
+// Finds the match of `regex` that begins at or after `from` in the `len` bytes at `buf`
+// that the path search would find: the leftmost, and of those the first in the order it tries the edges.
+// Unless `allow_empty`, empty matches are passed over.
+// Returns true if there is one, setting buf[*beg .. *end) to the match
+bool find_span(const Regex* regex, MatchState* state, const char* buf, size_t len, size_t from,
+               bool allow_empty, size_t* beg, size_t* end);
+
+// Steps through every non-overlapping match in a buffer, from left to right
+typedef struct {
+    const Regex* regex;
+    MatchScratch* scratch;
+    const char* buf;
+    size_t len;
+    // where the search for the next match begins
+    size_t pos;
+} MatchIter;
+
+// Prepare to iterate over the matches of `regex` in the `len` bytes at `buf`
+void init_match_iter(MatchIter* iter, const Regex* regex, MatchScratch* scratch, const char* buf, size_t len);
+
+// Find the next match (each search continues from the end of the last match)
+// Returns true and sets `match` if there is one, or false once there are no more
+bool next_match(MatchIter* iter, StrView* match);
+
 // Free the memory alloc'd by `regex`
 void destroy_regex(const Regex* regex);
 
@@ -3,6 +3,7 @@
 #include <stdio.h>
 
 #include "repition.h"
+#include "util.h"
 
 // parses an integer from `*str`, advancing `**str` to the first unconsumed char
 unsigned int parse_int(const char** str) {
@@ -53,21 +54,21 @@ bool parse_repition(Repition* rep, const char** str) {
                     rep->upper_bound = parse_int(str);
                     rep->is_unbounded = false;
                     if (rep->upper_bound < rep->lower_bound) {
-                        fprintf(stderr, "ERROR: regex upper bound (%d) is less than lower bound (%d)\n",
+                        fprintf(error_output(), "ERROR: regex upper bound (%d) is less than lower bound (%d)\n",
                                 rep->upper_bound, rep->lower_bound);
                         return false;
                     }
                     if (**str != '}') {
-                        fprintf(stderr, "ERROR in regex { }, found no closing `}`, found: `%s`\n", *str);
+                        fprintf(error_output(), "ERROR in regex { }, found no closing `}`, found: `%s`\n", *str);
                         return false;
                     }
                     ++*str;
                 } else {
-                    fprintf(stderr, "ERROR: in regex { } repition, expected `}` or number, found: `%c`\n", **str);
+                    fprintf(error_output(), "ERROR: in regex { } repition, expected `}` or number, found: `%c`\n", **str);
                     return false;
                 }
             } else {
-                fprintf(stderr, "ERROR: in regex { } repition, expected `,` or `}`, found: `%c`\n", **str);
+                fprintf(error_output(), "ERROR: in regex { } repition, expected `,` or `}`, found: `%c`\n", **str);
                 return false;
             }
             break;
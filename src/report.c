@@ -0,0 +1,144 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "report.h"
+#include "utf8.h"
+#include "util.h"
+
+//
+// This file contains the statistics behind `--report=json`
+//
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void init_report(Report* report, uint64_t start_ns) {
+    pthread_mutex_init(&report->lock, NULL);
+    report->files = NULL;
+    report->num_files = 0;
+    report->cap_files = 0;
+    report->start_ns = start_ns;
+    report->compile_ns = 0;
+}
+
+void destroy_report(Report* report) {
+    for (size_t i = 0; i < report->num_files; ++i) {
+        free(report->files[i].name);
+    }
+    free(report->files);
+    pthread_mutex_destroy(&report->lock);
+}
+
+void init_file_stats(FileStats* stats, const char* name) {
+    memset(stats, 0, sizeof(FileStats));
+    stats->name = make_copy(name);
+}
+
+void record_line(FileStats* stats, uint64_t ns) {
+    int bucket = 0;
+    while (bucket + 1 < LATENCY_BUCKETS && ns >> (bucket + 1)) {
+        ++bucket;
+    }
+    stats->latency[bucket] += 1;
+    stats->lines += 1;
+    stats->match_ns += ns;
+}
+
+void add_file_stats(Report* report, FileStats* stats) {
+    pthread_mutex_lock(&report->lock);
+    if (report->num_files >= report->cap_files) {
+        size_t new_cap = 2 * report->cap_files;
+        if (new_cap == 0) {
+            new_cap = 16;
+        }
+        FileStats* new_files = realloc(report->files, sizeof(FileStats) * new_cap);
+        if (!new_files) {
+            pthread_mutex_unlock(&report->lock);
+            out_of_memory();
+        }
+        report->files = new_files;
+        report->cap_files = new_cap;
+    }
+    report->files[report->num_files] = *stats;
+    report->num_files += 1;
+    pthread_mutex_unlock(&report->lock);
+}
+
+// Write `str` as a JSON string.
+// JSON has to be UTF-8, but a file name can be any bytes: a byte that is not part of a valid UTF-8 character
+// is written as the code point with the same value, e.g. \u00ff for 0xff
+void write_json_string(FILE* out, const char* str) {
+    fputc('"', out);
+    while (*str) {
+        unsigned char ch = *str;
+        uint32_t codepoint;
+        size_t len = ch < 0x80 ? 1 : decode_utf8(str, &codepoint);
+        if (ch == '"' || ch == '\\') {
+            fprintf(out, "\\%c", ch);
+        } else if (ch < 0x20 || len == 0) {
+            fprintf(out, "\\u%04x", ch);
+        } else {
+            fwrite(str, 1, len, out);
+        }
+        str += len > 0 ? len : 1;
+    }
+    fputc('"', out);
+}
+
+// Write the counts and times of `stats` as the fields of a JSON object (without the braces)
+void write_stats_fields(FILE* out, const FileStats* stats) {
+    fprintf(out, "\"bytes\": %lu, \"lines\": %lu, \"matched_lines\": %lu, \"fallback_lines\": %lu, ",
+            stats->bytes, stats->lines, stats->matched_lines, stats->fallback_lines);
+    fprintf(out, "\"wall_ns\": %lu, \"io_ns\": %lu, \"match_ns\": %lu, ",
+            stats->wall_ns, stats->io_ns, stats->match_ns);
+    // only the buckets that have anything in them, each named by the time its lines took less than
+    fprintf(out, "\"line_latency\": [");
+    bool first = true;
+    for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+        if (stats->latency[i] == 0) {
+            continue;
+        }
+        fprintf(out, "%s{\"below_ns\": %lu, \"lines\": %lu}", first ? "" : ", ",
+                (uint64_t)1 << (i + 1), stats->latency[i]);
+        first = false;
+    }
+    fprintf(out, "]");
+}
+
+void write_report_json(Report* report, FILE* out) {
+    pthread_mutex_lock(&report->lock);
+    FileStats total;
+    memset(&total, 0, sizeof(FileStats));
+    fprintf(out, "{\n  \"files\": [");
+    for (size_t i = 0; i < report->num_files; ++i) {
+        const FileStats* stats = &report->files[i];
+        fprintf(out, "%s\n    {\"name\": ", i == 0 ? "" : ",");
+        write_json_string(out, stats->name);
+        fprintf(out, ", ");
+        write_stats_fields(out, stats);
+        fprintf(out, "}");
+
+        total.bytes += stats->bytes;
+        total.lines += stats->lines;
+        total.matched_lines += stats->matched_lines;
+        total.fallback_lines += stats->fallback_lines;
+        total.wall_ns += stats->wall_ns;
+        total.io_ns += stats->io_ns;
+        total.match_ns += stats->match_ns;
+        for (int j = 0; j < LATENCY_BUCKETS; ++j) {
+            total.latency[j] += stats->latency[j];
+        }
+    }
+    // with threads, the files' wall times overlap, so the run's wall time is measured on its own
+    fprintf(out, "%s],\n  \"total\": {\"files\": %lu, \"compile_ns\": %lu, \"run_wall_ns\": %lu, ",
+            report->num_files > 0 ? "\n  " : "", report->num_files, report->compile_ns, now_ns() - report->start_ns);
+    write_stats_fields(out, &total);
+    fprintf(out, "}\n}\n");
+    pthread_mutex_unlock(&report->lock);
+}
@@ -0,0 +1,61 @@
+#ifndef __report_h__
+#define __report_h__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+// how many buckets the histogram of per-line match times has:
+// bucket i counts the lines that took from 2^i up to 2^(i+1) nanoseconds (bucket 0 also counts 0)
+#define LATENCY_BUCKETS 40
+
+// What happened while searching one input
+typedef struct {
+    // dynamically allocated copy of the input's name
+    char* name;
+    uint64_t bytes;
+    uint64_t lines;
+    uint64_t matched_lines;
+    // lines that went over the step budget (see MatchScratch)
+    uint64_t fallback_lines;
+    // from opening the input to the end of it, and the parts of that spent waiting on input and matching lines
+    uint64_t wall_ns;
+    uint64_t io_ns;
+    uint64_t match_ns;
+    uint64_t latency[LATENCY_BUCKETS];
+} FileStats;
+
+// The statistics of a whole run, which any number of threads can add to
+typedef struct {
+    // guards `files`
+    pthread_mutex_t lock;
+    // dynamically allocated array of the inputs searched so far, in the order they finished
+    FileStats* files;
+    size_t num_files;
+    size_t cap_files;
+    // when the run began, and how long compiling the regex took
+    uint64_t start_ns;
+    uint64_t compile_ns;
+} Report;
+
+// The time in nanoseconds, from some arbitrary (but fixed) point
+uint64_t now_ns(void);
+
+// Start a report for a run that began at `start_ns`
+void init_report(Report* report, uint64_t start_ns);
+
+void destroy_report(Report* report);
+
+// Zero the statistics of the input called `name`
+void init_file_stats(FileStats* stats, const char* name);
+
+// Count one line that took `ns` nanoseconds to match (and print, if it matched)
+void record_line(FileStats* stats, uint64_t ns);
+
+// Add the statistics of a finished input to the report, which takes ownership of them
+void add_file_stats(Report* report, FileStats* stats);
+
+// Write the report as a JSON object to `out`: one entry per input, and the totals over all of them
+void write_report_json(Report* report, FILE* out);
+
+#endif
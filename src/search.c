@@ -0,0 +1,629 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+
+#include "search.h"
+#include "follow.h"
+#include "index.h"
+#include "input.h"
+#include "walk.h"
+#include "util.h"
+
+//
+// This file contains the line matching loop shared by every way we can be handed input
+//
+
+// how much input we ask for at once
+#define READ_BLOCK_SIZE (256 * 1024)
+
+// the most lines we match without looking ahead for the regex's literal, when it is on most lines
+#define MAX_SKIP_BACKOFF 256
+
+void init_search_options(SearchOptions* opts) {
+    opts->trim_to_match = false;
+    opts->print_captures = false;
+    opts->all_matches = false;
+    opts->recursive = false;
+    opts->includes = NULL;
+    opts->num_includes = 0;
+    opts->excludes = NULL;
+    opts->num_excludes = 0;
+    opts->num_threads = 1;
+    opts->step_budget = DEFAULT_STEP_BUDGET;
+    opts->report = NULL;
+    opts->fallback_lines = NULL;
+    opts->index_path = NULL;
+    opts->follow = false;
+    opts->line_numbers = false;
+    opts->byte_offsets = false;
+}
+
+void destroy_search_options(const SearchOptions* opts) {
+    free(opts->includes);
+    free(opts->excludes);
+}
+
+// Append `glob` to the dynamically allocated array `*globs`
+void push_glob(const char*** globs, size_t* num_globs, const char* glob) {
+    const char** new_globs = realloc(*globs, sizeof(char*) * (*num_globs + 1));
+    if (!new_globs) {
+        out_of_memory();
+    }
+    new_globs[*num_globs] = glob;
+    *globs = new_globs;
+    *num_globs += 1;
+}
+
+char** parse_search_options(char** argv, SearchOptions* opts, int* compile_flags, bool* want_report, FILE* err) {
+    for (; *argv; ++argv) {
+        if (**argv != '-' || strcmp(*argv, "-") == 0) {
+            break;
+        }
+        if (  strcmp(*argv, "-t") == 0
+           || strcmp(*argv, "--trim") == 0)
+        {
+            opts->trim_to_match = true;
+        }
+        if (  strcmp(*argv, "-c") == 0
+           || strcmp(*argv, "--print-captures") == 0)
+        {
+            opts->print_captures = true;
+        }
+        if (  strcmp(*argv, "-o") == 0
+           || strcmp(*argv, "--only-matching") == 0)
+        {
+            opts->all_matches = true;
+        }
+        if (  strcmp(*argv, "-r") == 0
+           || strcmp(*argv, "--recursive") == 0)
+        {
+            opts->recursive = true;
+        }
+        if (strncmp(*argv, "--include=", strlen("--include=")) == 0) {
+            push_glob(&opts->includes, &opts->num_includes, *argv + strlen("--include="));
+        }
+        if (strncmp(*argv, "--exclude=", strlen("--exclude=")) == 0) {
+            push_glob(&opts->excludes, &opts->num_excludes, *argv + strlen("--exclude="));
+        }
+        if (  (strcmp(*argv, "-j") == 0 || strcmp(*argv, "--threads") == 0)
+           && argv[1])
+        {
+            ++argv;
+            opts->num_threads = atoi(*argv);
+        }
+        if (strcmp(*argv, "--step-budget") == 0 && argv[1]) {
+            ++argv;
+            opts->step_budget = strtoul(*argv, NULL, 10);
+        }
+        if (  strcmp(*argv, "-u") == 0
+           || strcmp(*argv, "--utf8") == 0)
+        {
+            *compile_flags |= COMPILE_UTF8;
+        }
+        if (strncmp(*argv, "--report=", strlen("--report=")) == 0) {
+            const char* format = *argv + strlen("--report=");
+            if (strcmp(format, "json") != 0) {
+                fprintf(err, "ERROR: Unknown report format `%s` (only `json` is supported)\n", format);
+                return NULL;
+            }
+            *want_report = true;
+        }
+        if (  strcmp(*argv, "-f") == 0
+           || strcmp(*argv, "--follow") == 0)
+        {
+            opts->follow = true;
+        }
+        if (  strcmp(*argv, "-n") == 0
+           || strcmp(*argv, "--line-number") == 0)
+        {
+            opts->line_numbers = true;
+        }
+        if (  strcmp(*argv, "-b") == 0
+           || strcmp(*argv, "--byte-offset") == 0)
+        {
+            opts->byte_offsets = true;
+        }
+        if (strncmp(*argv, "--use-index=", strlen("--use-index=")) == 0) {
+            opts->index_path = *argv + strlen("--use-index=");
+        }
+    }
+    if (!opts->print_captures) {
+        // nothing but where matches begin and end is ever printed
+        *compile_flags |= COMPILE_NO_CAPTURES;
+    }
+    return argv;
+}
+
+// Returns true if `name` matches any of the `num_globs` globs
+bool matches_any_glob(const char** globs, size_t num_globs, const char* name) {
+    for (size_t i = 0; i < num_globs; ++i) {
+        if (fnmatch(globs[i], name, 0) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool want_file(const SearchOptions* opts, const char* name) {
+    if (opts->num_includes > 0 && !matches_any_glob(opts->includes, opts->num_includes, name)) {
+        return false;
+    }
+    return !matches_any_glob(opts->excludes, opts->num_excludes, name);
+}
+
+bool want_dir(const SearchOptions* opts, const char* name) {
+    return !matches_any_glob(opts->excludes, opts->num_excludes, name);
+}
+
+// Print what goes before a printed line: the label (if any), then the line number and the byte offset,
+// if the options ask for them. `offset` is where what is printed begins in the input
+void print_prefix(FILE* out, const char* label, uint64_t line_number, uint64_t offset, const SearchOptions* opts) {
+    if (label) {
+        fprintf(out, "%s:", label);
+    }
+    if (opts->line_numbers) {
+        fprintf(out, "%lu:", line_number);
+    }
+    if (opts->byte_offsets) {
+        fprintf(out, "%lu:", offset);
+    }
+}
+
+// Print a line that is known to match, along with whatever else the options ask for.
+// It is line `line_number` of the input (if `opts->line_numbers` is set), and begins at `offset`
+void print_match(const Regex* regex, MatchScratch* scratch, const char* line, size_t len, FILE* out,
+                 const char* label, uint64_t line_number, uint64_t offset, const SearchOptions* opts)
+{
+    if (opts->all_matches) {
+        // every match on its own line
+        MatchIter iter;
+        init_match_iter(&iter, regex, scratch, line, len);
+        StrView match;
+        while (next_match(&iter, &match)) {
+            print_prefix(out, label, line_number, offset + (match.beg - line), opts);
+            fwrite(match.beg, 1, match.len, out);
+            fputc('\n', out);
+        }
+        return;
+    }
+    if (!opts->print_captures) {
+        StrView whole = { line, len };
+        if (opts->trim_to_match) {
+            // only where the match begins and ends is needed, which does not take a path search,
+            // but it is the same match that one (and so -c) finds
+            size_t beg = 0, end = 0;
+            find_span(regex, &scratch->state, line, len, 0, true, &beg, &end);
+            whole.beg = line + beg;
+            whole.len = end - beg;
+        }
+        print_prefix(out, label, line_number, offset + (whole.beg - line), opts);
+        fwrite(whole.beg, 1, whole.len, out);
+        fputc('\n', out);
+        return;
+    }
+    // every capture of every group is wanted, not just the last
+    Captures captures;
+    if (!capture_all_len(regex, scratch, line, len, &captures)) {
+        print_prefix(out, label, line_number, offset, opts);
+        fwrite(line, 1, len, out);
+        fputc('\n', out);
+        return;
+    }
+    if (opts->trim_to_match) {
+        size_t _num;
+        StrView s = get_capts(&captures, 0, &_num)[0]; // capture group 0 is the whole regex
+        print_prefix(out, label, line_number, offset + (s.beg - line), opts);
+        fwrite(s.beg, 1, s.len, out);
+    } else {
+        print_prefix(out, label, line_number, offset, opts);
+        fwrite(line, 1, len, out);
+    }
+    fputc('\n', out);
+    for (size_t group_idx = 1; group_idx < captures.num_groups; ++group_idx) {
+        size_t num;
+        StrView* capts = get_capts(&captures, group_idx, &num);
+        fprintf(out, "    [%ld]", group_idx);
+        for (size_t capt_idx = 0; capt_idx < num; ++capt_idx) {
+            StrView s = capts[capt_idx];
+            fputc(' ', out);
+            fwrite(s.beg, 1, s.len, out);
+        }
+        fprintf(out, "\n");
+    }
+    destroy_captures(&captures);
+}
+
+bool match_lines(const Regex* regex, FILE* in, const char* name, FILE* out, bool label_lines,
+                 const SearchOptions* opts)
+{
+    MatchScratch scratch;
+    init_match_scratch(&scratch, regex);
+    bool ok = match_lines_with(regex, &scratch, in, name, out, label_lines, opts);
+    destroy_match_scratch(&scratch);
+    return ok;
+}
+
+void init_line_scanner(LineScanner* scanner, const Regex* regex, MatchScratch* scratch, FILE* out, const char* label,
+                       const SearchOptions* opts, FileStats* stats)
+{
+    scanner->regex = regex;
+    scanner->scratch = scratch;
+    scanner->out = out;
+    scanner->label = label;
+    scanner->opts = opts;
+    // (allocated when input is first read into it, unless the caller hands it one)
+    scanner->buf = NULL;
+    scanner->cap = 0;
+    scanner->filled = 0;
+    scanner->line_beg = 0;
+    scanner->fed = 0;
+    // a pattern anchored only at the end is quickest decided by reading each line backwards, once we have all of it
+    scanner->from_end = prefers_match_from_end(regex);
+    scanner->bits = !scanner->from_end && prefers_match_bits(regex);
+    scanner->interleave = !scanner->from_end && !scanner->bits && !stats;
+    scanner->skip = regex->literal && !stats;
+    scanner->skip_wait = 0;
+    scanner->skip_backoff = 0;
+    restart_line_scanner(scanner);
+    scanner->stats = stats;
+    scanner->mark = 0;
+    scanner->line_ns = 0;
+    scratch->step_budget = opts->step_budget;
+    reset_dfa(&scratch->dfa);
+}
+
+void destroy_line_scanner(const LineScanner* scanner) {
+    free(scanner->buf);
+}
+
+// The first `len` bytes of the buffer are about to be thrown away, after counting their lines (if need be)
+void discard_input(LineScanner* scanner, size_t len) {
+    if (scanner->opts->line_numbers) {
+        scanner->lines_before += count_newlines(scanner->buf + scanner->counted, len - scanner->counted);
+    }
+    scanner->counted = 0;
+    scanner->buf_offset += len;
+}
+
+void restart_line_scanner(LineScanner* scanner) {
+    scanner->buf_offset = 0;
+    scanner->counted = 0;
+    scanner->lines_before = 0;
+}
+
+char* scanner_space(LineScanner* scanner, size_t* room) {
+    if (!scanner->buf) {
+        scanner->cap = READ_BLOCK_SIZE;
+        scanner->buf = alloc_or_die(scanner->cap, 1);
+    }
+    if (scanner->filled == scanner->cap) {
+        if (scanner->line_beg == 0) {
+            // the line is longer than the buffer, so make room for more of it
+            char* new_buf = realloc(scanner->buf, 2 * scanner->cap);
+            if (!new_buf) {
+                fprintf(error_output(), "ERROR: out of memory for a line of more than %ld bytes\n", scanner->cap);
+                return NULL;
+            }
+            scanner->buf = new_buf;
+            scanner->cap *= 2;
+        } else {
+            discard_input(scanner, scanner->line_beg);
+            memmove(scanner->buf, scanner->buf + scanner->line_beg, scanner->filled - scanner->line_beg);
+            scanner->filled -= scanner->line_beg;
+            scanner->fed -= scanner->line_beg;
+            scanner->line_beg = 0;
+        }
+    }
+    *room = scanner->cap - scanner->filled;
+    return scanner->buf + scanner->filled;
+}
+
+// Returns where the first line from buf[from .. filled) that could match begins: the line the literal
+// every match contains is first found on. If it is not there, no line can match, except the last one
+// (if it is not over yet, and the rest of the literal is still to come)
+size_t skip_lines_without_literal(const Regex* regex, const char* buf, size_t from, size_t filled, bool at_eof) {
+    const char* hit = memmem(buf + from, filled - from, regex->literal, regex->literal_len);
+    const char* nl;
+    if (hit) {
+        nl = memrchr(buf + from, '\n', hit - (buf + from));
+    } else if (at_eof) {
+        return filled;
+    } else {
+        nl = memrchr(buf + from, '\n', filled - from);
+    }
+    return nl ? (size_t)(nl + 1 - buf) : from;
+}
+
+// Print the line buf[line_beg .. line_beg + len), which matched, counting the lines before it if need be
+void print_line(LineScanner* scanner, size_t line_beg, size_t len) {
+    uint64_t line_number = 0;
+    if (scanner->opts->line_numbers) {
+        // count the lines since the last one we counted to, all at once
+        scanner->lines_before += count_newlines(scanner->buf + scanner->counted, line_beg - scanner->counted);
+        scanner->counted = line_beg;
+        line_number = scanner->lines_before + 1;
+    }
+    print_match(scanner->regex, scanner->scratch, scanner->buf + line_beg, len, scanner->out, scanner->label,
+                line_number, scanner->buf_offset + line_beg, scanner->opts);
+}
+
+// Match the whole lines that begin at buf[line_beg] together, as many as there are (up to `most`, and DFA_STREAMS),
+// and print those that match. Returns how many lines were matched, which is 0 if there were not at least two
+size_t scan_line_batch(LineScanner* scanner, size_t most) {
+    char* buf = scanner->buf;
+    StrView lines[DFA_STREAMS];
+    size_t ends[DFA_STREAMS];
+    size_t num_lines = 0;
+    size_t from = scanner->line_beg;
+    while (num_lines < most && num_lines < DFA_STREAMS && from < scanner->filled) {
+        char* nl = memchr(buf + from, '\n', scanner->filled - from);
+        if (!nl) {
+            break;
+        }
+        size_t line_end = nl - buf;
+        size_t len = line_end - from;
+        if (len > 0 && buf[line_end - 1] == '\r') {
+            --len;
+        }
+        lines[num_lines].beg = buf + from;
+        lines[num_lines].len = len;
+        ends[num_lines] = line_end;
+        ++num_lines;
+        from = line_end + 1;
+    }
+    if (num_lines < 2) {
+        return 0;
+    }
+    bool accepts[DFA_STREAMS];
+    match_dfa_lines(&scanner->scratch->dfa, scanner->regex, lines, num_lines, accepts);
+    for (size_t i = 0; i < num_lines; ++i) {
+        if (accepts[i]) {
+            print_line(scanner, lines[i].beg - buf, lines[i].len);
+        }
+    }
+    scanner->line_beg = ends[num_lines - 1] + 1;
+    scanner->fed = scanner->line_beg;
+    return num_lines;
+}
+
+void scan_lines(LineScanner* scanner, size_t got, bool at_eof) {
+    const Regex* regex = scanner->regex;
+    MatchScratch* scratch = scanner->scratch;
+    Dfa* dfa = &scratch->dfa;
+    FileStats* stats = scanner->stats;
+    char* buf = scanner->buf;
+    scanner->filled += got;
+    if (stats) {
+        stats->bytes += got;
+        scanner->mark = now_ns();
+    }
+
+    while (scanner->line_beg < scanner->filled) {
+        if (scanner->skip && scanner->fed == scanner->line_beg) {
+            if (scanner->skip_wait > 0) {
+                --scanner->skip_wait;
+            } else {
+                size_t skip_to = skip_lines_without_literal(regex, buf, scanner->line_beg, scanner->filled, at_eof);
+                if (skip_to == scanner->line_beg) {
+                    // the literal is on this line: if that keeps happening, looking for it is a waste,
+                    // so go longer and longer without
+                    scanner->skip_backoff = scanner->skip_backoff == 0 ? 1 : min(2 * scanner->skip_backoff, MAX_SKIP_BACKOFF);
+                    scanner->skip_wait = scanner->skip_backoff;
+                } else {
+                    scanner->skip_backoff = 0;
+                }
+                scanner->line_beg = skip_to;
+                scanner->fed = skip_to;
+                if (scanner->line_beg == scanner->filled) {
+                    break;
+                }
+            }
+        }
+        if (scanner->interleave && scanner->fed == scanner->line_beg) {
+            // (the lines after the first are not looked for the literal in, so only take as many as we would not look anyway)
+            size_t num = scan_line_batch(scanner, scanner->skip ? scanner->skip_wait + 1 : DFA_STREAMS);
+            if (num > 0) {
+                if (scanner->skip) {
+                    scanner->skip_wait -= num - 1;
+                }
+                continue;
+            }
+        }
+        char* nl = memchr(buf + scanner->fed, '\n', scanner->filled - scanner->fed);
+        if (!nl) {
+            if (!at_eof) {
+                // feed what we have, except a '\r' that might yet turn out to end the line
+                size_t upto = scanner->filled;
+                if (buf[upto - 1] == '\r') {
+                    --upto;
+                }
+                if (upto > scanner->fed) {
+                    if (!scanner->from_end && !scanner->bits) {
+                        feed_dfa(dfa, regex, buf + scanner->fed, upto - scanner->fed);
+                    }
+                    scanner->fed = upto;
+                }
+                if (stats) {
+                    scanner->line_ns += now_ns() - scanner->mark;
+                }
+                break;
+            }
+            // the last line had no newline at the end
+            nl = buf + scanner->filled;
+        }
+        size_t line_beg = scanner->line_beg;
+        size_t line_end = nl - buf;
+        size_t len = line_end - line_beg;
+        if (len > 0 && buf[line_end - 1] == '\r') {
+            --len;
+        }
+        bool matched;
+        if (scanner->from_end) {
+            matched = match_from_end(regex, &scratch->state, buf + line_beg, len);
+        } else if (scanner->bits) {
+            matched = match_bits(regex->bits, buf + line_beg, len);
+        } else {
+            // (once the automaton has settled, feeding it the rest of the line costs nothing)
+            if (line_beg + len > scanner->fed) {
+                feed_dfa(dfa, regex, buf + scanner->fed, line_beg + len - scanner->fed);
+            }
+            matched = dfa_accepts(dfa);
+        }
+        if (matched) {
+            print_line(scanner, line_beg, len);
+        }
+        if (stats) {
+            uint64_t now = now_ns();
+            record_line(stats, scanner->line_ns + (now - scanner->mark));
+            stats->matched_lines += matched;
+            scanner->mark = now;
+            scanner->line_ns = 0;
+        }
+        reset_dfa(dfa);
+        scanner->line_beg = line_end + 1;
+        scanner->fed = scanner->line_beg;
+    }
+    if (scanner->line_beg >= scanner->filled) {
+        // everything read so far is done with
+        discard_input(scanner, scanner->filled);
+        scanner->filled = 0;
+        scanner->line_beg = 0;
+        scanner->fed = 0;
+    }
+}
+
+// Start timing the file `name`, if a report was asked for. Returns where its stats go, or NULL if they are not kept
+FileStats* start_file_stats(FileStats* file_stats, const char* name, const SearchOptions* opts) {
+    if (!opts->report) {
+        return NULL;
+    }
+    init_file_stats(file_stats, name);
+    file_stats->wall_ns = now_ns();
+    return file_stats;
+}
+
+// Read the rest of `input` (unless `at_eof` is already set) and match its lines with `scanner`,
+// then close it and add up the file's stats
+bool scan_input(LineScanner* scanner, Input* input, bool at_eof, FileStats* stats) {
+    MatchScratch* scratch = scanner->scratch;
+    bool ok = true;
+    while (!at_eof) {
+        size_t room;
+        char* space = scanner_space(scanner, &room);
+        if (!space) {
+            ok = false;
+            break;
+        }
+        // a pipe hands us whatever it has, without waiting to fill the block
+        uint64_t read_beg = stats ? now_ns() : 0;
+        ssize_t got = read_input(input, space, room);
+        if (stats) {
+            stats->io_ns += now_ns() - read_beg;
+        }
+        if (got < 0) {
+            ok = false;
+        }
+        at_eof = got <= 0;
+        scan_lines(scanner, got > 0 ? got : 0, at_eof);
+    }
+
+    if (scanner->opts->fallback_lines) {
+        __atomic_add_fetch(scanner->opts->fallback_lines, scratch->num_fallbacks, __ATOMIC_RELAXED);
+    }
+    if (stats) {
+        stats->fallback_lines = scratch->num_fallbacks;
+    }
+    destroy_line_scanner(scanner);
+    close_input(input);
+    if (stats) {
+        stats->wall_ns = now_ns() - stats->wall_ns;
+        add_file_stats(scanner->opts->report, stats);
+    }
+    return ok;
+}
+
+bool match_lines_with(const Regex* regex, MatchScratch* scratch, FILE* in, const char* name, FILE* out,
+                      bool label_lines, const SearchOptions* opts)
+{
+    FileStats file_stats;
+    FileStats* stats = start_file_stats(&file_stats, name, opts);
+    Input input;
+    if (!open_input(&input, fileno(in), name)) {
+        if (stats) {
+            free(stats->name);
+        }
+        return false;
+    }
+    scratch->num_fallbacks = 0;
+    LineScanner scanner;
+    init_line_scanner(&scanner, regex, scratch, out, label_lines ? name : NULL, opts, stats);
+    return scan_input(&scanner, &input, false, stats);
+}
+
+bool match_block_lines(const Regex* regex, MatchScratch* scratch, char* block, size_t cap, size_t len, bool at_eof,
+                       int fd, const char* name, FILE* out, bool label_lines, const SearchOptions* opts)
+{
+    FileStats file_stats;
+    FileStats* stats = start_file_stats(&file_stats, name, opts);
+    Input input;
+    open_plain_input(&input, fd);
+    scratch->num_fallbacks = 0;
+    LineScanner scanner;
+    init_line_scanner(&scanner, regex, scratch, out, label_lines ? name : NULL, opts, stats);
+    scanner.buf = block;
+    scanner.cap = cap;
+    scan_lines(&scanner, len, at_eof);
+    return scan_input(&scanner, &input, at_eof, stats);
+}
+
+bool search_inputs(const Regex* regex, MatchScratch* scratch, char** paths, FILE* in, FILE* out, FILE* err,
+                   const SearchOptions* opts)
+{
+    if (opts->index_path) {
+        if (*paths) {
+            fprintf(err, "ERROR: Input files can not be given along with --use-index\n");
+            return false;
+        }
+        return search_indexed(regex, scratch, out, err, opts);
+    }
+    if (opts->follow) {
+        return follow_files(regex, paths, out, err, opts);
+    }
+    bool ok = true;
+    if (!*paths && !match_lines_with(regex, scratch, in, "standard input", out, false, opts)) {
+        ok = false;
+    }
+    for (; *paths; ++paths) {
+        if (strcmp(*paths, "-") == 0) {
+            if (!match_lines_with(regex, scratch, in, "standard input", out, false, opts)) {
+                ok = false;
+            }
+            continue;
+        }
+        struct stat st;
+        if (stat(*paths, &st) == 0 && S_ISDIR(st.st_mode)) {
+            if (!opts->recursive) {
+                fprintf(err, "ERROR: `%s` is a directory (use -r to search it), skipping...\n", *paths);
+                ok = false;
+            } else if (!search_tree(regex, *paths, out, opts)) {
+                ok = false;
+            }
+            continue;
+        }
+        FILE* file = fopen(*paths, "r");
+        if (!file) {
+            fprintf(err, "ERROR: Can not open input file `%s` to read, skipping...\n", *paths);
+            ok = false;
+            continue;
+        }
+        if (!match_lines_with(regex, scratch, file, *paths, out, false, opts)) {
+            ok = false;
+        }
+        fclose(file);
+    }
+    return ok;
+}
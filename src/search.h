@@ -0,0 +1,150 @@
+#ifndef __search_h__
+#define __search_h__
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "regex.h"
+#include "report.h"
+
+// Everything the command line can tell us about how to search and what to print
+typedef struct {
+    // only print the matched segment
+    bool trim_to_match;
+    // print out all of the captured groups
+    bool print_captures;
+    // print every match in the line, each on its own line (instead of anything else)
+    bool all_matches;
+    // descend into directories given on the command line
+    bool recursive;
+    // when non-empty, only files whose name matches one of these globs are searched
+    const char** includes;
+    size_t num_includes;
+    // files and directories whose name matches one of these globs are skipped
+    const char** excludes;
+    size_t num_excludes;
+    // how many threads walk directories when `recursive` is set
+    size_t num_threads;
+    // how many steps the path search for captures may take on a line before the linear-time engine takes over
+    // (0 for no limit)
+    size_t step_budget;
+    // if set, the statistics of every input searched are added to it
+    Report* report;
+    // if set, every thread that searches adds to it how many lines went over the step budget
+    // and were matched by the linear-time engine, when it is done with its input
+    size_t* fallback_lines;
+    // if set, the files in this trigram index that could match are searched, instead of any inputs given
+    const char* index_path;
+    // keep watching the input files after reaching their end, matching lines as they are appended
+    bool follow;
+    // prefix every printed line with its line number, and with the byte offset of what is printed
+    bool line_numbers;
+    bool byte_offsets;
+} SearchOptions;
+
+// Initialize the options to the defaults: print every matching line of every file we are given
+void init_search_options(SearchOptions* opts);
+
+// Parse the options at the front of `argv` (the arguments after the regex) into `opts`,
+// setting COMPILE_ flags in `*compile_flags` (COMPILE_NO_CAPTURES unless captures are printed)
+// and `*want_report` if a report was asked for.
+// Unrecognized options are ignored.
+// Returns the arguments after the options, or NULL (with a message printed to `err`) if an option is invalid
+char** parse_search_options(char** argv, SearchOptions* opts, int* compile_flags, bool* want_report, FILE* err);
+
+// Free the memory alloc'd by the include and exclude lists
+void destroy_search_options(const SearchOptions* opts);
+
+// Use the compiled regex object to read lines from the open file `in`, printing matches to `out`
+// Compressed input is recognized and decompressed on the fly.
+// name - what to call `in` in error messages
+// label_lines - if set, every printed line is prefixed by `name:`
+// Returns false if the input could not be read to the end
+bool match_lines(const Regex* regex, FILE* in, const char* name, FILE* out, bool label_lines,
+                 const SearchOptions* opts);
+
+// The same, but matching with `scratch`, which keeps what it learns about the regex (its DFA) for the next input
+bool match_lines_with(const Regex* regex, MatchScratch* scratch, FILE* in, const char* name, FILE* out,
+                      bool label_lines, const SearchOptions* opts);
+
+// The same, for a file whose first `len` bytes have been read ahead into `block` (dynamically allocated,
+// `cap` bytes, which the matcher takes over), and whose rest is read from `fd`, unless `at_eof` is set.
+// The file must not be compressed
+bool match_block_lines(const Regex* regex, MatchScratch* scratch, char* block, size_t cap, size_t len, bool at_eof,
+                       int fd, const char* name, FILE* out, bool label_lines, const SearchOptions* opts);
+
+// Matches lines as the input arrives, in whatever pieces it comes in.
+// Input is read a block at a time, and each line is fed to the DFA straight out of the block.
+// A line that runs off the end of the block has already been fed as far as it goes,
+// so when the next block arrives we only move it to the front of the buffer (to keep it in one piece)
+// and resume the DFA where it left off.
+typedef struct {
+    const Regex* regex;
+    MatchScratch* scratch;
+    FILE* out;
+    // what to prefix printed lines with (or NULL for nothing)
+    const char* label;
+    const SearchOptions* opts;
+    // dynamically allocated buffer (NULL until input is first read): buf[0 .. filled) holds input,
+    // buf[line_beg .. fed) is the current line fed so far
+    char* buf;
+    size_t cap;
+    size_t filled;
+    size_t line_beg;
+    size_t fed;
+    // whether lines are matched backwards once they are whole, rather than fed to the DFA as they come
+    bool from_end;
+    // whether lines are matched by the bit-parallel automaton once they are whole (see `prefers_match_bits`)
+    bool bits;
+    // whether whole lines are taken DFA_STREAMS at a time and stepped through the DFA together (see `match_dfa_lines`),
+    // rather than one after the other (not when lines are timed, as each line is timed on its own)
+    bool interleave;
+    // whether lines that do not contain the regex's literal are skipped over without being matched
+    // (not when lines are timed, as each line is counted)
+    bool skip;
+    // how many more lines to match before looking for the literal again, and how many we waited last time
+    size_t skip_wait;
+    size_t skip_backoff;
+    // where in the input buf[0] is, and how many lines of the input end before buf[counted].
+    // Newlines are only counted when a line number is printed (from `counted` on), or the buffer is emptied
+    uint64_t buf_offset;
+    size_t counted;
+    uint64_t lines_before;
+    // if set, every line is timed: `mark` is when the time spent on the current line so far was last added up
+    FileStats* stats;
+    uint64_t mark;
+    uint64_t line_ns;
+} LineScanner;
+
+// Start matching lines with `scratch`, printing matches to `out` as `opts` says (prefixed by `label:`, if it is set)
+void init_line_scanner(LineScanner* scanner, const Regex* regex, MatchScratch* scratch, FILE* out, const char* label,
+                       const SearchOptions* opts, FileStats* stats);
+
+void destroy_line_scanner(const LineScanner* scanner);
+
+// The input starts over (with a new file under the same name), so count lines and offsets from its start again.
+// Everything read so far must have been scanned, up to the end of input
+void restart_line_scanner(LineScanner* scanner);
+
+// Returns where the next bytes of input go, setting `*room` to how many fit (at least one),
+// or NULL (with a message printed) if the current line is too long to make room for
+char* scanner_space(LineScanner* scanner, size_t* room);
+
+// Match every line finished by the `got` bytes just put where `scanner_space` said.
+// At the end of input (`at_eof`), whatever is left is a line too, even without a newline at the end
+void scan_lines(LineScanner* scanner, size_t got, bool at_eof);
+
+// Search every input named in the null-terminated array `paths`, the way the command line does:
+// `-` (or no paths at all) is `in`, directories are walked with `opts->recursive`, and anything else is opened as a file.
+// Matches are printed to `out`, and inputs that can not be opened are reported to `err`
+// Returns false if any input could not be searched
+bool search_inputs(const Regex* regex, MatchScratch* scratch, char** paths, FILE* in, FILE* out, FILE* err,
+                   const SearchOptions* opts);
+
+// Returns true if the file name (without directories) passes the include and exclude globs
+bool want_file(const SearchOptions* opts, const char* name);
+
+// Returns true if the directory name (without parents) passes the exclude globs
+bool want_dir(const SearchOptions* opts, const char* name);
+
+#endif
@@ -0,0 +1,634 @@
+// for unshare()
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "server.h"
+#include "regex.h"
+#include "report.h"
+#include "search.h"
+#include "util.h"
+
+//
+// This file contains the server behind `--serve`, and the client that talks to it.
+//
+// A client sends one request per connection: the length of its arguments, along with its working directory,
+// standard input, output and error (as file descriptors, over the socket itself), and then the arguments,
+// each ending with a null byte. The server searches on a thread of its own, reading and writing the client's
+// files directly, and answers with the exit status once it is done.
+//
+// Compiled regexes are kept in a small cache, keyed by their pattern and compile flags.
+// Each one also keeps the MatchScratch of every search that used it, so that the DFA built up for one
+// search is already there for the next.
+//
+// Only the user running the server may connect to it: the socket is created readable and writable by them alone,
+// and a connection from anyone else is closed straight away.
+// Running out of memory while compiling a client's regex fails that search, rather than the whole server.
+//
+
+// the file descriptors a client hands over, in order
+#define CLIENT_CWD 0
+#define CLIENT_STDIN 1
+#define CLIENT_STDOUT 2
+#define CLIENT_STDERR 3
+#define NUM_CLIENT_FDS 4
+
+// the most argument bytes a request may have
+#define MAX_REQUEST_LEN (16 * 1024 * 1024)
+
+typedef struct {
+    // dynamically allocated copy of the pattern the regex was compiled from
+    char* pattern;
+    int flags;
+    Regex regex;
+    // dynamically allocated stack of scratches no search is using right now
+    MatchScratch** idle;
+    size_t num_idle;
+    size_t cap_idle;
+    // how many searches are using the regex right now (it is not thrown away until there are none)
+    size_t num_users;
+    // the value of the cache's clock the last time a search was done with it
+    uint64_t last_used;
+} CachedRegex;
+
+typedef struct {
+    // guards every field below, and every field of every entry except the regex itself (which never changes)
+    pthread_mutex_t lock;
+    // dynamically allocated array of entries, in no particular order
+    CachedRegex** entries;
+    size_t num_entries;
+    size_t cap_entries;
+    // how many entries to keep when none are in use
+    size_t cache_size;
+    // goes up by one every time a search is done
+    uint64_t clock;
+} RegexCache;
+
+typedef struct {
+    RegexCache* cache;
+    int conn;
+    size_t num_threads;
+} Connection;
+
+void destroy_cached_regex(CachedRegex* entry) {
+    for (size_t i = 0; i < entry->num_idle; ++i) {
+        destroy_match_scratch(entry->idle[i]);
+        free(entry->idle[i]);
+    }
+    free(entry->idle);
+    destroy_regex(&entry->regex);
+    free(entry->pattern);
+    free(entry);
+}
+
+// Throw away the entries used longest ago, until there are no more than the cache size (or all the rest are in use)
+// The cache must be locked
+void evict_regexes(RegexCache* cache) {
+    while (cache->num_entries > cache->cache_size) {
+        size_t oldest = cache->num_entries;
+        for (size_t i = 0; i < cache->num_entries; ++i) {
+            CachedRegex* entry = cache->entries[i];
+            if (entry->num_users == 0
+                && (oldest == cache->num_entries || entry->last_used < cache->entries[oldest]->last_used))
+            {
+                oldest = i;
+            }
+        }
+        if (oldest == cache->num_entries) {
+            return;
+        }
+        destroy_cached_regex(cache->entries[oldest]);
+        cache->entries[oldest] = cache->entries[cache->num_entries - 1];
+        cache->num_entries -= 1;
+    }
+}
+
+// Returns the cached regex for `pattern`, compiling it if it is not cached yet,
+// or NULL (with a message printed to this thread's error output) if it does not compile, or there is no memory for it.
+// The caller must give it back with `release_regex` when done
+CachedRegex* acquire_regex(RegexCache* cache, const char* pattern, int flags) {
+    pthread_mutex_lock(&cache->lock);
+    for (size_t i = 0; i < cache->num_entries; ++i) {
+        CachedRegex* entry = cache->entries[i];
+        if (entry->flags == flags && strcmp(entry->pattern, pattern) == 0) {
+            entry->num_users += 1;
+            pthread_mutex_unlock(&cache->lock);
+            return entry;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    // compile without holding the lock, so that other searches are not held up
+    CachedRegex* entry = calloc(1, sizeof(CachedRegex));
+    if (!entry) {
+        fprintf(error_output(), "ERROR: out of memory\n");
+        return NULL;
+    }
+    // every node is recorded in the regex as soon as it is made, so one that is given up on part way
+    // (whether it does not parse, or runs out of memory) can still be destroyed
+    jmp_buf env;
+    if (setjmp(env) != 0) {
+        catch_out_of_memory(NULL);
+        destroy_regex(&entry->regex);
+        free(entry);
+        return NULL;
+    }
+    catch_out_of_memory(&env);
+    bool compiled = compile_with(&entry->regex, pattern, flags);
+    catch_out_of_memory(NULL);
+    if (!compiled) {
+        destroy_regex(&entry->regex);
+        free(entry);
+        return NULL;
+    }
+    entry->pattern = strdup(pattern);
+    if (!entry->pattern) {
+        fprintf(error_output(), "ERROR: out of memory\n");
+        destroy_cached_regex(entry);
+        return NULL;
+    }
+    entry->flags = flags;
+    entry->num_users = 1;
+
+    pthread_mutex_lock(&cache->lock);
+    if (cache->num_entries >= cache->cap_entries) {
+        size_t new_cap = 2 * cache->cap_entries;
+        if (new_cap == 0) {
+            new_cap = 16;
+        }
+        CachedRegex** new_entries = realloc(cache->entries, sizeof(CachedRegex*) * new_cap);
+        if (!new_entries) {
+            pthread_mutex_unlock(&cache->lock);
+            fprintf(error_output(), "ERROR: out of memory\n");
+            destroy_cached_regex(entry);
+            return NULL;
+        }
+        cache->entries = new_entries;
+        cache->cap_entries = new_cap;
+    }
+    // (if another search compiled the same pattern in the meantime, both stay until one is evicted)
+    cache->entries[cache->num_entries] = entry;
+    cache->num_entries += 1;
+    pthread_mutex_unlock(&cache->lock);
+    return entry;
+}
+
+// Returns a scratch for `entry`, reusing one an earlier search left behind if there is one,
+// or NULL (with a message printed to this thread's error output) if there is no memory for a new one
+MatchScratch* acquire_scratch(RegexCache* cache, CachedRegex* entry) {
+    MatchScratch* scratch = NULL;
+    pthread_mutex_lock(&cache->lock);
+    if (entry->num_idle > 0) {
+        entry->num_idle -= 1;
+        scratch = entry->idle[entry->num_idle];
+    }
+    pthread_mutex_unlock(&cache->lock);
+    if (scratch) {
+        return scratch;
+    }
+    scratch = calloc(1, sizeof(MatchScratch));
+    if (!scratch) {
+        fprintf(error_output(), "ERROR: out of memory\n");
+        return NULL;
+    }
+    jmp_buf env;
+    if (setjmp(env) != 0) {
+        // (whatever the scratch had allocated so far is lost)
+        catch_out_of_memory(NULL);
+        free(scratch);
+        return NULL;
+    }
+    catch_out_of_memory(&env);
+    init_match_scratch(scratch, &entry->regex);
+    catch_out_of_memory(NULL);
+    return scratch;
+}
+
+// Give back `entry` along with the scratch used with it (if there was one)
+void release_regex(RegexCache* cache, CachedRegex* entry, MatchScratch* scratch) {
+    pthread_mutex_lock(&cache->lock);
+    if (scratch && entry->num_idle >= entry->cap_idle) {
+        size_t new_cap = 2 * entry->cap_idle;
+        if (new_cap == 0) {
+            new_cap = 4;
+        }
+        MatchScratch** new_idle = realloc(entry->idle, sizeof(MatchScratch*) * new_cap);
+        if (new_idle) {
+            entry->idle = new_idle;
+            entry->cap_idle = new_cap;
+        }
+    }
+    if (scratch && entry->num_idle < entry->cap_idle) {
+        entry->idle[entry->num_idle] = scratch;
+        entry->num_idle += 1;
+    } else if (scratch) {
+        // no room to keep it for the next search
+        destroy_match_scratch(scratch);
+        free(scratch);
+    }
+    entry->num_users -= 1;
+    cache->clock += 1;
+    entry->last_used = cache->clock;
+    evict_regexes(cache);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Read exactly `len` bytes from `fd`, returning false if it ends first
+bool read_all(int fd, void* buf, size_t len) {
+    char* pos = buf;
+    while (len > 0) {
+        ssize_t got = read(fd, pos, len);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        pos += got;
+        len -= got;
+    }
+    return true;
+}
+
+bool write_all(int fd, const void* buf, size_t len) {
+    const char* pos = buf;
+    while (len > 0) {
+        ssize_t put = write(fd, pos, len);
+        if (put < 0 && errno == EINTR) {
+            continue;
+        }
+        if (put <= 0) {
+            return false;
+        }
+        pos += put;
+        len -= put;
+    }
+    return true;
+}
+
+// Receive the header of a request: the length of the arguments, and the client's file descriptors
+// Returns false if the client did not send a whole header
+bool recv_header(int conn, uint32_t* len, int* fds) {
+    char control[CMSG_SPACE(NUM_CLIENT_FDS * sizeof(int))];
+    struct iovec iov = { len, sizeof(uint32_t) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t got;
+    do {
+        got = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    } while (got < 0 && errno == EINTR);
+
+    bool ok = false;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        size_t num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), num_fds * sizeof(int));
+        if (num_fds == NUM_CLIENT_FDS) {
+            ok = true;
+        } else {
+            for (size_t i = 0; i < num_fds; ++i) {
+                close(fds[i]);
+            }
+        }
+    }
+    if (got != sizeof(uint32_t)) {
+        if (ok) {
+            for (size_t i = 0; i < NUM_CLIENT_FDS; ++i) {
+                close(fds[i]);
+            }
+        }
+        return false;
+    }
+    return ok;
+}
+
+// Run the search with arguments `args` for a client, writing to its `out` and `err`
+// (as are any messages, such as why its regex does not compile)
+// Returns its exit status
+int serve_search(RegexCache* cache, char** args, FILE* in, FILE* out, FILE* err, size_t num_threads) {
+    if (!*args) {
+        fprintf(err, "ERROR: Invalid arguments\n");
+        return EXIT_FAILURE;
+    }
+    uint64_t start_ns = now_ns();
+    const char* pattern = *args;
+    SearchOptions opts;
+    init_search_options(&opts);
+    opts.num_threads = num_threads;
+    // counted for this search alone, as the command line would
+    size_t num_fallbacks = 0;
+    opts.fallback_lines = &num_fallbacks;
+    int compile_flags = 0;
+    bool want_report = false;
+    char** paths = parse_search_options(args + 1, &opts, &compile_flags, &want_report, err);
+    if (!paths) {
+        destroy_search_options(&opts);
+        return EXIT_FAILURE;
+    }
+    Report report;
+    if (want_report) {
+        init_report(&report, start_ns);
+        opts.report = &report;
+    }
+
+    // (a cached regex counts as taking no time to compile, which is the point)
+    uint64_t compile_start_ns = now_ns();
+    set_error_output(err);
+    CachedRegex* entry = acquire_regex(cache, pattern, compile_flags);
+    if (!entry) {
+        fprintf(err, "ERROR: Can not compile the regex `%s`\n", pattern);
+    }
+    MatchScratch* scratch = entry ? acquire_scratch(cache, entry) : NULL;
+    set_error_output(NULL);
+    if (!scratch) {
+        if (entry) {
+            release_regex(cache, entry, NULL);
+        }
+        if (opts.report) {
+            destroy_report(opts.report);
+        }
+        destroy_search_options(&opts);
+        return EXIT_FAILURE;
+    }
+    if (opts.report) {
+        opts.report->compile_ns = now_ns() - compile_start_ns;
+    }
+    // running out of memory part way through fails this search alone. What it had open or allocated is lost,
+    // and the scratch may have been left half way through an update, so it is not kept for the next search
+    volatile bool ok = false;
+    jmp_buf env;
+    set_error_output(err);
+    catch_out_of_memory(&env);
+    if (setjmp(env) == 0) {
+        ok = search_inputs(&entry->regex, scratch, paths, in, out, err, &opts);
+    } else {
+        destroy_match_scratch(scratch);
+        free(scratch);
+        scratch = NULL;
+    }
+    catch_out_of_memory(NULL);
+    set_error_output(NULL);
+    release_regex(cache, entry, scratch);
+
+    fflush(out);
+    if (num_fallbacks > 0) {
+        fprintf(err, "NOTE: %ld line(s) went over the step budget, and their captures were found by the linear-time engine\n",
+                num_fallbacks);
+    }
+    if (opts.report) {
+        write_report_json(opts.report, err);
+        destroy_report(opts.report);
+    }
+    destroy_search_options(&opts);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void* serve_connection(void* arg) {
+    Connection* c = arg;
+    int fds[NUM_CLIENT_FDS];
+    uint32_t len;
+    if (!recv_header(c->conn, &len, fds)) {
+        close(c->conn);
+        free(c);
+        return NULL;
+    }
+    char* request = NULL;
+    char** args = NULL;
+    int32_t status = EXIT_FAILURE;
+    // the arguments must each end with a null byte
+    if (len > MAX_REQUEST_LEN) {
+        goto done;
+    }
+    request = malloc(len + 1);
+    if (!request || !read_all(c->conn, request, len) || (len > 0 && request[len - 1] != '\0')) {
+        goto done;
+    }
+    size_t num_args = 0;
+    for (size_t i = 0; i < len; ++i) {
+        num_args += request[i] == '\0';
+    }
+    args = calloc(num_args + 1, sizeof(char*));
+    if (!args) {
+        goto done;
+    }
+    for (size_t i = 0, pos = 0; i < num_args; ++i) {
+        args[i] = request + pos;
+        pos += strlen(request + pos) + 1;
+    }
+
+    // give this thread (and any it starts) a working directory of its own, so relative paths mean what the client meant
+    if (unshare(CLONE_FS) != 0 || fchdir(fds[CLIENT_CWD]) != 0) {
+        goto done;
+    }
+    FILE* in = fdopen(dup(fds[CLIENT_STDIN]), "r");
+    FILE* out = fdopen(dup(fds[CLIENT_STDOUT]), "w");
+    FILE* err = fdopen(dup(fds[CLIENT_STDERR]), "w");
+    if (in && out && err) {
+        setvbuf(err, NULL, _IONBF, 0);
+        status = serve_search(c->cache, args, in, out, err, c->num_threads);
+    }
+    if (in) {
+        fclose(in);
+    }
+    if (out) {
+        fclose(out);
+    }
+    if (err) {
+        fclose(err);
+    }
+
+done:
+    write_all(c->conn, &status, sizeof(status));
+    for (size_t i = 0; i < NUM_CLIENT_FDS; ++i) {
+        close(fds[i]);
+    }
+    free(args);
+    free(request);
+    close(c->conn);
+    free(c);
+    return NULL;
+}
+
+// Fill in the address of the socket at `path`, returning false if the path is too long
+bool socket_address(struct sockaddr_un* addr, const char* path) {
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "ERROR: the socket path `%s` is too long\n", path);
+        return false;
+    }
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+// Returns true if the client at the other end of `conn` is the user running the server
+bool same_user(int conn) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+        fprintf(stderr, "ERROR: Can not tell who a connection is from: %s\n", strerror(errno));
+        return false;
+    }
+    if (cred.uid != getuid()) {
+        fprintf(stderr, "ERROR: Refused a connection from user %d\n", (int)cred.uid);
+        return false;
+    }
+    return true;
+}
+
+bool serve(const char* path, size_t cache_size) {
+    struct sockaddr_un addr;
+    if (!socket_address(&addr, path)) {
+        return false;
+    }
+    // a socket left behind by a server that is gone would keep us from binding
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    // whoever can write to the socket can search (and read) anything we can, so it is ours alone from the start
+    mode_t old_mask = umask(0177);
+    bool bound = sock >= 0 && bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+    umask(old_mask);
+    if (!bound || listen(sock, SOMAXCONN) != 0) {
+        fprintf(stderr, "ERROR: Can not listen on `%s`: %s\n", path, strerror(errno));
+        if (sock >= 0) {
+            close(sock);
+        }
+        return false;
+    }
+    // a client that goes away mid-search should only end that search
+    signal(SIGPIPE, SIG_IGN);
+
+    RegexCache cache;
+    pthread_mutex_init(&cache.lock, NULL);
+    cache.entries = NULL;
+    cache.num_entries = 0;
+    cache.cap_entries = 0;
+    cache.cache_size = cache_size;
+    cache.clock = 0;
+
+    size_t num_threads = 1;
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_cpus > 0) {
+        num_threads = num_cpus;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (;;) {
+        int conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno != EINTR) {
+                fprintf(stderr, "ERROR: Can not accept a connection: %s\n", strerror(errno));
+            }
+            continue;
+        }
+        if (!same_user(conn)) {
+            close(conn);
+            continue;
+        }
+        Connection* c = malloc(sizeof(Connection));
+        if (!c) {
+            fprintf(stderr, "ERROR: out of memory for a connection\n");
+            close(conn);
+            continue;
+        }
+        c->cache = &cache;
+        c->conn = conn;
+        c->num_threads = num_threads;
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, serve_connection, c) != 0) {
+            fprintf(stderr, "ERROR: Can not start a thread for a connection\n");
+            close(conn);
+            free(c);
+        }
+    }
+}
+
+int run_client(const char* path, char** args) {
+    struct sockaddr_un addr;
+    if (!socket_address(&addr, path)) {
+        return EXIT_FAILURE;
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "ERROR: Can not connect to the server at `%s`: %s\n", path, strerror(errno));
+        if (sock >= 0) {
+            close(sock);
+        }
+        return EXIT_FAILURE;
+    }
+    int cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cwd < 0) {
+        fprintf(stderr, "ERROR: Can not open the working directory\n");
+        close(sock);
+        return EXIT_FAILURE;
+    }
+
+    size_t len = 0;
+    for (char** arg = args; *arg; ++arg) {
+        len += strlen(*arg) + 1;
+    }
+    char* request = alloc_or_die(len > 0 ? len : 1, 1);
+    size_t pos = 0;
+    for (char** arg = args; *arg; ++arg) {
+        size_t arg_len = strlen(*arg) + 1;
+        memcpy(request + pos, *arg, arg_len);
+        pos += arg_len;
+    }
+
+    uint32_t header = len;
+    int fds[NUM_CLIENT_FDS];
+    fds[CLIENT_CWD] = cwd;
+    fds[CLIENT_STDIN] = STDIN_FILENO;
+    fds[CLIENT_STDOUT] = STDOUT_FILENO;
+    fds[CLIENT_STDERR] = STDERR_FILENO;
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = { &header, sizeof(header) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    // a server that refuses us hangs up, which should be reported rather than kill us
+    signal(SIGPIPE, SIG_IGN);
+    int32_t status = EXIT_FAILURE;
+    if (sendmsg(sock, &msg, 0) != sizeof(header) || !write_all(sock, request, len)) {
+        fprintf(stderr, "ERROR: Can not send the search to the server at `%s`\n", path);
+    } else if (!read_all(sock, &status, sizeof(status))) {
+        fprintf(stderr, "ERROR: The server at `%s` hung up before the search was done\n", path);
+        status = EXIT_FAILURE;
+    }
+    free(request);
+    close(cwd);
+    close(sock);
+    return status;
+}
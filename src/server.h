@@ -0,0 +1,23 @@
+#ifndef __server_h__
+#define __server_h__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// how many compiled regexes the server keeps by default
+#define DEFAULT_CACHE_SIZE 64
+
+// Listen on the Unix domain socket at `path`, searching for every client that connects.
+// Up to `cache_size` compiled regexes (each with the DFAs it has built so far) are kept between searches,
+// and the one used longest ago is the first to go.
+// Only returns (with a message printed to stderr) if the socket can not be set up
+bool serve(const char* path, size_t cache_size);
+
+// Have the server listening at `path` run the search described by `args`:
+// the regex, options and inputs, exactly as they would be given on the command line.
+// The server reads our standard input and writes to our standard output and error itself,
+// and relative paths are taken from our working directory.
+// Returns the exit status of the search
+int run_client(const char* path, char** args);
+
+#endif
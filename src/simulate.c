@@ -0,0 +1,367 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "regex.h"
+#include "pattern.h"
+#include "util.h"
+
+//
+// This file simulates the NFA one byte at a time, tracking every node we could be in at once.
+// Unlike the path search in match.c, this never backtracks, so all of its state
+// is the set of current nodes, and the input can be fed to it in as many pieces as we like.
+//
+
+// The edges we follow out of `node`: the forward ones, or when scanning backwards, the reversed ones
+const Edge* edges_of(const Node* node, bool reverse, size_t* num_edges) {
+    if (reverse) {
+        *num_edges = node->num_rev_edges;
+        return node->rev_edges;
+    }
+    *num_edges = node->num_edges;
+    return node->edges;
+}
+
+// Add `node`, and every node reachable from it by empty edges (in the given direction), to the `next` set
+void add_closure_dir(MatchState* state, const Node* node, bool reverse) {
+    if (state->marks[node->id] == state->generation) {
+        return; // already in the set
+    }
+    // explicit stack, so long chains of empty edges can not overflow the call stack
+    size_t num_stack = 0;
+    state->stack[num_stack++] = node;
+    state->marks[node->id] = state->generation;
+    while (num_stack > 0) {
+        const Node* n = state->stack[--num_stack];
+        if (n->dead) {
+            continue; // it would only take up room in the set
+        }
+        state->next_sure |= n->sure;
+        state->next[state->num_next++] = n;
+        if (!reverse) {
+            for (size_t i = 0; i < n->num_empty_edges; ++i) {
+                const Node* target = n->empty_edges[i]->target;
+                if (state->marks[target->id] != state->generation) {
+                    state->marks[target->id] = state->generation;
+                    state->stack[num_stack++] = target;
+                }
+            }
+            continue;
+        }
+        for (size_t i = 0; i < n->num_rev_edges; ++i) {
+            const Edge* e = &n->rev_edges[i];
+            if (pat_size(&e->pat) == 0 && state->marks[e->target->id] != state->generation) {
+                state->marks[e->target->id] = state->generation;
+                state->stack[num_stack++] = e->target;
+            }
+        }
+    }
+}
+
+void add_closure(MatchState* state, const Node* node) {
+    add_closure_dir(state, node, false);
+}
+
+// Make the `next` set the current one, and empty out the new `next` set
+void swap_sets(MatchState* state) {
+    const Node** tmp = state->curr;
+    state->curr = state->next;
+    state->num_curr = state->num_next;
+    state->next = tmp;
+    state->num_next = 0;
+    state->curr_sure = state->next_sure;
+    state->next_sure = false;
+    // bumping the generation forgets every mark at once
+    state->generation += 1;
+}
+
+// Empty out both sets
+void clear_sets(MatchState* state) {
+    state->num_curr = 0;
+    state->num_next = 0;
+    state->curr_sure = false;
+    state->next_sure = false;
+    state->generation += 1;
+}
+
+void init_match_state(MatchState* state, const Regex* regex) {
+    state->curr   = alloc_or_die(regex->num_nodes, sizeof(Node*));
+    state->next   = alloc_or_die(regex->num_nodes, sizeof(Node*));
+    state->stack  = alloc_or_die(regex->num_nodes, sizeof(Node*));
+    // every consuming edge can be a thread of `find_span` at once
+    size_t num_edges = 0;
+    for (size_t i = 0; i < regex->num_nodes; ++i) {
+        num_edges += regex->nodes[i]->num_edges;
+    }
+    state->curr_edges = alloc_or_die(num_edges, sizeof(Edge*));
+    state->next_edges = alloc_or_die(num_edges, sizeof(Edge*));
+    state->stack_next = alloc_or_die(regex->num_nodes, sizeof(size_t));
+    state->marks  = alloc_or_die(regex->num_nodes, sizeof(size_t));
+    state->generation = 1;
+    reset_match_state(state, regex);
+}
+
+void reset_match_state(MatchState* state, const Regex* regex) {
+    clear_sets(state);
+    add_closure(state, regex->initial);
+    swap_sets(state);
+}
+
+void feed_match_state(MatchState* state, const char* buf, size_t len) {
+    for (size_t pos = 0; pos < len && !match_state_settled(state); ++pos) {
+        char ch = buf[pos];
+        if ((unsigned char)ch < 0x80) {
+            for (size_t i = 0; i < state->num_curr; ++i) {
+                const Node* n = state->curr[i];
+                for (size_t j = 0; j < n->num_ascii_edges; ++j) {
+                    const Edge* e = n->ascii_edges[j];
+                    if (pattern_matches(&e->pat, ch)) {
+                        add_closure(state, e->target);
+                    }
+                }
+            }
+            swap_sets(state);
+            continue;
+        }
+        for (size_t i = 0; i < state->num_curr; ++i) {
+            const Node* n = state->curr[i];
+            for (size_t j = 0; j < n->num_edges; ++j) {
+                const Edge* e = &n->edges[j];
+                if (pat_size(&e->pat) > 0 && pattern_matches(&e->pat, ch)) {
+                    add_closure(state, e->target);
+                }
+            }
+        }
+        swap_sets(state);
+    }
+}
+
+bool match_state_settled(const MatchState* state) {
+    return state->curr_sure || state->num_curr == 0;
+}
+
+bool match_state_accepts(const MatchState* state) {
+    if (state->curr_sure) {
+        return true;
+    }
+    for (size_t i = 0; i < state->num_curr; ++i) {
+        if (state->curr[i]->accepts) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void destroy_match_state(const MatchState* state) {
+    free(state->curr);
+    free(state->next);
+    free(state->stack);
+    free(state->curr_edges);
+    free(state->next_edges);
+    free(state->stack_next);
+    free(state->marks);
+}
+
+
+
+
+
+
+// =================================================================================
+//   Finding where a match begins and ends, without recording how we got there
+//
+// A forward scan finds where the match the path search would find ends, then the reversed edges are scanned
+// backwards from there to find where it begins.
+// These only walk the pattern proper: the loops consuming the input around a match are left out.
+// =================================================================================
+
+// Returns true if `e` consumes the input around a match, rather than being part of the match
+bool outside_match(const Regex* regex, const Edge* e) {
+    return e->target == regex->trap
+        || e->target == regex->tail
+        || (e->target == regex->initial && regex->initial != regex->start);
+}
+
+// Returns true if `node` is in the current set
+bool in_curr(const MatchState* state, const Node* node) {
+    for (size_t i = 0; i < state->num_curr; ++i) {
+        if (state->curr[i] == node) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Add everywhere the current set can go by consuming `ch` (in the given direction) to the `next` set
+void advance_sets(const Regex* regex, MatchState* state, char ch, bool reverse) {
+    for (size_t i = 0; i < state->num_curr; ++i) {
+        size_t num_edges;
+        const Edge* edges = edges_of(state->curr[i], reverse, &num_edges);
+        for (size_t j = 0; j < num_edges; ++j) {
+            const Edge* e = &edges[j];
+            if (pat_size(&e->pat) > 0 && !outside_match(regex, e) && pattern_matches(&e->pat, ch)) {
+                add_closure_dir(state, e->target, reverse);
+            }
+        }
+    }
+}
+
+bool prefers_match_from_end(const Regex* regex) {
+    return regex->anchored_end && !regex->anchored_beg;
+}
+
+bool match_from_end(const Regex* regex, MatchState* state, const char* buf, size_t len) {
+    clear_sets(state);
+    add_closure_dir(state, regex->final, true);
+    swap_sets(state);
+    for (size_t pos = len; ; --pos) {
+        if (in_curr(state, regex->start)) {
+            return true; // a match begins here, and runs to the end
+        }
+        if (pos == 0 || state->num_curr == 0) {
+            return false;
+        }
+        advance_sets(regex, state, buf[pos - 1], true);
+        swap_sets(state);
+    }
+}
+
+// Enter `node` at `pos`, and every node reachable from it by empty edges, in the order the path search would,
+// adding their consuming edges to the `next` threads in that order.
+// Returns true if that order reaches the end of a match (at `pos`) before anything else,
+// in which case the rest is left out: the path search would never get to it.
+// If not `can_end`, the ends of matches reached are passed over (as when they would be empty)
+bool enter_ordered(const Regex* regex, MatchState* state, const Node* node, size_t pos, size_t len,
+                   bool can_end)
+{
+    if (state->marks[node->id] == state->generation) {
+        return false; // something the path search tries first already went this way
+    }
+    // explicit stack of the nodes entered, and which of its edges each is up to
+    size_t num_stack = 0;
+    state->marks[node->id] = state->generation;
+    state->stack[num_stack] = node;
+    state->stack_next[num_stack++] = 0;
+    if (can_end && node->accepts && pos == len) {
+        return true;
+    }
+    while (num_stack > 0) {
+        const Node* n = state->stack[num_stack - 1];
+        size_t i = state->stack_next[num_stack - 1]++;
+        if (i == n->num_edges || n->dead) {
+            --num_stack;
+            continue;
+        }
+        const Edge* e = &n->edges[i];
+        if (can_end && e->target == regex->tail && pos < len) {
+            return true; // the rest of the line is consumed after the match
+        }
+        if (outside_match(regex, e)) {
+            continue;
+        }
+        if (pat_size(&e->pat) > 0) {
+            state->next_edges[state->num_next_edges++] = e;
+            continue;
+        }
+        if (state->marks[e->target->id] != state->generation) {
+            state->marks[e->target->id] = state->generation;
+            if (can_end && e->target->accepts && pos == len) {
+                return true;
+            }
+            state->stack[num_stack] = e->target;
+            state->stack_next[num_stack++] = 0;
+        }
+    }
+    return false;
+}
+
+// Scan forward from `from`, beginning a match at every position until one is found, with the threads
+// kept in the order the path search would try them (as pike.c does, without the captures).
+// Once a thread reaches the end of a match, those after it are dropped, and only those before it go on.
+// Returns true if there is a match, setting `*end` to where the one the path search would find ends
+bool find_end(const Regex* regex, MatchState* state, const char* buf, size_t len, size_t from,
+              bool allow_empty, size_t* end)
+{
+    state->num_next_edges = 0;
+    state->generation += 1;
+    bool found = false;
+    for (size_t pos = from; ; ++pos) {
+        // a match beginning here comes after every one that began earlier
+        if (!found && (!regex->anchored_beg || pos == 0) && enter_ordered(regex, state, regex->start, pos, len, allow_empty)) {
+            found = true;
+            *end = pos;
+        }
+        const Edge** tmp = state->curr_edges;
+        state->curr_edges = state->next_edges;
+        state->num_curr_edges = state->num_next_edges;
+        state->next_edges = tmp;
+        state->num_next_edges = 0;
+        state->generation += 1;
+        if (pos == len || (state->num_curr_edges == 0 && (found || regex->anchored_beg))) {
+            return found;
+        }
+        for (size_t i = 0; i < state->num_curr_edges; ++i) {
+            const Edge* e = state->curr_edges[i];
+            if (pattern_matches(&e->pat, buf[pos]) && enter_ordered(regex, state, e->target, pos + 1, len, true)) {
+                found = true;
+                *end = pos + 1;
+                break;
+            }
+        }
+    }
+}
+
+// Scan backward from `end` (to no further than `from`) along the reversed edges.
+// Returns the leftmost position at which a match ending at `end` begins
+size_t find_start(const Regex* regex, MatchState* state, const char* buf, size_t from, size_t end) {
+    clear_sets(state);
+    add_closure_dir(state, regex->final, true);
+    swap_sets(state);
+    size_t beg = end;
+    for (size_t pos = end; ; --pos) {
+        if (in_curr(state, regex->start) && (!regex->anchored_beg || pos == 0)) {
+            beg = pos;
+        }
+        if (pos == from || state->num_curr == 0) {
+            break;
+        }
+        advance_sets(regex, state, buf[pos - 1], true);
+        swap_sets(state);
+    }
+    return beg;
+}
+
+bool find_span(const Regex* regex, MatchState* state, const char* buf, size_t len, size_t from,
+               bool allow_empty, size_t* beg, size_t* end)
+{
+    if (from > len || !find_end(regex, state, buf, len, from, allow_empty, end)) {
+        return false;
+    }
+    // the match the path search finds begins leftmost, so no match ending there begins before it
+    *beg = find_start(regex, state, buf, from, *end);
+    return true;
+}
+
+void init_match_iter(MatchIter* iter, const Regex* regex, MatchScratch* scratch, const char* buf, size_t len) {
+    iter->regex = regex;
+    iter->scratch = scratch;
+    iter->buf = buf;
+    iter->len = len;
+    iter->pos = 0;
+}
+
+bool next_match(MatchIter* iter, StrView* match) {
+    if (iter->pos > iter->len) {
+        return false;
+    }
+    size_t beg, end;
+    if (!find_span(iter->regex, &iter->scratch->state, iter->buf, iter->len, iter->pos, false, &beg, &end)) {
+        iter->pos = iter->len + 1;
+        return false;
+    }
+    match->beg = iter->buf + beg;
+    match->len = end - beg;
+    // the next match picks up where this one left off
+    iter->pos = end;
+    return true;
+}
@@ -0,0 +1,444 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trigram.h"
+#include "util.h"
+
+//
+// This file works out which trigrams a match of a compiled regex must contain, straight from its NFA.
+//
+// We walk the NFA from the start of the pattern, remembering the last two bytes read whenever they are known
+// for sure (an edge that matches only a handful of bytes is tried with each of them; any other edge forgets them).
+// Each (node, last bytes) pair is a state, and reading a third known byte names a trigram.
+// The query for a state is then the `or` over its steps of the trigram the step names (if any) `and` the query for
+// where the step leads, which is worked out for every state at once, by iterating from "never holds" until nothing changes.
+// Loops only ever add clauses that are already implied, so this settles.
+//
+// Queries are kept small, by giving up precision where they would not be:
+// a clause with too many trigrams keeps only some of them, and a query with too many clauses
+// is replaced by the trigrams all of its clauses have in common.
+//
+
+// the most bytes an edge may match and still be followed byte by byte
+#define MAX_EDGE_BYTES 4
+// the most trigrams a clause keeps
+#define MAX_CLAUSE_TRIGRAMS 16
+// the most clauses a query keeps
+#define MAX_CLAUSES 32
+// past this many states or rounds, the query is not worth the trouble, and always holds
+#define MAX_STATES 20000
+#define MAX_ROUNDS 200
+
+// a step that does not name a trigram
+#define NO_TRIGRAM UINT32_MAX
+
+typedef struct {
+    Trigram trigram;
+    size_t target;
+} Step;
+
+typedef struct {
+    const Node* node;
+    // how many of the last bytes are known (0 to 2) in bits 16 and up, then the bytes themselves (the latest lowest)
+    uint32_t window;
+    bool accepts;
+    // dynamically allocated array of where this state can go
+    Step* steps;
+    size_t num_steps;
+    size_t cap_steps;
+    TrigramQuery query;
+} TrigramState;
+
+typedef struct {
+    // dynamically allocated array of states, in the order they were found
+    TrigramState* states;
+    size_t num_states;
+    size_t cap_states;
+    // open addressing hash table of (state index + 1), or 0 for an empty slot
+    size_t* table;
+    size_t table_cap;
+} StateMap;
+
+
+// =================================================================================
+//                                   Queries
+// =================================================================================
+
+void query_never(TrigramQuery* query) {
+    query->clauses = NULL;
+    query->num_clauses = 0;
+}
+
+void query_always(TrigramQuery* query) {
+    query->clauses = alloc_or_die(1, sizeof(TrigramClause));
+    query->clauses[0].trigrams = NULL;
+    query->clauses[0].num_trigrams = 0;
+    query->num_clauses = 1;
+}
+
+void destroy_trigram_query(const TrigramQuery* query) {
+    for (size_t i = 0; i < query->num_clauses; ++i) {
+        free(query->clauses[i].trigrams);
+    }
+    free(query->clauses);
+}
+
+TrigramClause copy_clause(const TrigramClause* clause) {
+    TrigramClause copy;
+    copy.num_trigrams = clause->num_trigrams;
+    copy.trigrams = NULL;
+    if (clause->num_trigrams > 0) {
+        copy.trigrams = alloc_or_die(clause->num_trigrams, sizeof(Trigram));
+        memcpy(copy.trigrams, clause->trigrams, clause->num_trigrams * sizeof(Trigram));
+    }
+    return copy;
+}
+
+// Returns true if every trigram of `a` is in `b`
+bool clause_within(const TrigramClause* a, const TrigramClause* b) {
+    size_t j = 0;
+    for (size_t i = 0; i < a->num_trigrams; ++i) {
+        while (j < b->num_trigrams && b->trigrams[j] < a->trigrams[i]) {
+            ++j;
+        }
+        if (j == b->num_trigrams || b->trigrams[j] != a->trigrams[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int compare_clauses(const void* a, const void* b) {
+    const TrigramClause* ca = a;
+    const TrigramClause* cb = b;
+    if (ca->num_trigrams != cb->num_trigrams) {
+        return ca->num_trigrams < cb->num_trigrams ? -1 : 1;
+    }
+    for (size_t i = 0; i < ca->num_trigrams; ++i) {
+        if (ca->trigrams[i] != cb->trigrams[i]) {
+            return ca->trigrams[i] < cb->trigrams[i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+// Put the clauses in order, drop any clause that holds whenever a smaller one does (it adds nothing to the `or`),
+// and shrink the query if it has too many clauses
+void normalize_query(TrigramQuery* query) {
+    // sorted by size, so a clause can only be within the ones after it
+    qsort(query->clauses, query->num_clauses, sizeof(TrigramClause), compare_clauses);
+    size_t num = 0;
+    for (size_t i = 0; i < query->num_clauses; ++i) {
+        bool redundant = false;
+        for (size_t j = 0; j < num && !redundant; ++j) {
+            redundant = clause_within(&query->clauses[j], &query->clauses[i]);
+        }
+        if (redundant) {
+            free(query->clauses[i].trigrams);
+        } else {
+            query->clauses[num++] = query->clauses[i];
+        }
+    }
+    query->num_clauses = num;
+    if (num <= MAX_CLAUSES) {
+        return;
+    }
+    // whichever clause holds, the trigrams they all have are there
+    TrigramClause* common = &query->clauses[0];
+    for (size_t i = 1; i < num; ++i) {
+        size_t kept = 0;
+        for (size_t k = 0; k < common->num_trigrams; ++k) {
+            TrigramClause one = { &common->trigrams[k], 1 };
+            if (clause_within(&one, &query->clauses[i])) {
+                common->trigrams[kept++] = common->trigrams[k];
+            }
+        }
+        common->num_trigrams = kept;
+        free(query->clauses[i].trigrams);
+    }
+    query->num_clauses = 1;
+}
+
+// Add copies of the clauses of `src` to `dst`
+void query_or(TrigramQuery* dst, const TrigramQuery* src) {
+    if (src->num_clauses == 0) {
+        return;
+    }
+    TrigramClause* new_clauses = realloc(dst->clauses, (dst->num_clauses + src->num_clauses) * sizeof(TrigramClause));
+    if (!new_clauses) {
+        out_of_memory();
+    }
+    dst->clauses = new_clauses;
+    for (size_t i = 0; i < src->num_clauses; ++i) {
+        dst->clauses[dst->num_clauses++] = copy_clause(&src->clauses[i]);
+    }
+    normalize_query(dst);
+}
+
+// Add to `dst` the clauses of `src`, each with `trigram` as well
+void query_or_with(TrigramQuery* dst, const TrigramQuery* src, Trigram trigram) {
+    TrigramQuery with;
+    with.num_clauses = src->num_clauses;
+    with.clauses = src->num_clauses > 0 ? alloc_or_die(src->num_clauses, sizeof(TrigramClause)) : NULL;
+    for (size_t i = 0; i < src->num_clauses; ++i) {
+        const TrigramClause* clause = &src->clauses[i];
+        TrigramClause* copy = &with.clauses[i];
+        copy->trigrams = alloc_or_die(clause->num_trigrams + 1, sizeof(Trigram));
+        copy->num_trigrams = 0;
+        bool placed = clause->num_trigrams >= MAX_CLAUSE_TRIGRAMS;
+        for (size_t k = 0; k < clause->num_trigrams; ++k) {
+            if (!placed && trigram <= clause->trigrams[k]) {
+                placed = true;
+                if (trigram < clause->trigrams[k]) {
+                    copy->trigrams[copy->num_trigrams++] = trigram;
+                }
+            }
+            copy->trigrams[copy->num_trigrams++] = clause->trigrams[k];
+        }
+        if (!placed) {
+            copy->trigrams[copy->num_trigrams++] = trigram;
+        }
+    }
+    query_or(dst, &with);
+    destroy_trigram_query(&with);
+}
+
+// Returns true if the (normalized) queries are the same
+bool query_equals(const TrigramQuery* a, const TrigramQuery* b) {
+    if (a->num_clauses != b->num_clauses) {
+        return false;
+    }
+    for (size_t i = 0; i < a->num_clauses; ++i) {
+        if (compare_clauses(&a->clauses[i], &b->clauses[i]) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void debug_trigram_query(const TrigramQuery* query) {
+    if (query->num_clauses == 0) {
+        printf("never\n");
+        return;
+    }
+    for (size_t i = 0; i < query->num_clauses; ++i) {
+        const TrigramClause* clause = &query->clauses[i];
+        printf("%s(", i == 0 ? "" : " OR ");
+        if (clause->num_trigrams == 0) {
+            printf("always");
+        }
+        for (size_t k = 0; k < clause->num_trigrams; ++k) {
+            printf("%s\"", k == 0 ? "" : " AND ");
+            for (int shift = 16; shift >= 0; shift -= 8) {
+                unsigned char ch = clause->trigrams[k] >> shift;
+                if (ch >= 0x20 && ch < 0x7F && ch != '"' && ch != '\\') {
+                    putchar(ch);
+                } else {
+                    printf("\\x%02x", ch);
+                }
+            }
+            printf("\"");
+        }
+        printf(")");
+    }
+    printf("\n");
+}
+
+
+// =================================================================================
+//                              Walking the NFA
+// =================================================================================
+
+uint64_t state_key(const Node* node, uint32_t window) {
+    return ((uint64_t)node->id << 32) | window;
+}
+
+size_t hash_state_key(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key;
+}
+
+// Returns the index of the state for `node` with `window`, adding it if it is new
+size_t state_of(StateMap* map, const Node* node, uint32_t window) {
+    if (2 * (map->num_states + 1) > map->table_cap) {
+        // rehash into a table twice the size, to keep it at most half full
+        size_t new_cap = map->table_cap == 0 ? 64 : 2 * map->table_cap;
+        size_t* new_table = alloc_or_die(new_cap, sizeof(size_t));
+        for (size_t i = 0; i < map->num_states; ++i) {
+            size_t slot = hash_state_key(state_key(map->states[i].node, map->states[i].window)) & (new_cap - 1);
+            while (new_table[slot]) {
+                slot = (slot + 1) & (new_cap - 1);
+            }
+            new_table[slot] = i + 1;
+        }
+        free(map->table);
+        map->table = new_table;
+        map->table_cap = new_cap;
+    }
+    uint64_t key = state_key(node, window);
+    size_t mask = map->table_cap - 1;
+    size_t slot = hash_state_key(key) & mask;
+    for (; map->table[slot]; slot = (slot + 1) & mask) {
+        const TrigramState* s = &map->states[map->table[slot] - 1];
+        if (state_key(s->node, s->window) == key) {
+            return map->table[slot] - 1;
+        }
+    }
+
+    if (map->num_states >= map->cap_states) {
+        size_t new_cap = map->cap_states == 0 ? 64 : 2 * map->cap_states;
+        TrigramState* new_states = realloc(map->states, new_cap * sizeof(TrigramState));
+        if (!new_states) {
+            out_of_memory();
+        }
+        map->states = new_states;
+        map->cap_states = new_cap;
+    }
+    size_t idx = map->num_states++;
+    TrigramState* s = &map->states[idx];
+    s->node = node;
+    s->window = window;
+    s->accepts = false;
+    s->steps = NULL;
+    s->num_steps = 0;
+    s->cap_steps = 0;
+    query_never(&s->query);
+    map->table[slot] = idx + 1;
+    return idx;
+}
+
+void add_step(TrigramState* s, Trigram trigram, size_t target) {
+    if (s->num_steps >= s->cap_steps) {
+        size_t new_cap = s->cap_steps == 0 ? 4 : 2 * s->cap_steps;
+        Step* new_steps = realloc(s->steps, new_cap * sizeof(Step));
+        if (!new_steps) {
+            out_of_memory();
+        }
+        s->steps = new_steps;
+        s->cap_steps = new_cap;
+    }
+    s->steps[s->num_steps].trigram = trigram;
+    s->steps[s->num_steps].target = target;
+    s->num_steps += 1;
+}
+
+// Find the steps out of state `idx`, adding the states they lead to
+void find_steps(StateMap* map, const Regex* regex, size_t idx) {
+    const Node* node = map->states[idx].node;
+    uint32_t window = map->states[idx].window;
+    if (node == regex->final || node->accepts) {
+        map->states[idx].accepts = true;
+        return;
+    }
+    for (size_t i = 0; i < node->num_edges; ++i) {
+        const Edge* e = &node->edges[i];
+        if (e->target->dead) {
+            continue;
+        }
+        if (pat_size(&e->pat) == 0) {
+            size_t target = state_of(map, e->target, window);
+            add_step(&map->states[idx], NO_TRIGRAM, target);
+            continue;
+        }
+        unsigned char bytes[MAX_EDGE_BYTES];
+        size_t num_bytes = 0;
+        for (int ch = 0; ch < 256; ++ch) {
+            if (pattern_matches(&e->pat, (char)ch)) {
+                if (num_bytes < MAX_EDGE_BYTES) {
+                    bytes[num_bytes] = ch;
+                }
+                ++num_bytes;
+            }
+        }
+        if (num_bytes > MAX_EDGE_BYTES) {
+            // too many to follow: we no longer know what came before
+            size_t target = state_of(map, e->target, 0);
+            add_step(&map->states[idx], NO_TRIGRAM, target);
+            continue;
+        }
+        uint32_t known = window >> 16;
+        for (size_t b = 0; b < num_bytes; ++b) {
+            Trigram trigram = NO_TRIGRAM;
+            uint32_t next_window;
+            if (known == 0) {
+                next_window = (1 << 16) | bytes[b];
+            } else {
+                next_window = (2 << 16) | ((window & 0xFF) << 8) | bytes[b];
+                if (known == 2) {
+                    trigram = ((window & 0xFFFF) << 8) | bytes[b];
+                }
+            }
+            size_t target = state_of(map, e->target, next_window);
+            add_step(&map->states[idx], trigram, target);
+        }
+    }
+}
+
+void required_trigrams(const Regex* regex, TrigramQuery* query) {
+    StateMap map;
+    map.states = NULL;
+    map.num_states = 0;
+    map.cap_states = 0;
+    map.table = NULL;
+    map.table_cap = 0;
+
+    bool settled = true;
+    size_t start = state_of(&map, regex->start, 0);
+    for (size_t i = 0; i < map.num_states && settled; ++i) {
+        find_steps(&map, regex, i);
+        settled = map.num_states <= MAX_STATES;
+    }
+    for (size_t i = 0; i < map.num_states && settled; ++i) {
+        if (map.states[i].accepts) {
+            destroy_trigram_query(&map.states[i].query);
+            query_always(&map.states[i].query);
+        }
+    }
+
+    // states found later tend to be closer to the end of the pattern, so they go first
+    bool changed = settled;
+    for (size_t round = 0; round < MAX_ROUNDS && changed; ++round) {
+        changed = false;
+        for (size_t i = map.num_states; i-- > 0;) {
+            TrigramState* s = &map.states[i];
+            if (s->accepts) {
+                continue;
+            }
+            TrigramQuery next;
+            query_never(&next);
+            for (size_t k = 0; k < s->num_steps; ++k) {
+                const Step* step = &s->steps[k];
+                if (step->trigram == NO_TRIGRAM) {
+                    query_or(&next, &map.states[step->target].query);
+                } else {
+                    query_or_with(&next, &map.states[step->target].query, step->trigram);
+                }
+            }
+            if (query_equals(&next, &s->query)) {
+                destroy_trigram_query(&next);
+            } else {
+                destroy_trigram_query(&s->query);
+                s->query = next;
+                changed = true;
+            }
+        }
+    }
+
+    if (!settled || changed) {
+        query_always(query);
+    } else {
+        // the query is moved out of the state, which is left with nothing to free
+        *query = map.states[start].query;
+        query_never(&map.states[start].query);
+    }
+    for (size_t i = 0; i < map.num_states; ++i) {
+        destroy_trigram_query(&map.states[i].query);
+        free(map.states[i].steps);
+    }
+    free(map.states);
+    free(map.table);
+}
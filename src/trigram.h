@@ -0,0 +1,40 @@
+#ifndef __trigram_h__
+#define __trigram_h__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "regex.h"
+
+// Three bytes in a row, as one number: (b0 << 16) | (b1 << 8) | b2
+typedef uint32_t Trigram;
+
+// the number of different trigrams there are
+#define NUM_TRIGRAMS (1 << 24)
+
+// Every trigram in the clause
+typedef struct {
+    // dynamically allocated array, sorted
+    Trigram* trigrams;
+    size_t num_trigrams;
+} TrigramClause;
+
+// A condition on which trigrams some text contains: it holds if the text contains every trigram of at least one clause.
+// With a clause of no trigrams, it always holds; with no clauses at all, it never does
+typedef struct {
+    // dynamically allocated array
+    TrigramClause* clauses;
+    size_t num_clauses;
+} TrigramQuery;
+
+// Work out what trigrams any text the compiled `regex` matches somewhere in must contain.
+// A file whose trigrams do not satisfy the query can not have a matching line.
+// The query is only as precise as is cheap to work out: at worst, it always holds
+void required_trigrams(const Regex* regex, TrigramQuery* query);
+
+void destroy_trigram_query(const TrigramQuery* query);
+
+// Prints a debug report to stdout
+void debug_trigram_query(const TrigramQuery* query);
+
+#endif
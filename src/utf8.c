@@ -0,0 +1,340 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "utf8.h"
+#include "util.h"
+
+//
+// This file works out what the byte-level automaton needs to look like for a pattern to match
+// whole UTF-8 characters, so that matching itself never has to decode anything.
+//
+// A character of two or more bytes is matched by a chain of byte edges, one per byte.
+// The code points a pattern matches are split into runs whose encodings have the same length
+// and whose bytes each vary over one range, e.g. U+0800 to U+0FFF is [e0][a0-bf][80-bf].
+// Each run becomes one chain of PAT_RANGE edges in the compiler.
+//
+
+size_t decode_utf8(const char* s, uint32_t* codepoint) {
+    unsigned char lead = s[0];
+    if (lead < 0x80) {
+        *codepoint = lead;
+        return 1;
+    }
+    size_t len;
+    uint32_t cp;
+    uint32_t smallest; // anything below this has a shorter encoding
+    if ((lead & 0xE0) == 0xC0) {
+        len = 2;
+        cp = lead & 0x1F;
+        smallest = 0x80;
+    } else if ((lead & 0xF0) == 0xE0) {
+        len = 3;
+        cp = lead & 0x0F;
+        smallest = 0x800;
+    } else if ((lead & 0xF8) == 0xF0) {
+        len = 4;
+        cp = lead & 0x07;
+        smallest = 0x10000;
+    } else {
+        return 0;
+    }
+    for (size_t i = 1; i < len; ++i) {
+        unsigned char b = s[i];
+        if ((b & 0xC0) != 0x80) {
+            return 0;
+        }
+        cp = (cp << 6) | (b & 0x3F);
+    }
+    if (cp < smallest || cp > MAX_CODEPOINT || (0xD800 <= cp && cp <= 0xDFFF)) {
+        return 0;
+    }
+    *codepoint = cp;
+    return len;
+}
+
+// Write the UTF-8 encoding of `cp` to `out`, returning how many bytes it takes
+size_t encode_utf8(uint32_t cp, unsigned char* out) {
+    if (cp < 0x80) {
+        out[0] = cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = 0xC0 | (cp >> 6);
+        out[1] = 0x80 | (cp & 0x3F);
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = 0xE0 | (cp >> 12);
+        out[1] = 0x80 | ((cp >> 6) & 0x3F);
+        out[2] = 0x80 | (cp & 0x3F);
+        return 3;
+    }
+    out[0] = 0xF0 | (cp >> 18);
+    out[1] = 0x80 | ((cp >> 12) & 0x3F);
+    out[2] = 0x80 | ((cp >> 6) & 0x3F);
+    out[3] = 0x80 | (cp & 0x3F);
+    return 4;
+}
+
+
+// =================================================================================
+//                               Sets of code points
+// =================================================================================
+
+void init_codepoint_set(CodepointSet* set) {
+    set->ranges = NULL;
+    set->len = 0;
+    set->cap = 0;
+}
+
+void destroy_codepoint_set(const CodepointSet* set) {
+    free(set->ranges);
+}
+
+void add_codepoints(CodepointSet* set, uint32_t first, uint32_t last) {
+    if (set->len >= set->cap) {
+        size_t new_cap = 2 * set->cap;
+        if (new_cap == 0) {
+            new_cap = 4;
+        }
+        CodepointRange* new_ranges = realloc(set->ranges, sizeof(CodepointRange) * new_cap);
+        if (!new_ranges) {
+            out_of_memory();
+        }
+        set->ranges = new_ranges;
+        set->cap = new_cap;
+    }
+    set->ranges[set->len].first = first;
+    set->ranges[set->len].last = last;
+    ++set->len;
+}
+
+int compare_ranges(const void* a, const void* b) {
+    const CodepointRange* ra = a;
+    const CodepointRange* rb = b;
+    if (ra->first != rb->first) {
+        return ra->first < rb->first ? -1 : 1;
+    }
+    return 0;
+}
+
+// Sort the ranges and merge any that overlap or touch
+void normalize_codepoints(CodepointSet* set) {
+    if (set->len == 0) {
+        return;
+    }
+    qsort(set->ranges, set->len, sizeof(CodepointRange), compare_ranges);
+    size_t num = 1;
+    for (size_t i = 1; i < set->len; ++i) {
+        CodepointRange* prev = &set->ranges[num - 1];
+        if (set->ranges[i].first <= prev->last + 1) {
+            if (set->ranges[i].last > prev->last) {
+                prev->last = set->ranges[i].last;
+            }
+        } else {
+            set->ranges[num++] = set->ranges[i];
+        }
+    }
+    set->len = num;
+}
+
+// Replace the (normalized) set with every non-ASCII code point it did not have
+void complement_codepoints(CodepointSet* set) {
+    CodepointSet result;
+    init_codepoint_set(&result);
+    uint32_t next = 0x80;
+    for (size_t i = 0; i < set->len; ++i) {
+        if (set->ranges[i].first > next) {
+            add_codepoints(&result, next, set->ranges[i].first - 1);
+        }
+        if (set->ranges[i].last + 1 > next) {
+            next = set->ranges[i].last + 1;
+        }
+    }
+    if (next <= MAX_CODEPOINT) {
+        add_codepoints(&result, next, MAX_CODEPOINT);
+    }
+    destroy_codepoint_set(set);
+    *set = result;
+}
+
+void nonascii_codepoints(const Pattern* pat, CodepointSet* set) {
+    switch (pat->type) {
+        case PAT_ANY:
+        case PAT_NONALPHA:
+        case PAT_NONDIGIT:
+            add_codepoints(set, 0x80, MAX_CODEPOINT);
+            break;
+        case PAT_CODEPOINT:
+            add_codepoints(set, pat->codepoint, pat->codepoint);
+            break;
+        case PAT_SET:
+            for (size_t i = 0; i < pat->num_sub_pats; ++i) {
+                nonascii_codepoints(&pat->sub_pats[i], set);
+            }
+            break;
+        case PAT_NEG_SET: {
+            CodepointSet excluded;
+            init_codepoint_set(&excluded);
+            for (size_t i = 0; i < pat->num_sub_pats; ++i) {
+                nonascii_codepoints(&pat->sub_pats[i], &excluded);
+            }
+            normalize_codepoints(&excluded);
+            complement_codepoints(&excluded);
+            for (size_t i = 0; i < excluded.len; ++i) {
+                add_codepoints(set, excluded.ranges[i].first, excluded.ranges[i].last);
+            }
+            destroy_codepoint_set(&excluded);
+            break;
+        }
+        default:
+            // the rest only ever match ASCII (or a single invalid byte, which stays as it is)
+            break;
+    }
+    normalize_codepoints(set);
+}
+
+
+// =================================================================================
+//                       The single-byte part of a pattern
+// =================================================================================
+
+Pattern make_range(unsigned char first, unsigned char last) {
+    Pattern pat = EMPTY_PATTERN;
+    pat.type = PAT_RANGE;
+    pat.literal = first;
+    pat.last = last;
+    return pat;
+}
+
+// Returns true if `pat` matches any of the bytes `first` to `last`
+bool matches_byte_in(const Pattern* pat, int first, int last) {
+    for (int ch = first; ch <= last; ++ch) {
+        if (pattern_matches(pat, (char)ch)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// `pat`, but matching no byte outside of ASCII (except an invalid byte it names on its own)
+Pattern ascii_only(const Pattern* pat) {
+    if (!matches_byte_in(pat, 0x80, 0xFF)) {
+        return copy_pat(pat);
+    }
+    Pattern result = EMPTY_PATTERN;
+    switch (pat->type) {
+        case PAT_ANY:
+            return make_range(0x00, 0x7F);
+        case PAT_NONALPHA:
+            result.type = PAT_ASCII_NONALPHA;
+            return result;
+        case PAT_NONDIGIT:
+            result.type = PAT_ASCII_NONDIGIT;
+            return result;
+        case PAT_NEG_SET:
+            result = copy_pat(pat);
+            result.type = PAT_ASCII_NEG_SET;
+            return result;
+        case PAT_SET:
+            result.type = PAT_SET;
+            result.num_sub_pats = pat->num_sub_pats;
+            result.sub_pats = alloc_or_die(result.num_sub_pats, sizeof(Pattern));
+            for (size_t i = 0; i < pat->num_sub_pats; ++i) {
+                result.sub_pats[i] = ascii_only(&pat->sub_pats[i]);
+            }
+            return result;
+        default:
+            return copy_pat(pat);
+    }
+}
+
+bool ascii_part(const Pattern* pat, Pattern* ascii) {
+    *ascii = ascii_only(pat);
+    return matches_byte_in(ascii, 0x00, 0xFF);
+}
+
+
+// =================================================================================
+//                      Code points to runs of byte sequences
+// =================================================================================
+
+void init_byte_seqs(ByteSeqList* list) {
+    list->seqs = NULL;
+    list->len = 0;
+    list->cap = 0;
+}
+
+void destroy_byte_seqs(const ByteSeqList* list) {
+    free(list->seqs);
+}
+
+void push_byte_seq(ByteSeqList* list, const ByteSeq* seq) {
+    if (list->len >= list->cap) {
+        size_t new_cap = 2 * list->cap;
+        if (new_cap == 0) {
+            new_cap = 8;
+        }
+        ByteSeq* new_seqs = realloc(list->seqs, sizeof(ByteSeq) * new_cap);
+        if (!new_seqs) {
+            out_of_memory();
+        }
+        list->seqs = new_seqs;
+        list->cap = new_cap;
+    }
+    list->seqs[list->len++] = *seq;
+}
+
+// Split `first` .. `last` until each piece is a single run of byte sequences, and append them to `list`
+void split_codepoints(uint32_t first, uint32_t last, ByteSeqList* list) {
+    if (first > last) {
+        return;
+    }
+    // surrogates have no encoding
+    if (first <= 0xDFFF && last >= 0xD800) {
+        if (first < 0xD800) {
+            split_codepoints(first, 0xD7FF, list);
+        }
+        if (last > 0xDFFF) {
+            split_codepoints(0xE000, last, list);
+        }
+        return;
+    }
+    // every encoding in a run takes the same number of bytes
+    static const uint32_t largest_of_len[] = { 0x7F, 0x7FF, 0xFFFF };
+    for (size_t i = 0; i < sizeof(largest_of_len) / sizeof(largest_of_len[0]); ++i) {
+        uint32_t largest = largest_of_len[i];
+        if (first <= largest && last > largest) {
+            split_codepoints(first, largest, list);
+            split_codepoints(largest + 1, last, list);
+            return;
+        }
+    }
+    // and the trailing bytes must each cover all of 80-bf, except where the leading ones are the same
+    for (int i = 1; i < 4; ++i) {
+        uint32_t low_bits = ((uint32_t)1 << (6 * i)) - 1;
+        if ((first & ~low_bits) != (last & ~low_bits)) {
+            if ((first & low_bits) != 0) {
+                split_codepoints(first, first | low_bits, list);
+                split_codepoints((first | low_bits) + 1, last, list);
+                return;
+            }
+            if ((last & low_bits) != low_bits) {
+                split_codepoints(first, (last & ~low_bits) - 1, list);
+                split_codepoints(last & ~low_bits, last, list);
+                return;
+            }
+        }
+    }
+    ByteSeq seq;
+    seq.len = encode_utf8(first, seq.first);
+    encode_utf8(last, seq.last);
+    push_byte_seq(list, &seq);
+}
+
+void utf8_sequences(const CodepointSet* set, ByteSeqList* list) {
+    for (size_t i = 0; i < set->len; ++i) {
+        split_codepoints(set->ranges[i].first, set->ranges[i].last, list);
+    }
+}
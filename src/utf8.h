@@ -0,0 +1,64 @@
+#ifndef __utf8_h__
+#define __utf8_h__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pattern.h"
+
+// the largest code point there is
+#define MAX_CODEPOINT 0x10FFFF
+
+// Decode the UTF-8 character at `s` into `*codepoint`
+// Returns how many bytes it takes, or 0 if `s` does not begin with a valid UTF-8 character
+// (an overlong encoding, a surrogate, or a sequence cut short all count as invalid)
+size_t decode_utf8(const char* s, uint32_t* codepoint);
+
+// The code points from `first` to `last` (inclusive)
+typedef struct {
+    uint32_t first;
+    uint32_t last;
+} CodepointRange;
+
+// A growable array of code point ranges, sorted and without overlaps once `normalize_codepoints` is called
+typedef struct {
+    CodepointRange* ranges;
+    size_t len;
+    size_t cap;
+} CodepointSet;
+
+void init_codepoint_set(CodepointSet* set);
+
+void destroy_codepoint_set(const CodepointSet* set);
+
+// Fill `set` with every code point of two or more bytes that `pat` matches in UTF-8 mode
+void nonascii_codepoints(const Pattern* pat, CodepointSet* set);
+
+// Sets `*ascii` to a pattern that matches the same single bytes as `pat`, except for any byte outside of ASCII.
+// It must be destroyed on its own.
+// Returns false if that pattern would never match anything
+bool ascii_part(const Pattern* pat, Pattern* ascii);
+
+// A run of UTF-8 encodings: byte i is in first[i] .. last[i] (inclusive), for each of the `len` bytes
+typedef struct {
+    unsigned char first[4];
+    unsigned char last[4];
+    size_t len;
+} ByteSeq;
+
+// A growable array of byte sequences
+typedef struct {
+    ByteSeq* seqs;
+    size_t len;
+    size_t cap;
+} ByteSeqList;
+
+void init_byte_seqs(ByteSeqList* list);
+
+void destroy_byte_seqs(const ByteSeqList* list);
+
+// Append to `list` the byte sequences that match exactly the UTF-8 encodings of the code points in `set`
+void utf8_sequences(const CodepointSet* set, ByteSeqList* list);
+
+#endif
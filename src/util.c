@@ -1,22 +1,60 @@
+#include <setjmp.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 int min(int a, int b) {
     if (a < b) return a;
     else       return b;
 }
 
+// NULL means stderr
+_Thread_local FILE* thread_error_output = NULL;
+_Thread_local jmp_buf* out_of_memory_env = NULL;
+
+FILE* error_output(void) {
+    return thread_error_output ? thread_error_output : stderr;
+}
+
+void set_error_output(FILE* out) {
+    thread_error_output = out;
+}
+
+void out_of_memory(void) {
+    fprintf(error_output(), "ERROR: out of memory\n");
+    if (out_of_memory_env) {
+        longjmp(*out_of_memory_env, 1);
+    }
+    exit(EXIT_FAILURE);
+}
+
+jmp_buf* catch_out_of_memory(jmp_buf* env) {
+    jmp_buf* prev = out_of_memory_env;
+    out_of_memory_env = env;
+    return prev;
+}
+
+void* alloc_or_die(size_t count, size_t size) {
+    void* data = calloc(count > 0 ? count : 1, size);
+    if (!data) {
+        out_of_memory();
+    }
+    return data;
+}
+
 char* make_copy(const char* str) {
     int len = strlen(str);
-    char* copy = malloc(len + 1); // one extra for the null byte
+    char* copy = alloc_or_die(len + 1, 1); // one extra for the null byte
     strcpy(copy, str);
     return copy;
 }
 
 char* copy_between(const char* begin, const char* end) {
     size_t len = end - begin;
-    char* copy = malloc(len + 1); // one extra for the null byte
+    char* copy = alloc_or_die(len + 1, 1); // one extra for the null byte
     strncpy(copy, begin, len);
     copy[len] = '\0';
     return copy;
@@ -31,3 +69,31 @@ char* trim_newline(char* str) {
     return NULL;
 }
 
+
+size_t count_newlines(const char* buf, size_t len) {
+    size_t count = 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i newline = _mm_set1_epi8('\n');
+    while (len - i >= 16) {
+        // each byte of `counts` counts the newlines in its lane, which can go 255 blocks before it overflows
+        __m128i counts = _mm_setzero_si128();
+        size_t blocks = (len - i) / 16;
+        if (blocks > 255) {
+            blocks = 255;
+        }
+        for (size_t b = 0; b < blocks; ++b, i += 16) {
+            __m128i block = _mm_loadu_si128((const __m128i*)(buf + i));
+            // a match is all ones, which is -1
+            counts = _mm_sub_epi8(counts, _mm_cmpeq_epi8(block, newline));
+        }
+        // add up the lanes, in two halves of 8
+        __m128i sums = _mm_sad_epu8(counts, _mm_setzero_si128());
+        count += _mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4);
+    }
+#endif
+    for (; i < len; ++i) {
+        count += buf[i] == '\n';
+    }
+    return count;
+}
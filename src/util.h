@@ -1,8 +1,28 @@
 #ifndef __util_h__
 #define __util_h__
 
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdio.h>
+
 int min(int a, int b);
 
+// Where this thread's error messages (such as why a regex does not compile) go: stderr, unless set otherwise
+FILE* error_output(void);
+void set_error_output(FILE* out);
+
+// Report that we are out of memory, then exit,
+// unless this thread is catching it (see `catch_out_of_memory`), in which case jump back there
+void out_of_memory(void);
+
+// Until called again with NULL, running out of memory on this thread longjmps to `env` (with 1) instead of exiting.
+// Returns the `env` it replaces, to be put back when done
+jmp_buf* catch_out_of_memory(jmp_buf* env);
+
+// dynamically allocate a zeroed array of `count` items of `size` bytes,
+// exiting if we are out of memory (see `out_of_memory`)
+void* alloc_or_die(size_t count, size_t size);
+
 // dynamically allocate a copy of `str`
 char* make_copy(const char* str);
 
@@ -14,5 +34,8 @@ char* copy_between(const char* begin, const char* end);
 // returns a pointer to that instance, or NULL if none exist
 char* trim_newline(char* str);
 
+// Returns how many newlines there are in the `len` bytes at `buf`
+// (16 bytes at a time, where SSE2 is available)
+size_t count_newlines(const char* buf, size_t len);
 
 #endif
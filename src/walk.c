@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "walk.h"
+#include "input.h"
+#include "reader.h"
+#include "util.h"
+
+//
+// This file contains the recursive directory traversal behind `-r`
+// Several worker threads share a stack of directories that still need to be read.
+// Reading a directory pushes its subdirectories onto the stack and searches its files on the spot,
+// so traversal and matching both run in parallel, and the regex is only ever compiled once.
+// Each worker keeps many of its files being opened and read ahead at once (see `reader.c`), and matches each one
+// once its first block is in, so a tree of small files is not read one round trip to the disk at a time.
+//
+
+// how much of a file we inspect to decide if it is binary
+#define SNIFF_SIZE 4096
+
+// how many files each worker has on their way at once
+#define READ_AHEAD_FILES 32
+
+typedef struct {
+    const Regex* regex;
+    const SearchOptions* opts;
+    // where the output of every file goes, a whole file at a time
+    FILE* out;
+    // where the workers' error messages go: the same place as those of the thread that started them
+    FILE* err;
+    // guards every field below
+    pthread_mutex_t lock;
+    // signalled when a directory is pushed, or when the last busy worker finishes
+    pthread_cond_t wakeup;
+    // dynamically allocated stack of directory paths still to be read
+    char** dirs;
+    size_t num_dirs;
+    size_t cap_dirs;
+    // how many workers are in the middle of reading a directory (and so may push more)
+    size_t num_busy;
+    // set if any file or directory could not be read
+    bool failed;
+} WorkQueue;
+
+// dynamically allocate `dir/name`
+char* join_path(const char* dir, const char* name) {
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    bool needs_slash = dir_len > 0 && dir[dir_len - 1] != '/';
+    char* path = alloc_or_die(dir_len + needs_slash + name_len + 1, 1); // one extra for the null byte
+    memcpy(path, dir, dir_len);
+    if (needs_slash) {
+        path[dir_len] = '/';
+    }
+    memcpy(path + dir_len + needs_slash, name, name_len + 1);
+    return path;
+}
+
+// Push an owned directory path onto the stack, waking up an idle worker
+void push_dir(WorkQueue* q, char* path) {
+    pthread_mutex_lock(&q->lock);
+    if (q->num_dirs >= q->cap_dirs) {
+        size_t new_cap = 2 * q->cap_dirs;
+        if (new_cap == 0) {
+            new_cap = 16;
+        }
+        char** new_dirs = realloc(q->dirs, sizeof(char*) * new_cap);
+        if (!new_dirs) {
+            pthread_mutex_unlock(&q->lock);
+            free(path);
+            out_of_memory();
+        }
+        q->dirs = new_dirs;
+        q->cap_dirs = new_cap;
+    }
+    q->dirs[q->num_dirs] = path;
+    q->num_dirs += 1;
+    pthread_cond_signal(&q->wakeup);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Blocks until there is a directory to read (if `wait` is set), and marks the caller as busy.
+// Returns NULL once the stack is empty and no busy worker can refill it, or straight away if it is empty and `wait` is not set
+char* pop_dir(WorkQueue* q, bool wait) {
+    pthread_mutex_lock(&q->lock);
+    while (wait && q->num_dirs == 0 && q->num_busy > 0) {
+        pthread_cond_wait(&q->wakeup, &q->lock);
+    }
+    char* path = NULL;
+    if (q->num_dirs > 0) {
+        q->num_dirs -= 1;
+        path = q->dirs[q->num_dirs];
+        q->num_busy += 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return path;
+}
+
+// Marks the caller as no longer busy, releasing everyone if that was the last of the work
+void finish_dir(WorkQueue* q) {
+    pthread_mutex_lock(&q->lock);
+    q->num_busy -= 1;
+    if (q->num_busy == 0 && q->num_dirs == 0) {
+        pthread_cond_broadcast(&q->wakeup);
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+void report_failure(WorkQueue* q, const char* what, const char* path) {
+    fprintf(stderr, "ERROR: Can not open %s `%s` to read, skipping...\n", what, path);
+    pthread_mutex_lock(&q->lock);
+    q->failed = true;
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Search the file read ahead into `file`, taking over everything in it
+// The output for the whole file is collected first, so that lines from different files never interleave
+void search_read_ahead(WorkQueue* q, MatchScratch* scratch, ReadAhead* file) {
+    if (file->fd < 0 || file->len < 0) {
+        report_failure(q, "input file", file->path);
+        if (file->fd >= 0) {
+            close(file->fd);
+        }
+        free(file->buf);
+        free(file->path);
+        return;
+    }
+    // a null byte in the first block means this is not text (unless it is compressed text)
+    size_t sniffed = file->len < SNIFF_SIZE ? file->len : SNIFF_SIZE;
+    bool compressed = is_compressed(file->buf, file->len);
+    if (!compressed && memchr(file->buf, '\0', sniffed)) {
+        close(file->fd);
+        free(file->buf);
+        free(file->path);
+        return;
+    }
+
+    char* text = NULL;
+    size_t text_len = 0;
+    FILE* out = open_memstream(&text, &text_len);
+    bool ok;
+    if (compressed) {
+        // decompressed from the start, like any other input
+        free(file->buf);
+        FILE* in = lseek(file->fd, 0, SEEK_SET) == 0 ? fdopen(file->fd, "r") : NULL;
+        ok = in && match_lines_with(q->regex, scratch, in, file->path, out, true, q->opts);
+        if (in) {
+            fclose(in);
+        } else {
+            close(file->fd);
+        }
+    } else {
+        // a short read means we have all of it; otherwise the rest comes after what was read ahead
+        bool at_eof = file->len < READ_AHEAD_SIZE;
+        if (at_eof || lseek(file->fd, file->len, SEEK_SET) == file->len) {
+            ok = match_block_lines(q->regex, scratch, file->buf, READ_AHEAD_SIZE, file->len, at_eof, file->fd,
+                                   file->path, out, true, q->opts);
+        } else {
+            free(file->buf);
+            ok = false;
+        }
+        close(file->fd);
+    }
+    if (!ok) {
+        report_failure(q, "input file", file->path);
+    }
+    fclose(out);
+    free(file->path);
+
+    if (text_len > 0) {
+        flockfile(q->out);
+        fwrite(text, 1, text_len, q->out);
+        funlockfile(q->out);
+    }
+    free(text);
+}
+
+// Search the file submitted to `reader` longest ago, waiting for it if need be.
+// Returns false if there are none
+bool search_next_file(WorkQueue* q, MatchScratch* scratch, FileReader* reader) {
+    ReadAhead file;
+    if (!next_file(reader, &file)) {
+        return false;
+    }
+    search_read_ahead(q, scratch, &file);
+    return true;
+}
+
+// Read every entry of the directory at `path`
+// Regular files are handed to `reader`, and searched with `scratch` as they come back from it
+void read_dir(WorkQueue* q, MatchScratch* scratch, FileReader* reader, const char* path) {
+    int dir_fd = open(path, O_RDONLY | O_DIRECTORY);
+    DIR* dir = dir_fd < 0 ? NULL : fdopendir(dir_fd);
+    if (!dir) {
+        if (dir_fd >= 0) {
+            close(dir_fd);
+        }
+        report_failure(q, "directory", path);
+        return;
+    }
+    struct dirent* ent;
+    while ((ent = readdir(dir))) {
+        const char* name = ent->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+        unsigned char type = ent->d_type;
+        if (type == DT_UNKNOWN) {
+            // not every file system fills in the type, so ask for it
+            struct stat st;
+            if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                continue;
+            }
+            if (S_ISDIR(st.st_mode)) {
+                type = DT_DIR;
+            } else if (S_ISREG(st.st_mode)) {
+                type = DT_REG;
+            }
+        }
+        // note: symbolic links are never followed, so there is no way to loop forever
+        if (type == DT_DIR && want_dir(q->opts, name)) {
+            push_dir(q, join_path(path, name));
+        } else if (type == DT_REG && want_file(q->opts, name)) {
+            if (file_reader_full(reader)) {
+                search_next_file(q, scratch, reader);
+            }
+            submit_file(reader, join_path(path, name));
+        }
+    }
+    closedir(dir);
+}
+
+void* walk_worker(void* arg) {
+    WorkQueue* q = arg;
+    set_error_output(q->err);
+    // (one scratch for every file, so the DFA built up for one is there for the next)
+    MatchScratch scratch;
+    init_match_scratch(&scratch, q->regex);
+    FileReader* reader = open_file_reader(READ_AHEAD_FILES);
+    // running out of memory stops this worker and fails the search, but the others carry on.
+    // (what it had open or allocated for the file or directory at hand is lost)
+    volatile bool busy = false;
+    jmp_buf env;
+    jmp_buf* prev_env = catch_out_of_memory(&env);
+    if (setjmp(env) != 0) {
+        pthread_mutex_lock(&q->lock);
+        q->failed = true;
+        pthread_mutex_unlock(&q->lock);
+        if (busy) {
+            finish_dir(q);
+        }
+    } else {
+        while (1) {
+            // while files are on their way, search them rather than wait for another directory
+            char* path = pop_dir(q, !file_reader_busy(reader));
+            if (path) {
+                busy = true;
+                read_dir(q, &scratch, reader, path);
+                free(path);
+                busy = false;
+                finish_dir(q);
+            } else if (!search_next_file(q, &scratch, reader)) {
+                break;
+            }
+        }
+    }
+    catch_out_of_memory(prev_env);
+    destroy_file_reader(reader);
+    destroy_match_scratch(&scratch);
+    return NULL;
+}
+
+bool search_tree(const Regex* regex, const char* root, FILE* out, const SearchOptions* opts) {
+    WorkQueue q;
+    q.regex = regex;
+    q.opts = opts;
+    q.out = out;
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.wakeup, NULL);
+    q.dirs = NULL;
+    q.num_dirs = 0;
+    q.cap_dirs = 0;
+    q.num_busy = 0;
+    q.failed = false;
+    q.err = error_output();
+
+    push_dir(&q, make_copy(root));
+
+    size_t num_threads = opts->num_threads > 0 ? opts->num_threads : 1;
+    pthread_t* threads = alloc_or_die(num_threads, sizeof(pthread_t));
+    size_t num_started = 0;
+    for (; num_started < num_threads; ++num_started) {
+        if (pthread_create(&threads[num_started], NULL, walk_worker, &q) != 0) {
+            break;
+        }
+    }
+    if (num_started == 0) {
+        // no threads to be had, so do all the work here
+        walk_worker(&q);
+    }
+    for (size_t i = 0; i < num_started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    free(q.dirs);
+    pthread_cond_destroy(&q.wakeup);
+    pthread_mutex_destroy(&q.lock);
+    return !q.failed;
+}
@@ -0,0 +1,19 @@
+#ifndef __walk_h__
+#define __walk_h__
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "regex.h"
+#include "search.h"
+
+// dynamically allocate `dir/name`
+char* join_path(const char* dir, const char* name);
+
+// Searches every text file below the directory `root`, using `opts->num_threads` threads
+// Matches are printed to `out`, prefixed with the path of the file they came from.
+// Files whose first block contains a null byte are considered binary and skipped.
+// Returns false if some file or directory could not be read
+bool search_tree(const Regex* regex, const char* root, FILE* out, const SearchOptions* opts);
+
+#endif
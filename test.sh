@@ -0,0 +1,235 @@
+#!/bin/bash
+# regression checks for the command line tool, run after build.sh
+
+BIN=build/a.out
+FAILED=0
+
+# check <expected output> <input line> <regex> [options...]
+check() {
+    local expected="$1"
+    local input="$2"
+    shift 2
+    local got
+    got=$(printf '%s\n' "$input" | $BIN "$@" 2>&1)
+    if [ "$got" != "$expected" ]; then
+        echo "FAILED: $* on '$input'"
+        echo "  expected: '$expected'"
+        echo "  got:      '$got'"
+        FAILED=1
+    fi
+}
+
+# a repetition inside a repeated group must not skip the rest of the group
+check "" "abaa" '^(a*b)+$'
+check "" "abaa" '^(a*b)+$' -c
+check "abab" "abab" '^(a*b)+$'
+check "" "abababaa" '^(a*b){2,}$'
+check "" "aa" '^(a*b)*$'
+check "" "aa" '^(a*b)*$' -c
+check "x" "1x" '(\d*\s)?x' -o
+check "1x
+    [1]" "1x" '(\d*\s)?x' -c
+check "" "cxbbbcxa2axba " '\w{2}((.+)?[^a1]*\w{2}\D{1,3})+\W*[ab]{2,}'
+check "" "cxbbbcxa2axba " '\w{2}((.+)?[^a1]*\w{2}\D{1,3})+\W*[ab]{2,}' -c
+
+# compiling takes time in proportion to the pattern, even for a large counted repeat
+if ! timeout 2 $BIN 'x{0,4000}' /dev/null || ! timeout 2 $BIN 'x{0,16000}b' /dev/null; then
+    echo "FAILED: compiling a large counted repeat took too long"
+    FAILED=1
+fi
+
+# the leftmost match wins, even when a later one ends first
+check "axyx" "axyx" '(axy)?x' -o
+check "axyx" "axyx" '(axy)?x' -t
+check "1 abb1 1x cx " "1 abb1 1x cx " '((\d*.{2})*b{0,2})+\s{1,3}' -o
+# with only an empty match, -t prints it rather than the whole line
+check "" "hello world" 'a*a*' -t
+# -t and -o find the match the path search (and so -c) does, not the longest one
+check "a" "ab" 'a?(ab)?' -t
+check "a" "ab" 'a?(ab)?' -o
+check "a
+    [1]" "ab" 'a?(ab)?' -t -c
+check "xa
+x" "xaxb" 'x*a?' -o
+
+# the path search must not go round empty loops, or run out of stack on long lines, even with no budget
+check "ab
+    [1] a b" "ab" '(\D?)+\s{0,2}' -c --step-budget 0
+check "ab
+    [1] a b" "ab" '(\D?)+\s{0,2}' -c
+long=$(head -c 300000 /dev/zero | tr '\0' a)x
+got=$(printf '%s\n' "$long" | $BIN '(a+)x' -c --step-budget 0 | wc -l)
+if [ "$got" != "2" ]; then
+    echo "FAILED: (a+)x -c --step-budget 0 on a 300000 byte line"
+    FAILED=1
+fi
+# nor must the linear-time engine, following a long chain of empty edges on a small stack
+got=$(ulimit -s 128; printf 'xxb\n' | $BIN '(x?){1500}b' -c --step-budget 1 2>/dev/null)
+if [ "$got" != "$(printf 'xxb\n    [1] ')" ]; then
+    echo "FAILED: (x?){1500}b -c --step-budget 1 with 128KB of stack"
+    echo "  got:      '$got'"
+    FAILED=1
+fi
+
+# what a truncated gzip stream held before it was cut off is still searched
+gz=$(mktemp)
+printf 'one\nmatch here\nlast\n' | gzip > "$gz"
+got=$(head -c $(( $(stat -c %s "$gz") - 6 )) "$gz" | $BIN match 2>/dev/null)
+if [ "$got" != "match here" ]; then
+    echo "FAILED: the lines of a truncated gzip stream were not searched"
+    echo "  got:      '$got'"
+    FAILED=1
+fi
+rm -f "$gz"
+
+# a file name that is not valid UTF-8 is escaped in the JSON report, and one that is passes through
+dir=$(mktemp -d)
+printf 'hit\n' > "$dir/$(printf 'caf\xc3\xa9-\xff')"
+got=$($BIN hit --report=json -r "$dir" 2>&1 >/dev/null | grep -o '"name": "[^"]*"')
+if [ "$got" != "$(printf '"name": "%s/caf\xc3\xa9-\\u00ff"' "$dir")" ]; then
+    echo "FAILED: a file name that is not valid UTF-8 in the JSON report"
+    echo "  got:      '$got'"
+    FAILED=1
+fi
+rm -rf "$dir"
+
+# the C that --emit-c writes builds cleanly, and matches the same lines the tool does
+dir=$(mktemp -d)
+cat > "$dir/driver.c" <<'DRIVER'
+#include <stdio.h>
+#include <string.h>
+
+int mygrep_match(const char* buf, size_t len);
+
+int main(void) {
+    char line[4096];
+    while (fgets(line, sizeof(line), stdin)) {
+        size_t len = strcspn(line, "\n");
+        if (mygrep_match(line, len)) {
+            fwrite(line, 1, len, stdout);
+            fputc('\n', stdout);
+        }
+    }
+    return 0;
+}
+DRIVER
+lines='color12
+colour
+the colour3 is
+x1y
+^anchored
+anchored at the end
+naïve café
+ab
+'
+# check_emit_c <regex> [options...]
+check_emit_c() {
+    if ! $BIN --emit-c "$@" > "$dir/match.c" ||
+       ! cc -Wall -Werror -o "$dir/match" "$dir/match.c" "$dir/driver.c"; then
+        echo "FAILED: the C emitted for $* does not build"
+        FAILED=1
+        return
+    fi
+    local expected got
+    expected=$(printf '%s' "$lines" | $BIN "$@")
+    got=$(printf '%s' "$lines" | "$dir/match")
+    if [ "$got" != "$expected" ]; then
+        echo "FAILED: the C emitted for $* matches different lines"
+        echo "  expected: '$expected'"
+        echo "  got:      '$got'"
+        FAILED=1
+    fi
+}
+for regex in 'colou?r\d+' '^\w+\d?$' 'end$' '^a' '[éï]' 'x\d*y' '(ab)+'; do
+    check_emit_c "$regex"
+done
+check_emit_c 'f.$' -u
+check_emit_c '[éï]v' -u
+rm -rf "$dir"
+
+# a followed file is searched as it grows, even a line at a time, and after it is truncated or rotated
+dir=$(mktemp -d)
+log="$dir/log"
+printf 'old hit\n' > "$log"
+$BIN hit -f "$log" > "$dir/out" 2>/dev/null &
+follower=$!
+# wait_for_lines <n>: give the follower a couple of seconds to have printed n lines
+wait_for_lines() {
+    for i in $(seq 20); do
+        [ "$(wc -l < "$dir/out")" -ge "$1" ] && return
+        sleep 0.1
+    done
+}
+wait_for_lines 1
+printf 'new hit\nmiss\n' >> "$log"
+printf 'half of a ' >> "$log"
+wait_for_lines 2
+printf 'hit\n' >> "$log"
+wait_for_lines 3
+: > "$log"
+sleep 0.2
+printf 'hit after truncating\n' >> "$log"
+wait_for_lines 4
+mv "$log" "$log.1"
+printf 'last hit before rotating\n' >> "$log.1"
+printf 'hit after rotating\n' > "$log"
+wait_for_lines 6
+kill $follower
+wait $follower 2>/dev/null
+expected='old hit
+new hit
+half of a hit
+hit after truncating
+last hit before rotating
+hit after rotating'
+if [ "$(cat "$dir/out")" != "$expected" ]; then
+    echo "FAILED: -f did not print what was written to the file"
+    echo "  got:      '$(cat "$dir/out")'"
+    FAILED=1
+fi
+rm -rf "$dir"
+
+# the index rules out files, but never one that -r finds a match in
+dir=$(mktemp -d)
+mkdir "$dir/sub"
+printf 'the color red\nnothing\n' > "$dir/a.txt"
+printf 'colour blue\n' > "$dir/sub/b.txt"
+printf 'bat and bit\n' > "$dir/c.txt"
+printf 'foo123bar\nabababc\n' > "$dir/sub/d.txt"
+printf 'plain\n' > "$dir/e.txt"
+$BIN --index "$dir.idx" "$dir"
+for regex in 'colou?r' 'b[aeiou]t' 'foo\d+bar' '\d+' '(ab)*c' 'r.d' 'lue$' '^pla' 'x?yz'; do
+    missing=$(comm -23 <($BIN "$regex" -r "$dir" | cut -d: -f1 | sort -u) \
+                       <($BIN "$regex" --use-index="$dir.idx" | cut -d: -f1 | sort -u))
+    if [ -n "$missing" ]; then
+        echo "FAILED: --use-index left out files -r matches '$regex' in: $missing"
+        FAILED=1
+    fi
+done
+rm -rf "$dir" "$dir.idx"
+
+# the server keeps its socket to itself, and tells the client why its regex does not compile
+sock=$(mktemp -u)
+$BIN --serve "$sock" 2>/dev/null &
+server=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    [ -S "$sock" ] && break
+    sleep 0.1
+done
+if [ "$(stat -c %a "$sock")" != "600" ]; then
+    echo "FAILED: the server's socket is not 0600"
+    FAILED=1
+fi
+got=$(echo abc | $BIN --client "$sock" '(b' 2>&1)
+if [ "$got" = "${got#ERROR: unclosed}" ]; then
+    echo "FAILED: the client was not told why its regex does not compile"
+    echo "  got:      '$got'"
+    FAILED=1
+fi
+kill $server
+rm -f "$sock"
+
+if [ $FAILED -ne 0 ]; then
+    exit 1
+fi
+echo "All checks passed"